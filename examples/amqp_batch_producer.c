@@ -0,0 +1,161 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Publishes message_count messages to amq.direct once without batching and
+ * then with amqp_set_publish_batching() at a range of batch sizes, and
+ * reports the publish rate for each.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <amqp_tcp_socket.h>
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "utils.h"
+
+#define MAX_BATCH_BYTES (1024 * 1024)
+
+static const int batch_sizes[] = { 1, 8, 32, 128, 512 };
+
+static void send_messages(amqp_connection_state_t conn,
+                          char const *queue_name,
+                          int batch_size,
+                          int message_count,
+                          amqp_bytes_t message_bytes)
+{
+  uint64_t start_time;
+  uint64_t total_delta;
+  int i;
+
+  if (batch_size > 1) {
+    die_on_error(amqp_set_publish_batching(conn, MAX_BATCH_BYTES, batch_size,
+                                           NULL),
+                 "Enabling batching");
+  } else {
+    die_on_error(amqp_set_publish_batching(conn, 0, 0, NULL),
+                 "Disabling batching");
+  }
+
+  start_time = now_microseconds();
+
+  for (i = 0; i < message_count; i++) {
+    die_on_error(amqp_basic_publish(conn,
+                                    1,
+                                    amqp_cstring_bytes("amq.direct"),
+                                    amqp_cstring_bytes(queue_name),
+                                    0,
+                                    0,
+                                    NULL,
+                                    message_bytes),
+                 "Publishing");
+  }
+  die_on_error(amqp_flush(conn), "Flushing");
+
+  total_delta = now_microseconds() - start_time;
+
+  printf("batch size %4d: %d messages in %d ms, %g messages-per-second\n",
+         batch_size, message_count, (int)(total_delta / 1000),
+         message_count / (total_delta / 1000000.0));
+}
+
+int main(int argc, char const *const *argv)
+{
+  char const *hostname;
+  int port, status;
+  int message_count;
+  int message_size = 256;
+  char *message;
+  amqp_bytes_t message_bytes;
+  amqp_socket_t *socket = NULL;
+  amqp_connection_state_t conn;
+  int i;
+
+  if (argc < 4) {
+    fprintf(stderr, "Usage: amqp_batch_producer host port message_count [message_size]\n");
+    return 1;
+  }
+
+  hostname = argv[1];
+  port = atoi(argv[2]);
+  message_count = atoi(argv[3]);
+  if (argc > 4) {
+    message_size = atoi(argv[4]);
+  }
+
+  message = malloc(message_size);
+  if (!message) {
+    die("allocating message");
+  }
+  for (i = 0; i < message_size; i++) {
+    message[i] = i & 0xff;
+  }
+  message_bytes.len = message_size;
+  message_bytes.bytes = message;
+
+  conn = amqp_new_connection();
+
+  socket = amqp_tcp_socket_new();
+  if (!socket) {
+    die("creating TCP socket");
+  }
+
+  status = amqp_socket_open(socket, hostname, port);
+  if (status) {
+    die("opening TCP socket");
+  }
+
+  amqp_set_socket(conn, socket);
+  die_on_amqp_error(amqp_login(conn, "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, "guest", "guest"),
+                    "Logging in");
+  amqp_channel_open(conn, 1);
+  die_on_amqp_error(amqp_get_rpc_reply(conn), "Opening channel");
+
+  for (i = 0; i < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); i++) {
+    send_messages(conn, "test queue", batch_sizes[i], message_count,
+                  message_bytes);
+  }
+
+  die_on_amqp_error(amqp_channel_close(conn, 1, AMQP_REPLY_SUCCESS), "Closing channel");
+  die_on_amqp_error(amqp_connection_close(conn, AMQP_REPLY_SUCCESS), "Closing connection");
+  die_on_error(amqp_destroy_connection(conn), "Ending connection");
+  free(message);
+  return 0;
+}
@@ -43,8 +43,6 @@
 #include <amqp.h>
 #include <amqp_framing.h>
 
-#include <assert.h>
-
 #include "utils.h"
 
 #define SUMMARY_EVERY_US 1000000
@@ -59,12 +57,12 @@ static void run(amqp_connection_state_t conn)
 
   amqp_frame_t frame;
   int result;
-  size_t body_received;
-  size_t body_target;
 
   uint64_t now;
 
   while (1) {
+    amqp_envelope_t envelope;
+
     now = now_microseconds();
     if (now > next_summary_time) {
       int countOverInterval = received - previous_received;
@@ -78,47 +76,20 @@ static void run(amqp_connection_state_t conn)
     }
 
     amqp_maybe_release_buffers(conn);
-    result = amqp_simple_wait_frame(conn, &frame);
-    if (result < 0) {
-      return;
-    }
-
-    if (frame.frame_type != AMQP_FRAME_METHOD) {
-      continue;
-    }
-
-    if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
-      continue;
-    }
-
-    result = amqp_simple_wait_frame(conn, &frame);
-    if (result < 0) {
-      return;
-    }
-
-    if (frame.frame_type != AMQP_FRAME_HEADER) {
-      fprintf(stderr, "Expected header!");
-      abort();
-    }
-
-    body_target = frame.payload.properties.body_size;
-    body_received = 0;
-
-    while (body_received < body_target) {
+    result = amqp_consume_message(conn, &envelope, NULL);
+    if (AMQP_STATUS_UNEXPECTED_STATE == result) {
+      /* Something other than a delivery, e.g. a heartbeat: skip it */
       result = amqp_simple_wait_frame(conn, &frame);
       if (result < 0) {
         return;
       }
-
-      if (frame.frame_type != AMQP_FRAME_BODY) {
-        fprintf(stderr, "Expected body!");
-        abort();
-      }
-
-      body_received += frame.payload.body_fragment.len;
-      assert(body_received <= body_target);
+      continue;
+    }
+    if (result < 0) {
+      return;
     }
 
+    amqp_destroy_envelope(&envelope);
     received++;
   }
 }
@@ -0,0 +1,415 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Exercises the memory pools without a broker:
+ *
+ *  - feeds the frames a consumer sees when it connects, opens a number of
+ *    channels and receives a message on each, then closes them, through
+ *    amqp_handle_input(). Buffers are released after each frame as a
+ *    consumer loop would. Reports the time and the minor page faults per
+ *    connection, which is where zeroing whole pool pages shows.
+ *  - feeds many deliveries on one channel without releasing buffers, as
+ *    when frames queue up behind an RPC, with the smallest frame_max so
+ *    the channel pool grows by many pages.
+ *  - decodes a table of many small nested tables into a fresh pool.
+ *
+ * The last two also report heap calls, counted by interposing malloc on
+ * glibc only.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+
+#include "utils.h"
+
+#define FRAME_MAX 131072
+#define BODY_SIZE 1024
+#define QUEUED_FRAMES 1000000
+#define TABLE_ENTRIES 20000
+#define TABLE_DECODES 50
+
+static char frame_buffer[FRAME_MAX];
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long malloc_calls = 0;
+static unsigned long realloc_calls = 0;
+
+/* the build hides symbols by default, these have to override libc's */
+#define INTERPOSE __attribute__ ((visibility ("default")))
+
+INTERPOSE void *malloc(size_t size)
+{
+  malloc_calls++;
+  return __libc_malloc(size);
+}
+
+INTERPOSE void *calloc(size_t nmemb, size_t size)
+{
+  malloc_calls++;
+  return __libc_calloc(nmemb, size);
+}
+
+INTERPOSE void *realloc(void *ptr, size_t size)
+{
+  realloc_calls++;
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+static void print_heap_calls(unsigned long mallocs, unsigned long reallocs,
+                             int per, const char *unit)
+{
+#ifdef __GLIBC__
+  printf("  heap allocations: %.4f, reallocs: %.4f per %s\n",
+         (double)mallocs / per, (double)reallocs / per, unit);
+#else
+  (void)mallocs;
+  (void)reallocs;
+  (void)per;
+  (void)unit;
+#endif
+}
+
+static void put16(char *p, uint16_t v)
+{
+  p[0] = (char)(v >> 8);
+  p[1] = (char)v;
+}
+
+static void put32(char *p, uint32_t v)
+{
+  put16(p, (uint16_t)(v >> 16));
+  put16(p + 2, (uint16_t)v);
+}
+
+static void put64(char *p, uint64_t v)
+{
+  put32(p, (uint32_t)(v >> 32));
+  put32(p + 4, (uint32_t)v);
+}
+
+static void feed(amqp_connection_state_t conn, char *data, size_t len)
+{
+  amqp_bytes_t input;
+
+  input.bytes = data;
+  input.len = len;
+
+  while (input.len > 0) {
+    amqp_frame_t frame;
+    int res = amqp_handle_input(conn, input, &frame);
+
+    die_on_error(res, "Handling input");
+    input.bytes = (char *)input.bytes + res;
+    input.len -= res;
+  }
+}
+
+/* Wraps payload_len bytes already at frame_buffer + 7 in a frame,
+ * returns the frame size */
+static size_t wrap_frame(uint8_t type, amqp_channel_t channel,
+                         size_t payload_len)
+{
+  frame_buffer[0] = (char)type;
+  put16(frame_buffer + 1, channel);
+  put32(frame_buffer + 3, (uint32_t)payload_len);
+  frame_buffer[7 + payload_len] = (char)AMQP_FRAME_END;
+
+  return 7 + payload_len + 1;
+}
+
+static size_t wrap_method(amqp_channel_t channel, amqp_method_number_t id,
+                          void *decoded)
+{
+  amqp_bytes_t encoded;
+  int len;
+
+  put32(frame_buffer + 7, id);
+  encoded.bytes = frame_buffer + 11;
+  encoded.len = sizeof(frame_buffer) - 12;
+  len = amqp_encode_method(id, decoded, encoded);
+  die_on_error(len, "Encoding method");
+  return wrap_frame(AMQP_FRAME_METHOD, channel, 4 + len);
+}
+
+static void feed_frame(amqp_connection_state_t conn, uint8_t type,
+                       amqp_channel_t channel, size_t payload_len)
+{
+  feed(conn, frame_buffer, wrap_frame(type, channel, payload_len));
+  amqp_maybe_release_buffers_on_channel(conn, channel);
+}
+
+static void feed_method(amqp_connection_state_t conn, amqp_channel_t channel,
+                        amqp_method_number_t id, void *decoded)
+{
+  feed(conn, frame_buffer, wrap_method(channel, id, decoded));
+  amqp_maybe_release_buffers_on_channel(conn, channel);
+}
+
+static amqp_connection_state_t open_connection(int frame_max)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  char protocol_header[] = "AMQP\0\0\x09\x01";
+
+  if (conn == NULL) {
+    die("Allocating connection");
+  }
+
+  feed(conn, protocol_header, 8);
+  die_on_error(amqp_tune_connection(conn, 0, frame_max, 0),
+               "Tuning connection");
+  return conn;
+}
+
+static void run_connection(int channels)
+{
+  amqp_connection_state_t conn = open_connection(FRAME_MAX);
+  amqp_channel_open_ok_t open_ok;
+  amqp_basic_deliver_t deliver;
+  amqp_channel_close_ok_t close_ok;
+  amqp_connection_open_ok_t connection_open_ok;
+  int i;
+
+  connection_open_ok.known_hosts = amqp_empty_bytes;
+  feed_method(conn, 0, AMQP_CONNECTION_OPEN_OK_METHOD, &connection_open_ok);
+
+  open_ok.channel_id = amqp_empty_bytes;
+  deliver.consumer_tag = amqp_cstring_bytes("amq.ctag-bench");
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("amq.direct");
+  deliver.routing_key = amqp_cstring_bytes("bench");
+  close_ok.dummy = 0;
+
+  for (i = 1; i <= channels; i++) {
+    amqp_channel_t channel = (amqp_channel_t)i;
+
+    feed_method(conn, channel, AMQP_CHANNEL_OPEN_OK_METHOD, &open_ok);
+
+    deliver.delivery_tag = i;
+    feed_method(conn, channel, AMQP_BASIC_DELIVER_METHOD, &deliver);
+
+    /* content header: class, weight, body size and no properties */
+    put16(frame_buffer + 7, AMQP_BASIC_CLASS);
+    put16(frame_buffer + 9, 0);
+    put64(frame_buffer + 11, BODY_SIZE);
+    put16(frame_buffer + 19, 0);
+    feed_frame(conn, AMQP_FRAME_HEADER, channel, 14);
+
+    memset(frame_buffer + 7, 'x', BODY_SIZE);
+    feed_frame(conn, AMQP_FRAME_BODY, channel, BODY_SIZE);
+
+    feed_method(conn, channel, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  }
+
+  die_on_error(amqp_destroy_connection(conn), "Destroying connection");
+}
+
+static void bench_queued_frames(void)
+{
+  amqp_connection_state_t conn = open_connection(AMQP_FRAME_MIN_SIZE);
+  amqp_basic_deliver_t deliver;
+  size_t frame_size;
+  unsigned long mallocs = 0;
+  unsigned long reallocs = 0;
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  deliver.consumer_tag = amqp_cstring_bytes("amq.ctag-bench");
+  deliver.delivery_tag = 1;
+  deliver.redelivered = 0;
+  deliver.exchange = amqp_cstring_bytes("amq.direct");
+  deliver.routing_key = amqp_cstring_bytes("bench");
+  frame_size = wrap_method(1, AMQP_BASIC_DELIVER_METHOD, &deliver);
+
+#ifdef __GLIBC__
+  mallocs = malloc_calls;
+  reallocs = realloc_calls;
+#endif
+  start = now_microseconds();
+
+  for (i = 0; i < QUEUED_FRAMES; i++) {
+    feed(conn, frame_buffer, frame_size);
+  }
+  die_on_error(amqp_destroy_connection(conn), "Destroying connection");
+
+  elapsed = now_microseconds() - start;
+#ifdef __GLIBC__
+  mallocs = malloc_calls - mallocs;
+  reallocs = realloc_calls - reallocs;
+#endif
+
+  printf("%d unreleased %d byte frames, frame_max %d: %.1f ns per frame\n",
+         QUEUED_FRAMES, (int)frame_size, AMQP_FRAME_MIN_SIZE,
+         elapsed * 1000.0 / QUEUED_FRAMES);
+  print_heap_calls(mallocs, reallocs, QUEUED_FRAMES, "frame");
+}
+
+static void bench_large_table(void)
+{
+  amqp_table_entry_t *entries;
+  amqp_table_entry_t inner_entries[4];
+  amqp_table_t table;
+  amqp_bytes_t encoded;
+  size_t offset = 0;
+  unsigned long mallocs = 0;
+  unsigned long reallocs = 0;
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    inner_entries[i].key = amqp_cstring_bytes("inner");
+    inner_entries[i].value.kind = AMQP_FIELD_KIND_I32;
+    inner_entries[i].value.value.i32 = i;
+  }
+
+  entries = malloc(TABLE_ENTRIES * sizeof(amqp_table_entry_t));
+  if (entries == NULL) {
+    die("Allocating table");
+  }
+  /* every key is the same, the decoder does not care */
+  for (i = 0; i < TABLE_ENTRIES; i++) {
+    entries[i].key = amqp_cstring_bytes("x-key");
+    entries[i].value.kind = AMQP_FIELD_KIND_TABLE;
+    entries[i].value.value.table.num_entries = 4;
+    entries[i].value.value.table.entries = inner_entries;
+  }
+  table.num_entries = TABLE_ENTRIES;
+  table.entries = entries;
+
+  encoded = amqp_bytes_malloc(TABLE_ENTRIES * 64);
+  if (encoded.bytes == NULL) {
+    die("Allocating encode buffer");
+  }
+  die_on_error(amqp_encode_table(encoded, &table, &offset), "Encoding table");
+  encoded.len = offset;
+
+#ifdef __GLIBC__
+  mallocs = malloc_calls;
+  reallocs = realloc_calls;
+#endif
+  start = now_microseconds();
+
+  for (i = 0; i < TABLE_DECODES; i++) {
+    amqp_pool_t pool;
+    amqp_table_t decoded;
+
+    offset = 0;
+    init_amqp_pool(&pool, AMQP_FRAME_MIN_SIZE);
+    die_on_error(amqp_decode_table(encoded, &pool, &decoded, &offset),
+                 "Decoding table");
+    empty_amqp_pool(&pool);
+  }
+
+  elapsed = now_microseconds() - start;
+#ifdef __GLIBC__
+  mallocs = malloc_calls - mallocs;
+  reallocs = realloc_calls - reallocs;
+#endif
+
+  printf("%d decodes of a table of %d nested tables into a fresh pool: "
+         "%.1f us per decode\n",
+         TABLE_DECODES, TABLE_ENTRIES, (double)elapsed / TABLE_DECODES);
+  print_heap_calls(mallocs, reallocs, TABLE_DECODES, "decode");
+
+  amqp_bytes_free(encoded);
+  free(entries);
+}
+
+static long minor_faults(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_minflt;
+}
+
+int main(int argc, char const *const *argv)
+{
+  int connections = 1000;
+  int channels = 64;
+  long faults;
+  uint64_t start;
+  uint64_t elapsed;
+  int i;
+
+  if (argc > 1) {
+    connections = atoi(argv[1]);
+  }
+  if (argc > 2) {
+    channels = atoi(argv[2]);
+  }
+  if (connections <= 0 || channels <= 0 || channels > 65535) {
+    die("usage: %s [connections] [channels per connection]", argv[0]);
+  }
+
+  /* the first connection warms up the allocator */
+  run_connection(channels);
+
+  faults = minor_faults();
+  start = now_microseconds();
+
+  for (i = 0; i < connections; i++) {
+    run_connection(channels);
+  }
+
+  elapsed = now_microseconds() - start;
+  faults = minor_faults() - faults;
+
+  printf("%d connections of %d channels, frame_max %d: %.1f us per connection\n",
+         connections, channels, FRAME_MAX, (double)elapsed / connections);
+  printf("minor page faults per connection: %.1f\n",
+         (double)faults / connections);
+
+  bench_queued_frames();
+  bench_large_table();
+
+  return 0;
+}
@@ -0,0 +1,180 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Decodes a typical headers table (30 entries, one nested table and one
+ * array) repeatedly and reports the time and heap allocations per decode.
+ * Allocations are counted by interposing malloc on glibc only.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <amqp.h>
+
+#include "utils.h"
+
+#define NUM_ENTRIES 30
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long malloc_calls = 0;
+
+/* the build hides symbols by default, these have to override libc's */
+#define INTERPOSE __attribute__ ((visibility ("default")))
+
+INTERPOSE void *malloc(size_t size)
+{
+  malloc_calls++;
+  return __libc_malloc(size);
+}
+
+INTERPOSE void *calloc(size_t nmemb, size_t size)
+{
+  malloc_calls++;
+  return __libc_calloc(nmemb, size);
+}
+
+INTERPOSE void *realloc(void *ptr, size_t size)
+{
+  malloc_calls++;
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+static size_t encode_headers(amqp_bytes_t buffer)
+{
+  amqp_table_entry_t entries[NUM_ENTRIES];
+  amqp_table_entry_t inner_entries[4];
+  amqp_field_value_t inner_values[4];
+  amqp_table_t table;
+  char keys[NUM_ENTRIES][16];
+  size_t offset = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    inner_entries[i].key = amqp_cstring_bytes("inner");
+    inner_entries[i].value.kind = AMQP_FIELD_KIND_I32;
+    inner_entries[i].value.value.i32 = i;
+
+    inner_values[i].kind = AMQP_FIELD_KIND_UTF8;
+    inner_values[i].value.bytes = amqp_cstring_bytes("element");
+  }
+
+  for (i = 0; i < NUM_ENTRIES; i++) {
+    sprintf(keys[i], "x-header-%d", i);
+    entries[i].key = amqp_cstring_bytes(keys[i]);
+    entries[i].value.kind = AMQP_FIELD_KIND_UTF8;
+    entries[i].value.value.bytes = amqp_cstring_bytes("some header value");
+  }
+
+  entries[0].value.kind = AMQP_FIELD_KIND_TABLE;
+  entries[0].value.value.table.num_entries = 4;
+  entries[0].value.value.table.entries = inner_entries;
+
+  entries[1].value.kind = AMQP_FIELD_KIND_ARRAY;
+  entries[1].value.value.array.num_entries = 4;
+  entries[1].value.value.array.entries = inner_values;
+
+  entries[2].value.kind = AMQP_FIELD_KIND_TIMESTAMP;
+  entries[2].value.value.u64 = 1234567890;
+
+  table.num_entries = NUM_ENTRIES;
+  table.entries = entries;
+
+  die_on_error(amqp_encode_table(buffer, &table, &offset), "Encoding table");
+  return offset;
+}
+
+int main(int argc, char const *const *argv)
+{
+  char encoded_buffer[4096];
+  amqp_bytes_t encoded;
+  amqp_pool_t pool;
+  unsigned long mallocs_before = 0;
+  unsigned long mallocs = 0;
+  uint64_t start;
+  uint64_t elapsed;
+  int iterations = 1000000;
+  int i;
+
+  if (argc > 1) {
+    iterations = atoi(argv[1]);
+  }
+
+  encoded.bytes = encoded_buffer;
+  encoded.len = sizeof(encoded_buffer);
+  encoded.len = encode_headers(encoded);
+
+  init_amqp_pool(&pool, 65536);
+
+#ifdef __GLIBC__
+  mallocs_before = malloc_calls;
+#endif
+  start = now_microseconds();
+
+  for (i = 0; i < iterations; i++) {
+    amqp_table_t decoded;
+    size_t offset = 0;
+
+    die_on_error(amqp_decode_table(encoded, &pool, &decoded, &offset),
+                 "Decoding table");
+    recycle_amqp_pool(&pool);
+  }
+
+  elapsed = now_microseconds() - start;
+#ifdef __GLIBC__
+  mallocs = malloc_calls - mallocs_before;
+#endif
+
+  printf("%d decodes of a %d entry table (%d bytes): %.1f ns per decode\n",
+         iterations, NUM_ENTRIES, (int)encoded.len,
+         elapsed * 1000.0 / iterations);
+#ifdef __GLIBC__
+  printf("heap allocations per decode: %.2f\n", (double)mallocs / iterations);
+#else
+  (void)mallocs;
+  printf("heap allocations are only counted on glibc\n");
+#endif
+
+  empty_amqp_pool(&pool);
+  return 0;
+}
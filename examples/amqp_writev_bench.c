@@ -0,0 +1,289 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Compares ways of writing AMQP body frames (frame header, payload, frame
+ * end byte) to a local socketpair that a child process drains:
+ *
+ *  - one send() per part, with MSG_MORE where available
+ *  - copying the parts into one buffer and a single send()
+ *  - a single sendmsg() over the three parts
+ *  - a single sendmsg() over 64 frames at a time
+ *
+ * and reports the syscalls per frame and the throughput for each.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <amqp.h>
+
+#include "utils.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define FRAMES_PER_SENDMSG 64
+
+static int sockfd;
+static unsigned long syscalls;
+static char *copy_buffer;
+
+static void send_all(const void *buf, size_t len, int flags)
+{
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t res = send(sockfd, p, len, flags | MSG_NOSIGNAL);
+    syscalls++;
+    if (res < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      die("send: %s", strerror(errno));
+    }
+    p += res;
+    len -= res;
+  }
+}
+
+static void sendmsg_all(struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+
+  while (iovcnt > 0) {
+    ssize_t res;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    res = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    syscalls++;
+    if (res < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      die("sendmsg: %s", strerror(errno));
+    }
+
+    /* resume after a partial write */
+    while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + res;
+      iov->iov_len -= res;
+    }
+  }
+}
+
+static void frame_header(unsigned char *header, size_t payload_len)
+{
+  header[0] = AMQP_FRAME_BODY;
+  header[1] = 0;
+  header[2] = 1;
+  header[3] = (payload_len >> 24) & 0xff;
+  header[4] = (payload_len >> 16) & 0xff;
+  header[5] = (payload_len >> 8) & 0xff;
+  header[6] = payload_len & 0xff;
+}
+
+static void send_parts(const void *payload, size_t payload_len, int frames)
+{
+  unsigned char header[7];
+  unsigned char frame_end = AMQP_FRAME_END;
+  int flags = 0;
+  int i;
+
+#ifdef MSG_MORE
+  flags = MSG_MORE;
+#endif
+
+  frame_header(header, payload_len);
+  for (i = 0; i < frames; i++) {
+    send_all(header, sizeof(header), flags);
+    send_all(payload, payload_len, flags);
+    send_all(&frame_end, 1, 0);
+  }
+}
+
+static void send_copy(const void *payload, size_t payload_len, int frames)
+{
+  int i;
+
+  for (i = 0; i < frames; i++) {
+    frame_header((unsigned char *)copy_buffer, payload_len);
+    memcpy(copy_buffer + 7, payload, payload_len);
+    copy_buffer[7 + payload_len] = (char)AMQP_FRAME_END;
+    send_all(copy_buffer, payload_len + 8, 0);
+  }
+}
+
+static void send_vectored(const void *payload, size_t payload_len, int frames)
+{
+  unsigned char header[7];
+  unsigned char frame_end = AMQP_FRAME_END;
+  struct iovec iov[3];
+  int i;
+
+  frame_header(header, payload_len);
+  for (i = 0; i < frames; i++) {
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payload_len;
+    iov[2].iov_base = &frame_end;
+    iov[2].iov_len = 1;
+    sendmsg_all(iov, 3);
+  }
+}
+
+static void send_vectored_batch(const void *payload, size_t payload_len,
+                                int frames)
+{
+  unsigned char header[7];
+  unsigned char frame_end = AMQP_FRAME_END;
+  struct iovec iov[3 * FRAMES_PER_SENDMSG];
+  int i;
+  int n = 0;
+
+  frame_header(header, payload_len);
+  for (i = 0; i < frames; i++) {
+    iov[n].iov_base = header;
+    iov[n].iov_len = sizeof(header);
+    iov[n + 1].iov_base = (void *)payload;
+    iov[n + 1].iov_len = payload_len;
+    iov[n + 2].iov_base = &frame_end;
+    iov[n + 2].iov_len = 1;
+    n += 3;
+
+    if (n == 3 * FRAMES_PER_SENDMSG || i == frames - 1) {
+      sendmsg_all(iov, n);
+      n = 0;
+    }
+  }
+}
+
+struct strategy {
+  const char *name;
+  void (*send_frames)(const void *payload, size_t payload_len, int frames);
+};
+
+static const struct strategy strategies[] = {
+  { "send per part", send_parts },
+  { "copy + send", send_copy },
+  { "sendmsg", send_vectored },
+  { "sendmsg x64", send_vectored_batch }
+};
+
+static const size_t payload_sizes[] = { 256, 4096, 131064 };
+
+int main(int argc, char const *const *argv)
+{
+  size_t total_bytes = 256 * 1024 * 1024;
+  char *payload;
+  int sv[2];
+  pid_t child;
+  size_t i;
+  size_t j;
+
+  if (argc > 1) {
+    total_bytes = (size_t)atoi(argv[1]) * 1024 * 1024;
+  }
+
+  payload = calloc(1, payload_sizes[2]);
+  copy_buffer = malloc(payload_sizes[2] + 8);
+  if (!payload || !copy_buffer) {
+    die("allocating buffers");
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair: %s", strerror(errno));
+  }
+
+  child = fork();
+  if (child < 0) {
+    die("fork: %s", strerror(errno));
+  }
+  if (0 == child) {
+    char drain[65536];
+    close(sv[0]);
+    while (read(sv[1], drain, sizeof(drain)) > 0)
+      ;
+    _exit(0);
+  }
+  close(sv[1]);
+  sockfd = sv[0];
+
+  for (i = 0; i < sizeof(payload_sizes) / sizeof(payload_sizes[0]); i++) {
+    int frames = (int)(total_bytes / payload_sizes[i]);
+
+    for (j = 0; j < sizeof(strategies) / sizeof(strategies[0]); j++) {
+      uint64_t start;
+      uint64_t elapsed;
+
+      syscalls = 0;
+      start = now_microseconds();
+      strategies[j].send_frames(payload, payload_sizes[i], frames);
+      elapsed = now_microseconds() - start;
+
+      printf("%6d byte frames, %-13s: %5.2f syscalls/frame, %8.1f ns/frame, %7.1f MB/s\n",
+             (int)payload_sizes[i], strategies[j].name,
+             (double)syscalls / frames, elapsed * 1000.0 / frames,
+             (double)frames * payload_sizes[i] / elapsed);
+    }
+  }
+
+  close(sockfd);
+  waitpid(child, NULL, 0);
+  free(payload);
+  free(copy_buffer);
+  return 0;
+}
@@ -0,0 +1,325 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+/*
+ * Compares two ways of handing a published message, laid out as the
+ * iovecs the library builds for it, to an OpenSSL stream that a child
+ * process decrypts and drains over a local socketpair:
+ *
+ *  - copying every part into one buffer and a single SSL_write()
+ *  - gathering small parts into full records and writing whole records
+ *    straight from the body, as amqp_ssl_socket_writev() does
+ *
+ * and reports the bytes copied per message and the throughput for each.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <amqp.h>
+
+#include "utils.h"
+
+#define FRAME_MAX 131072
+#define RECORD_SIZE SSL3_RT_MAX_PLAIN_LENGTH
+/* method and content header frames of a typical publish */
+#define PREFIX_SIZE 96
+
+static SSL *ssl;
+static unsigned long copied;
+static char *copy_buffer;
+static size_t copy_buffer_size;
+static char record[RECORD_SIZE];
+
+static void ssl_write_all(const void *buf, size_t len)
+{
+  if (SSL_write(ssl, buf, (int)len) <= 0) {
+    ERR_print_errors_fp(stderr);
+    die("SSL_write failed");
+  }
+}
+
+static void send_copy(struct iovec *iov, int iovcnt)
+{
+  size_t bytes = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    bytes += iov[i].iov_len;
+  }
+  if (copy_buffer_size < bytes) {
+    copy_buffer = realloc(copy_buffer, bytes);
+    if (!copy_buffer) {
+      die("allocating copy buffer");
+    }
+    copy_buffer_size = bytes;
+  }
+
+  bytes = 0;
+  for (i = 0; i < iovcnt; i++) {
+    memcpy(copy_buffer + bytes, iov[i].iov_base, iov[i].iov_len);
+    bytes += iov[i].iov_len;
+  }
+  copied += bytes;
+  ssl_write_all(copy_buffer, bytes);
+}
+
+static void send_gather(struct iovec *iov, int iovcnt)
+{
+  size_t staged = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    const char *p = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    while (len > 0) {
+      size_t n;
+
+      if (0 == staged && len >= RECORD_SIZE) {
+        n = len - len % RECORD_SIZE;
+        ssl_write_all(p, n);
+      } else {
+        n = RECORD_SIZE - staged;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(record + staged, p, n);
+        copied += n;
+        staged += n;
+        if (RECORD_SIZE == staged) {
+          ssl_write_all(record, staged);
+          staged = 0;
+        }
+      }
+      p += n;
+      len -= n;
+    }
+  }
+
+  if (staged > 0) {
+    ssl_write_all(record, staged);
+  }
+}
+
+struct strategy {
+  const char *name;
+  void (*send_message)(struct iovec *iov, int iovcnt);
+};
+
+static const struct strategy strategies[] = {
+  { "copy + SSL_write", send_copy },
+  { "record gather", send_gather }
+};
+
+static const size_t message_sizes[] = { 1024, 65536, 1048576 };
+
+/* Lays a message out the way amqp_basic_publish() does: the method and
+ * header frames from the connection's buffer, then each body frame as its
+ * payload between frame header and frame end glue */
+static int build_iovecs(struct iovec *iov, char *prefix, char *glue,
+                        const char *body, size_t body_len)
+{
+  size_t chunk = FRAME_MAX - 8;
+  size_t offset;
+  int n = 0;
+
+  iov[n].iov_base = prefix;
+  iov[n++].iov_len = PREFIX_SIZE;
+  for (offset = 0; offset < body_len; offset += chunk) {
+    if (chunk > body_len - offset) {
+      chunk = body_len - offset;
+    }
+    iov[n].iov_base = glue;
+    iov[n++].iov_len = 0 == offset ? 7 : 8;
+    iov[n].iov_base = (char *)body + offset;
+    iov[n++].iov_len = chunk;
+  }
+  iov[n].iov_base = glue;
+  iov[n++].iov_len = 1;
+  return n;
+}
+
+static void make_certificate(EVP_PKEY **pkey, X509 **cert)
+{
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+
+  *pkey = NULL;
+  if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0
+      || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0
+      || EVP_PKEY_keygen(ctx, pkey) <= 0) {
+    die("generating key");
+  }
+  EVP_PKEY_CTX_free(ctx);
+
+  *cert = X509_new();
+  if (!*cert) {
+    die("allocating certificate");
+  }
+  ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(*cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(*cert), 3600);
+  X509_set_pubkey(*cert, *pkey);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(*cert), "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(*cert, X509_get_subject_name(*cert));
+  if (!X509_sign(*cert, *pkey, EVP_sha256())) {
+    die("signing certificate");
+  }
+}
+
+static void serve(int fd)
+{
+  SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+  EVP_PKEY *pkey;
+  X509 *cert;
+  SSL *server;
+  char drain[65536];
+
+  make_certificate(&pkey, &cert);
+  if (!ctx || 1 != SSL_CTX_use_certificate(ctx, cert)
+      || 1 != SSL_CTX_use_PrivateKey(ctx, pkey)) {
+    die("setting up server context");
+  }
+  server = SSL_new(ctx);
+  if (!server || !SSL_set_fd(server, fd) || SSL_accept(server) <= 0) {
+    ERR_print_errors_fp(stderr);
+    die("SSL_accept failed");
+  }
+  while (SSL_read(server, drain, sizeof(drain)) > 0)
+    ;
+  _exit(0);
+}
+
+int main(int argc, char const *const *argv)
+{
+  size_t total_bytes = 256 * 1024 * 1024;
+  char prefix[PREFIX_SIZE];
+  char glue[8];
+  struct iovec *iov;
+  SSL_CTX *ctx;
+  char *body;
+  int sv[2];
+  pid_t child;
+  size_t i;
+  size_t j;
+
+  if (argc > 1) {
+    total_bytes = (size_t)atoi(argv[1]) * 1024 * 1024;
+  }
+
+  SSL_library_init();
+  SSL_load_error_strings();
+
+  body = calloc(1, message_sizes[2]);
+  iov = calloc(2 * (message_sizes[2] / (FRAME_MAX - 8) + 1) + 2,
+               sizeof(struct iovec));
+  if (!body || !iov) {
+    die("allocating buffers");
+  }
+  memset(prefix, 0, sizeof(prefix));
+  memset(glue, 0, sizeof(glue));
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    die("socketpair: %s", strerror(errno));
+  }
+
+  child = fork();
+  if (child < 0) {
+    die("fork: %s", strerror(errno));
+  }
+  if (0 == child) {
+    close(sv[0]);
+    serve(sv[1]);
+  }
+  close(sv[1]);
+
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  ssl = ctx ? SSL_new(ctx) : NULL;
+  if (!ssl || !SSL_set_fd(ssl, sv[0]) || SSL_connect(ssl) <= 0) {
+    ERR_print_errors_fp(stderr);
+    die("SSL_connect failed");
+  }
+  printf("%s\n", SSL_get_cipher(ssl));
+
+  for (i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]); i++) {
+    int messages = (int)(total_bytes / message_sizes[i]);
+    int iovcnt = build_iovecs(iov, prefix, glue, body, message_sizes[i]);
+
+    for (j = 0; j < sizeof(strategies) / sizeof(strategies[0]); j++) {
+      uint64_t start;
+      uint64_t elapsed;
+      int k;
+
+      copied = 0;
+      start = now_microseconds();
+      for (k = 0; k < messages; k++) {
+        strategies[j].send_message(iov, iovcnt);
+      }
+      elapsed = now_microseconds() - start;
+
+      printf("%7d byte messages, %-16s: %8.0f bytes copied/message, %9.2f us/message, %7.1f MB/s\n",
+             (int)message_sizes[i], strategies[j].name,
+             (double)copied / messages, (double)elapsed / messages,
+             (double)messages * message_sizes[i] / elapsed);
+    }
+  }
+
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  close(sv[0]);
+  waitpid(child, NULL, 0);
+  free(body);
+  free(iov);
+  free(copy_buffer);
+  return 0;
+}
@@ -270,6 +270,7 @@ typedef enum {
 typedef struct amqp_pool_blocklist_t_ {
   int num_blocks;
   void **blocklist;
+  int capacity; /* entries allocated in blocklist */
 } amqp_pool_blocklist_t;
 
 typedef struct amqp_pool_t_ {
@@ -277,6 +278,11 @@ typedef struct amqp_pool_t_ {
 
   amqp_pool_blocklist_t pages;
   amqp_pool_blocklist_t large_blocks;
+  /* large blocks kept by recycle_amqp_pool() for reuse, see
+   * amqp_pool_set_large_cache() */
+  amqp_pool_blocklist_t large_cache;
+  size_t large_cache_bytes;
+  size_t large_cache_max;
 
   int next_page;
   char *alloc_block;
@@ -348,6 +354,8 @@ typedef enum amqp_status_enum_
   AMQP_STATUS_WRONG_METHOD =              -0x000C,
   AMQP_STATUS_TIMEOUT =                   -0x000D,
   AMQP_STATUS_TIMER_FAILURE =             -0x000E,
+  AMQP_STATUS_UNEXPECTED_STATE =          -0x000F,
+  AMQP_STATUS_UNSUPPORTED =               -0x0010,
 
   AMQP_STATUS_TCP_ERROR =                 -0x0100,
   AMQP_STATUS_TCP_SOCKETLIB_INIT_ERROR =  -0x0101,
@@ -385,6 +393,27 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL empty_amqp_pool(amqp_pool_t *pool);
 
+/*
+ * Sets how many bytes of large blocks, allocations bigger than the pool's
+ * page size, recycle_amqp_pool() keeps for reuse instead of freeing. Large
+ * blocks that fit are rounded up to the page size times a power of two, so
+ * that a block can be reused by any allocation of the same size class. Lowering the limit
+ * frees what no longer fits; 0 turns the cache off. Defaults to 1 MiB.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_pool_set_large_cache(amqp_pool_t *pool, size_t max_bytes);
+
+/*
+ * Frees the large blocks a pool keeps for reuse.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_pool_trim(amqp_pool_t *pool);
+
+/*
+ * Allocates memory from a pool. The memory is not zeroed.
+ */
 AMQP_PUBLIC_FUNCTION
 void *
 AMQP_CALL amqp_pool_alloc(amqp_pool_t *pool, size_t amount);
@@ -397,6 +426,11 @@ AMQP_PUBLIC_FUNCTION
 amqp_bytes_t
 AMQP_CALL amqp_cstring_bytes(char const *cstr);
 
+/*
+ * amqp_bytes_malloc_dup() and amqp_bytes_malloc() results are released with
+ * amqp_bytes_free(). Passing them to free() only works while neither
+ * amqp_set_allocator() nor allocation statistics are in use.
+ */
 AMQP_PUBLIC_FUNCTION
 amqp_bytes_t
 AMQP_CALL amqp_bytes_malloc_dup(amqp_bytes_t src);
@@ -409,6 +443,62 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL amqp_bytes_free(amqp_bytes_t bytes);
 
+/*
+ * Functions the library calls instead of malloc(), calloc(), realloc() and
+ * free(), each passed user_data. See amqp_set_allocator().
+ */
+typedef struct amqp_allocator_t_ {
+  void *(AMQP_CALL *malloc_fn)(void *user_data, size_t size);
+  void *(AMQP_CALL *calloc_fn)(void *user_data, size_t nmemb, size_t size);
+  void *(AMQP_CALL *realloc_fn)(void *user_data, void *ptr, size_t size);
+  void (AMQP_CALL *free_fn)(void *user_data, void *ptr);
+  void *user_data;
+} amqp_allocator_t;
+
+/*
+ * Routes all the memory the library allocates, for every connection,
+ * through allocator: pools, connection and socket state, TLS buffers and
+ * amqp_bytes_malloc(), whose result must then be freed with
+ * amqp_bytes_free(). Strings handed to the caller to free(), such as
+ * amqp_error_string()'s, still come from malloc(). NULL goes back to the C
+ * library.
+ *
+ * The allocator is process wide and copied. It must be set before the
+ * library allocates anything, or once everything it allocated is freed,
+ * and not while another thread is using the library.
+ *
+ * Returns AMQP_STATUS_INVALID_PARAMETER if a function is missing.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_allocator(const amqp_allocator_t *allocator);
+
+typedef struct amqp_allocation_stats_t_ {
+  const char *site;           /* source file and line, "file:line" */
+  uint64_t allocations;       /* includes reallocations made there */
+  uint64_t frees;             /* of memory allocated there */
+  uint64_t bytes_allocated;
+  uint64_t bytes_freed;
+} amqp_allocation_stats_t;
+
+/*
+ * Copies the allocation statistics of up to max_sites call sites in the
+ * library into stats, and returns the number of sites that have allocated
+ * so far, which may be more than max_sites. Statistics are only kept by
+ * libraries built with allocation statistics (the ENABLE_ALLOC_STATS CMake
+ * option or --enable-alloc-stats, both off by default); others return
+ * AMQP_STATUS_UNSUPPORTED.
+ *
+ * With statistics on, every block the library allocates starts with a
+ * hidden header, so memory it hands out, such as amqp_bytes_malloc() and
+ * amqp_bytes_malloc_dup() results, must go back through amqp_bytes_free()
+ * and never plain free().
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_get_allocation_stats(amqp_allocation_stats_t *stats,
+                                    int max_sites);
+
 AMQP_PUBLIC_FUNCTION
 amqp_connection_state_t
 AMQP_CALL amqp_new_connection(void);
@@ -438,6 +528,73 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_get_channel_max(amqp_connection_state_t state);
 
+/*
+ * When enabled, frames that arrive whole in a single socket read are
+ * decoded straight out of the socket buffer instead of being copied into
+ * the channel pool first. The frame's byte fields (body fragments, short
+ * strings, raw properties) then point into that buffer, which stays
+ * valid until the channel's buffers are released, exactly as for copied
+ * frames. Off by default.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_decode_in_place(amqp_connection_state_t state,
+                                   amqp_boolean_t decode_in_place);
+
+/*
+ * When enabled, content header frames are returned with
+ * payload.properties.decoded set to NULL and only payload.properties.raw
+ * filled in, skipping the cost of decoding properties (notably the headers
+ * table) that are never looked at. Decode them when needed with
+ * amqp_decode_frame_properties(). Off by default.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_lazy_properties(amqp_connection_state_t state,
+                                   amqp_boolean_t lazy_properties);
+
+/*
+ * Decodes the properties of a content header frame from its raw bytes into
+ * the channel's pool, setting payload.properties.decoded. Does nothing if
+ * they have already been decoded. The frame must still be valid, i.e. the
+ * channel's buffers must not have been released since it was received.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_decode_frame_properties(amqp_connection_state_t state,
+                                       amqp_frame_t *frame);
+
+/*
+ * Sets how the buffer used for reading from the socket is sized. It is
+ * allocated at min_size on the first read, doubles (up to max_size) each
+ * time a read fills it, and drops back to min_size once the connection goes
+ * quiet: when amqp_release_buffers() runs or a wait times out after reads
+ * that would have fit in min_size. Defaults to 4096 and 131072 bytes.
+ *
+ * Returns AMQP_STATUS_INVALID_PARAMETER unless 0 < min_size <= max_size.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_sock_inbound_buffer_policy(amqp_connection_state_t state,
+                                              size_t min_size,
+                                              size_t max_size);
+
+/*
+ * Number of bytes currently allocated for the socket read buffer.
+ */
+AMQP_PUBLIC_FUNCTION
+size_t
+AMQP_CALL amqp_get_sock_inbound_buffer_size(amqp_connection_state_t state);
+
+/*
+ * Number of bytes allocated for socket read buffers by all connections in
+ * the process, including replaced buffers still kept by frames decoded in
+ * place or by retained buffers.
+ */
+AMQP_PUBLIC_FUNCTION
+uint64_t
+AMQP_CALL amqp_get_sock_inbound_resident_bytes(void);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_destroy_connection(amqp_connection_state_t state);
@@ -464,6 +621,62 @@ AMQP_PUBLIC_FUNCTION
 void
 AMQP_CALL amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state, amqp_channel_t channel);
 
+typedef struct amqp_retained_buffers_t_ amqp_retained_buffers_t;
+
+/*
+ * Takes over the memory of the frames received on a channel since its
+ * buffers were last released, instead of releasing it: the frames, and
+ * everything decoded from them such as properties and body fragments, stay
+ * valid until the returned handle is released, without being copied. The
+ * channel then carries on as after amqp_maybe_release_buffers_on_channel(),
+ * reusing the pool pages it has to spare and allocating new ones as needed.
+ *
+ * This lets a message read frame by frame be handed to another thread. The
+ * handle holds one reference, may be passed between threads, and may
+ * outlive the connection.
+ *
+ * Returns AMQP_STATUS_UNEXPECTED_STATE, retaining nothing, when the
+ * buffers could not be released: in the middle of reading a frame, or
+ * while frames for the channel are queued.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_retain_buffers_on_channel(amqp_connection_state_t state,
+    amqp_channel_t channel,
+    amqp_retained_buffers_t **retained);
+
+/*
+ * Adds a reference to retained buffers. Safe to call from any thread.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_retained_buffers_add_ref(amqp_retained_buffers_t *retained);
+
+/*
+ * Drops a reference to retained buffers, freeing them with the last one.
+ * Safe to call from any thread.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_release_retained_buffers(amqp_retained_buffers_t *retained);
+
+/*
+ * Sets the limit of amqp_pool_set_large_cache() for the pools of all
+ * channels of the connection, including those created later.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_set_large_block_cache(amqp_connection_state_t state,
+                                     size_t max_bytes);
+
+/*
+ * Frees the large blocks the pools of all channels keep for reuse, see
+ * amqp_pool_trim().
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_trim_buffers(amqp_connection_state_t state);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_send_frame(amqp_connection_state_t state, amqp_frame_t const *frame);
@@ -495,6 +708,23 @@ AMQP_CALL amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
                                          amqp_frame_t *decoded_frame,
                                          struct timeval *tv);
 
+/*
+ * Like amqp_simple_wait_frame_noblock(), but fills up to max_frames
+ * entries of decoded_frames in one call: queued frames first, then every
+ * complete frame already sitting in the socket buffer. It only blocks (or
+ * waits up to tv, if non-NULL) when no frame at all is available.
+ *
+ * Returns the number of frames stored (at least 1), or a negative
+ * amqp_status_enum value on error, in which case the connection should be
+ * considered unusable.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_simple_wait_frames(amqp_connection_state_t state,
+                                  amqp_frame_t *decoded_frames,
+                                  int max_frames,
+                                  struct timeval *tv);
+
 AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_simple_wait_method(amqp_connection_state_t state,
@@ -564,6 +794,140 @@ AMQP_CALL amqp_basic_publish(amqp_connection_state_t state, amqp_channel_t chann
                              struct amqp_basic_properties_t_ const *properties,
                              amqp_bytes_t body);
 
+/*
+ * Makes amqp_basic_publish() append messages to a buffer instead of writing
+ * each one to the socket. Buffered messages are written in one go once they
+ * add up to max_bytes, once max_messages of them are buffered, or once the
+ * oldest has waited max_latency. They are also
+ * written ahead of any other frame sent on the connection, before the
+ * library blocks waiting for input, and by amqp_flush(). Messages with a
+ * body of max_bytes or more are not copied into the buffer but written
+ * immediately, together with what was buffered before them.
+ *
+ * max_messages of 0 and a NULL max_latency mean no limit. A max_bytes of 0
+ * turns batching off (the default). Anything already buffered is written
+ * first.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_publish_batching(amqp_connection_state_t state,
+                                    size_t max_bytes, int max_messages,
+                                    struct timeval *max_latency);
+
+/*
+ * Writes out the messages buffered by amqp_basic_publish() in batching mode,
+ * and the acks held back by ack coalescing. Messages and acks still
+ * buffered when the connection is destroyed are lost.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_flush(amqp_connection_state_t state);
+
+/*
+ * Writes out the buffered messages and held acks if the oldest of them has
+ * waited its max_latency, and otherwise leaves them buffered.
+ *
+ * max_latency is not enforced by a timer: it is checked when publishing,
+ * when acking, and when waiting for or reading a frame. A publisher that
+ * can go quiet without waiting for frames should call this from its event
+ * loop, at least every max_latency, or messages can stay buffered for as
+ * long as it is idle.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_flush_expired(amqp_connection_state_t state);
+
+/*
+ * Makes amqp_basic_ack() hold back acks on channel, and send those for a
+ * run of consecutive delivery tags as one ack with multiple set. Held acks
+ * are written once max_acks of them are held, once the oldest has waited
+ * max_latency (checked when acking and when waiting for or reading a
+ * frame), ahead of any other frame sent on the connection, before the
+ * library blocks waiting for input, and by amqp_flush().
+ *
+ * Only an ack for the delivery right after the last one settled can be
+ * held; anything else is sent right away. Once the deliveries before such
+ * an ack are settled too, acks after it are held again. Deliveries that are
+ * not acked at all, such as those of no-ack consumers on the same channel,
+ * stop acks after them from being held. Tracking starts over when the
+ * channel is opened again.
+ *
+ * A max_acks of 0 turns coalescing off for the channel (the default),
+ * writing out what was held. A NULL max_latency means no limit.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_set_ack_coalescing(amqp_connection_state_t state,
+                                  amqp_channel_t channel, int max_acks,
+                                  struct timeval *max_latency);
+
+/*
+ * Tracks which deliveries on a channel have been processed, for consumers
+ * that finish them out of order, for example on several worker threads.
+ * amqp_ack_tracker_complete() may be called from any thread, without
+ * locking; everything else must be called from the thread that uses the
+ * connection.
+ */
+typedef struct amqp_ack_tracker_t_ amqp_ack_tracker_t;
+
+/*
+ * Creates a tracker for the deliveries on channel, starting at delivery
+ * tag 1. max_unacked is the most deliveries that may be waiting for their
+ * ack at a time, normally the channel's prefetch count. Returns NULL if
+ * max_unacked is not positive or memory runs out.
+ *
+ * Deliveries completed on the tracker should not also be acked with
+ * amqp_basic_ack(). When the channel is opened again, start a new tracker.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_ack_tracker_t *
+AMQP_CALL amqp_ack_tracker_new(amqp_channel_t channel, int max_unacked);
+
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_ack_tracker_free(amqp_ack_tracker_t *tracker);
+
+/*
+ * Marks a delivery as processed. Safe to call from any thread. Returns
+ * AMQP_STATUS_INVALID_PARAMETER if the delivery was acked already, or if
+ * it is more than the tracker's max_unacked deliveries past the oldest
+ * unacked one; amqp_ack_tracker_flush() makes room.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_ack_tracker_complete(amqp_ack_tracker_t *tracker,
+                                    uint64_t delivery_tag);
+
+/*
+ * Limits how long deliveries completed after one that is still being
+ * processed are kept back. Such deliveries can't be covered by a multiple
+ * ack until the gap before them closes, so they are held until then and
+ * acked together, unless max_held of them are waiting or the gap has been
+ * open for max_age; after that they are acked one by one. A max_held of 0
+ * acks them right away, and a NULL max_age sets no age limit.
+ *
+ * By default max_held is half of the tracker's max_unacked, and there is
+ * no age limit. Returns AMQP_STATUS_INVALID_PARAMETER if max_held is
+ * negative.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_ack_tracker_set_gap_limits(amqp_ack_tracker_t *tracker,
+    int max_held,
+    struct timeval *max_age);
+
+/*
+ * Acks the deliveries completed since the last flush, in one write: a
+ * single ack with multiple set for all of them up to the first one still
+ * being processed. Deliveries completed after that one are held, see
+ * amqp_ack_tracker_set_gap_limits(); the limits are only checked here.
+ * Nothing is written if there is nothing new to ack.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_ack_tracker_flush(amqp_connection_state_t state,
+                                 amqp_ack_tracker_t *tracker);
+
 AMQP_PUBLIC_FUNCTION
 amqp_rpc_reply_t
 AMQP_CALL amqp_channel_close(amqp_connection_state_t state, amqp_channel_t channel,
@@ -588,6 +952,46 @@ int
 AMQP_CALL amqp_basic_reject(amqp_connection_state_t state, amqp_channel_t channel,
                             uint64_t delivery_tag, amqp_boolean_t requeue);
 
+/*
+ * Sends a basic.nack, RabbitMQ's extension of basic.reject that can settle
+ * all deliveries up to delivery_tag at once when multiple is set.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_nack(amqp_connection_state_t state, amqp_channel_t channel,
+                          uint64_t delivery_tag, amqp_boolean_t multiple,
+                          amqp_boolean_t requeue);
+
+typedef enum amqp_settle_action_enum_ {
+  AMQP_SETTLE_ACK = 0,
+  AMQP_SETTLE_NACK,
+  AMQP_SETTLE_REJECT
+} amqp_settle_action_enum;
+
+/* One delivery to settle with amqp_basic_settle() */
+typedef struct amqp_settle_t_ {
+  uint64_t delivery_tag;
+  amqp_settle_action_enum action;
+  amqp_boolean_t requeue;  /* ignored for AMQP_SETTLE_ACK */
+  amqp_boolean_t multiple; /* not allowed for AMQP_SETTLE_REJECT */
+} amqp_settle_t;
+
+/*
+ * Settles deliveries on a channel in one write: the basic.ack, basic.nack
+ * and basic.reject frames for all count entries of settles are encoded
+ * back to back, in order, and sent together with anything batched.
+ *
+ * Returns AMQP_STATUS_INVALID_PARAMETER, sending nothing, if an entry has
+ * an unknown action or is a reject with multiple set. If the write fails,
+ * none of the entries are taken as settled, and acks held back by ack
+ * coalescing are still held.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_settle(amqp_connection_state_t state,
+                            amqp_channel_t channel,
+                            const amqp_settle_t *settles, int count);
+
 /*
  * Can be used to see if there is data still in the buffer, if so
  * calling amqp_simple_wait_frame will not immediately enter a
@@ -630,6 +1034,64 @@ AMQP_PUBLIC_FUNCTION
 int
 AMQP_CALL amqp_encode_table(amqp_bytes_t encoded, amqp_table_t *input, size_t *offset);
 
+/*
+ * Cursor over an encoded field table that decodes nothing up front.
+ *
+ * amqp_table_iter_init() positions iter on the table found at *offset in
+ * encoded (as amqp_decode_table() would read it) and moves *offset past it.
+ * amqp_table_iter_next() steps to the next entry, returning 1 and its key
+ * and kind, 0 at the end of the table, or an amqp_status_enum value if the
+ * table is malformed. amqp_table_iter_find() steps forward until an entry
+ * with the given key, returning 1 if one was found and 0 if not; it does
+ * not look past the match, so a second lookup only scans the remaining
+ * entries. amqp_table_iter_value() decodes the current entry's value,
+ * using pool only for nested tables and arrays; the key and any byte
+ * fields point into encoded. amqp_table_iter_child() starts a cursor over
+ * the current entry's value when that is a nested table.
+ *
+ * amqp_table_iter_init_headers() positions iter on the headers table inside
+ * the raw bytes of basic class properties (payload.properties.raw of a
+ * content header frame), returning 1, or 0 if the properties have no
+ * headers.
+ */
+typedef struct amqp_table_iter_t_ {
+  amqp_bytes_t encoded; /* the table's entries */
+  size_t offset;        /* start of the next entry */
+  size_t value_offset;  /* start of the current entry's value */
+  amqp_bytes_t key;     /* current entry's key */
+  uint8_t kind;         /* current entry's kind, 0 before the first entry */
+} amqp_table_iter_t;
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_init(amqp_table_iter_t *iter, amqp_bytes_t encoded,
+                               size_t *offset);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_init_headers(amqp_table_iter_t *iter,
+                                       amqp_bytes_t raw_properties);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_next(amqp_table_iter_t *iter, amqp_bytes_t *key,
+                               uint8_t *kind);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_find(amqp_table_iter_t *iter, amqp_bytes_t key,
+                               uint8_t *kind);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_value(amqp_table_iter_t *iter, amqp_pool_t *pool,
+                                amqp_field_value_t *value);
+
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_table_iter_child(amqp_table_iter_t *iter,
+                                amqp_table_iter_t *child);
+
 struct amqp_connection_info {
   char *user;
   char *password;
@@ -719,4 +1181,318 @@ AMQP_END_DECLS
 
 #include <amqp_framing.h>
 
+AMQP_BEGIN_DECLS
+
+/* consumer API */
+
+/**
+ * A complete message: properties and body, independent of the connection's
+ * buffers. Everything is allocated from the message's own pool.
+ */
+typedef struct amqp_message_t_ {
+  amqp_basic_properties_t properties; /**< message properties */
+  amqp_bytes_t body;                  /**< message body, one contiguous block */
+  amqp_pool_t pool;                   /**< pool used to allocate properties and body */
+} amqp_message_t;
+
+/**
+ * A message delivered by basic.deliver, along with the delivery details.
+ */
+typedef struct amqp_envelope_t_ {
+  amqp_channel_t channel;    /**< channel the message was delivered on */
+  amqp_bytes_t consumer_tag; /**< consumer tag the message was delivered to */
+  uint64_t delivery_tag;     /**< delivery tag, used to ack or reject the message */
+  amqp_boolean_t redelivered; /**< true if the message has been delivered before */
+  amqp_bytes_t exchange;     /**< exchange the message was published to */
+  amqp_bytes_t routing_key;  /**< routing key the message was published with */
+  amqp_message_t message;    /**< the message itself */
+} amqp_envelope_t;
+
+/**
+ * Wait for and read a complete delivered message.
+ *
+ * Waits for a basic.deliver method on any channel, then reads the content
+ * header and body that follow it. Once the header announces the body size a
+ * single buffer of that size is allocated, and the remaining body frames are
+ * read straight into it.
+ *
+ * If the next frame is not a basic.deliver (e.g. a channel.close), it is left
+ * queued so that amqp_simple_wait_frame() returns it, and
+ * AMQP_STATUS_UNEXPECTED_STATE is returned.
+ *
+ * Other frames that arrive while the content is read, such as methods on
+ * its channel or any other, are queued for amqp_simple_wait_frame() and
+ * the message is still read in full. A channel.close on its channel ends the read the
+ * same way as above.
+ *
+ * The envelope does not reference the connection's buffers, so
+ * amqp_maybe_release_buffers() may be called while it is alive. Release it
+ * with amqp_destroy_envelope().
+ *
+ * \param [in] state the connection object
+ * \param [out] envelope the delivered message
+ * \param [in] timeout how long to wait for the basic.deliver, NULL waits
+ *              indefinitely
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_consume_message(amqp_connection_state_t state,
+                               amqp_envelope_t *envelope,
+                               struct timeval *timeout);
+
+/**
+ * Read the content header and body of a message on a channel.
+ *
+ * Use after receiving a method that carries content (basic.deliver,
+ * basic.get-ok, basic.return). If the next content frame on the channel is
+ * not a content header, or the channel is closed first, that frame is left
+ * queued and AMQP_STATUS_UNEXPECTED_STATE is returned. Other frames arriving
+ * in between are queued for amqp_simple_wait_frame().
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel the content arrives on
+ * \param [out] message the message; release it with amqp_destroy_message()
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_read_message(amqp_connection_state_t state,
+                            amqp_channel_t channel,
+                            amqp_message_t *message);
+
+/**
+ * Free the memory held by a message read with amqp_read_message().
+ *
+ * \param [in] message the message
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_message(amqp_message_t *message);
+
+/**
+ * Free the memory held by an envelope read with amqp_consume_message().
+ *
+ * \param [in] envelope the envelope
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_destroy_envelope(amqp_envelope_t *envelope);
+
+/* publisher API */
+
+/**
+ * The basic.publish method frame and content header frame for messages that
+ * all go to the same exchange and routing key with the same properties,
+ * encoded once by amqp_publish_template_init(). A template belongs to one
+ * connection and channel, and must not be shared between threads.
+ */
+typedef struct amqp_publish_template_t_ {
+  amqp_channel_t channel;   /**< channel the messages are published on */
+  amqp_bytes_t frames;      /**< the encoded method and header frames */
+  size_t body_size_offset;  /**< where the body size goes in frames */
+  size_t message_id_offset; /**< where message_id goes in frames, 0 if unset */
+  size_t message_id_len;    /**< length every message_id must have */
+  size_t timestamp_offset;  /**< where timestamp goes in frames, 0 if unset */
+} amqp_publish_template_t;
+
+/**
+ * Encode a publish template.
+ *
+ * The arguments are those of amqp_basic_publish(). If properties sets
+ * message_id and/or timestamp, they can be changed per message with
+ * amqp_publish_template_set_message_id() and
+ * amqp_publish_template_set_timestamp(); nothing else can.
+ *
+ * \param [in] state the connection object
+ * \param [out] tmpl the template; release it with
+ *              amqp_publish_template_destroy()
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_init(amqp_connection_state_t state,
+                                     amqp_publish_template_t *tmpl,
+                                     amqp_channel_t channel,
+                                     amqp_bytes_t exchange,
+                                     amqp_bytes_t routing_key,
+                                     amqp_boolean_t mandatory,
+                                     amqp_boolean_t immediate,
+                                     amqp_basic_properties_t const *properties);
+
+/**
+ * Free the memory held by a publish template.
+ *
+ * \param [in] tmpl the template
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL amqp_publish_template_destroy(amqp_publish_template_t *tmpl);
+
+/**
+ * Set the message_id of the messages published from now on. The new id
+ * must be as long as the one the template was created with, so use fixed
+ * width ids.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *         template has no message_id or the length differs
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_set_message_id(amqp_publish_template_t *tmpl,
+                                               amqp_bytes_t message_id);
+
+/**
+ * Set the timestamp of the messages published from now on.
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_INVALID_PARAMETER if the
+ *         template has no timestamp
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_publish_template_set_timestamp(amqp_publish_template_t *tmpl,
+                                              uint64_t timestamp);
+
+/**
+ * Publish a message from a template. Only the body size is filled in, the
+ * method and header frames are otherwise sent as encoded. Batching applies
+ * as for amqp_basic_publish().
+ *
+ * \param [in] state the connection object
+ * \param [in] tmpl the template
+ * \param [in] body the message body
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_basic_publish_template(amqp_connection_state_t state,
+                                      amqp_publish_template_t *tmpl,
+                                      amqp_bytes_t body);
+
+/* publisher confirms */
+
+/**
+ * The outcome of a run of messages published on a channel in confirm mode,
+ * identified by their publish sequence numbers
+ */
+typedef struct amqp_confirm_t_ {
+  amqp_channel_t channel; /**< channel the messages were published on */
+  uint64_t first_seq;     /**< sequence number of the first message */
+  uint64_t last_seq;      /**< sequence number of the last message */
+  amqp_boolean_t nacked;  /**< non-zero if the broker nacked the messages,
+                               or the channel closed before confirming them */
+} amqp_confirm_t;
+
+/**
+ * Called with each outcome on a channel in confirm mode. It is called from
+ * within whichever library function read the ack or nack, so it must not
+ * use the connection.
+ */
+typedef void (AMQP_CALL *amqp_confirm_callback_t)(void *user_data,
+    const amqp_confirm_t *confirm);
+
+/**
+ * Put a channel in confirm mode and start tracking its publishes.
+ *
+ * Every message published on the channel from now on gets the next
+ * sequence number, starting at 1 (see amqp_confirm_next_seq()). The
+ * broker's basic.ack and basic.nack frames are consumed by the library as
+ * they are read, and never returned by amqp_simple_wait_frame(). Their
+ * outcomes are passed to callback, or, if callback is NULL, queued for
+ * amqp_confirm_poll(). A channel that closes before its messages are
+ * confirmed reports them as nacked.
+ *
+ * Other frames read while waiting for confirms, such as basic.return or
+ * channel.close, are queued for amqp_simple_wait_frame(), and
+ * amqp_confirm_poll() and amqp_confirm_wait() return
+ * AMQP_STATUS_UNEXPECTED_STATE to say so. Read them before waiting again:
+ * the buffers of a channel with queued frames can't be released.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel
+ * \param [in] max_in_flight the most messages that may wait for their
+ *             confirm; publishing blocks (reading frames) until there is
+ *             room. 0 for no limit.
+ * \param [in] callback the function outcomes are passed to, or NULL
+ * \param [in] user_data passed to callback
+ *
+ * \return the result of the confirm.select RPC
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_rpc_reply_t
+AMQP_CALL amqp_confirm_enable(amqp_connection_state_t state,
+                              amqp_channel_t channel,
+                              int max_in_flight,
+                              amqp_confirm_callback_t callback,
+                              void *user_data);
+
+/**
+ * Get the sequence number the next message published on a channel in
+ * confirm mode will get.
+ *
+ * \return the sequence number, 0 if the channel is not in confirm mode
+ */
+AMQP_PUBLIC_FUNCTION
+uint64_t
+AMQP_CALL amqp_confirm_next_seq(amqp_connection_state_t state,
+                                amqp_channel_t channel);
+
+/**
+ * Get the number of messages published on a channel in confirm mode that
+ * are still waiting for their confirm.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirm_in_flight(amqp_connection_state_t state,
+                                 amqp_channel_t channel);
+
+/**
+ * Get the queued outcomes of channels in confirm mode without a callback,
+ * reading frames until there is at least one. Other frames read in the
+ * meantime are kept for amqp_simple_wait_frame().
+ *
+ * \param [in] state the connection object
+ * \param [out] confirms where to store the outcomes
+ * \param [in] max_confirms the most outcomes to store
+ * \param [in] timeout how long to wait for an outcome, NULL to wait
+ *             forever, zero to not block
+ *
+ * \return the number of outcomes stored, or an amqp_status_enum value
+ *         (AMQP_STATUS_TIMEOUT if none arrived in time,
+ *         AMQP_STATUS_UNEXPECTED_STATE if another frame was read and left
+ *         for amqp_simple_wait_frame(), with any outcomes it brought kept
+ *         for the next call)
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirm_poll(amqp_connection_state_t state,
+                            amqp_confirm_t *confirms,
+                            int max_confirms,
+                            struct timeval *timeout);
+
+/**
+ * Wait until every message published on a channel in confirm mode so far
+ * has been confirmed. Outcomes are reported as usual.
+ *
+ * \param [in] state the connection object
+ * \param [in] channel the channel
+ * \param [in] timeout how long to wait, NULL to wait forever
+ *
+ * \return AMQP_STATUS_OK on success, AMQP_STATUS_TIMEOUT,
+ *         AMQP_STATUS_UNEXPECTED_STATE if another frame was read and left
+ *         for amqp_simple_wait_frame(), or another amqp_status_enum value
+ *         on error
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL amqp_confirm_wait(amqp_connection_state_t state,
+                            amqp_channel_t channel,
+                            struct timeval *timeout);
+
+AMQP_END_DECLS
+
 #endif /* AMQP_H */
@@ -39,7 +39,9 @@
 #endif
 
 #include "amqp_private.h"
+#include "amqp_timer.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -70,7 +72,9 @@ static const char *base_error_strings[] = {
   "table too large for buffer",         /* AMQP_STATUS_TABLE_TOO_BIG            -0x000B */
   "unexpected method received",         /* AMQP_STATUS_WRONG_METHOD             -0x000C */
   "request timed out",                  /* AMQP_STATUS_TIMEOUT                  -0x000D */
-  "system timer has failed"             /* AMQP_STATUS_TIMER_FAILED             -0x000E */
+  "system timer has failed",            /* AMQP_STATUS_TIMER_FAILED             -0x000E */
+  "unexpected protocol state",          /* AMQP_STATUS_UNEXPECTED_STATE         -0x000F */
+  "operation not supported"             /* AMQP_STATUS_UNSUPPORTED              -0x0010 */
 };
 
 static const char *tcp_error_strings[] = {
@@ -162,6 +166,218 @@ const amqp_array_t amqp_empty_array = { 0, NULL };
    ? (replytype *) state->most_recent_api_result.reply.decoded\
    : NULL)
 
+/* The number of iovecs handed to a single amqp_socket_writev() call by
+ * amqp_basic_publish(). Bodies that need more are sent in several calls. */
+#define PUBLISH_IOVEC_COUNT 64
+#if defined(IOV_MAX) && IOV_MAX < PUBLISH_IOVEC_COUNT
+# undef PUBLISH_IOVEC_COUNT
+# define PUBLISH_IOVEC_COUNT IOV_MAX
+#endif
+
+/* Copies body, split into body frames, into the outbound buffer at
+ * outbound_offset. Space must have been reserved. */
+static void append_body_frames(amqp_connection_state_t state,
+                               amqp_channel_t channel, amqp_bytes_t body,
+                               size_t usable_body_payload_size)
+{
+  size_t body_offset = 0;
+
+  while (body_offset < body.len) {
+    void *out_frame = amqp_offset(state->outbound_buffer.bytes,
+                                  state->outbound_offset);
+    size_t fragment_len = body.len - body_offset;
+
+    if (fragment_len > usable_body_payload_size) {
+      fragment_len = usable_body_payload_size;
+    }
+
+    amqp_e8(out_frame, 0, AMQP_FRAME_BODY);
+    amqp_e16(out_frame, 1, channel);
+    amqp_e32(out_frame, 3, fragment_len);
+    memcpy(amqp_offset(out_frame, HEADER_SIZE),
+           amqp_offset(body.bytes, body_offset), fragment_len);
+    amqp_e8(out_frame, HEADER_SIZE + fragment_len, AMQP_FRAME_END);
+
+    state->outbound_offset += HEADER_SIZE + fragment_len + FOOTER_SIZE;
+    body_offset += fragment_len;
+  }
+}
+
+/* Flushes the batch if the message just buffered filled it up */
+static int batch_message_added(amqp_connection_state_t state)
+{
+  state->outbound_messages++;
+
+  if (state->outbound_offset >= state->batch_max_bytes
+      || (state->batch_max_messages > 0
+          && state->outbound_messages >= state->batch_max_messages)) {
+    return amqp_flush(state);
+  }
+
+  if (state->batch_max_latency > 0) {
+    uint64_t now = amqp_get_monotonic_timestamp();
+    if (0 == now) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+
+    if (1 == state->outbound_messages) {
+      state->outbound_deadline = now + state->batch_max_latency;
+    } else if (now >= state->outbound_deadline) {
+      return amqp_flush(state);
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Reserves room in the outbound buffer for a message with the given body,
+ * and decides whether the body is copied into a batch */
+static int reserve_for_publish(amqp_connection_state_t state,
+                               amqp_bytes_t body,
+                               size_t usable_body_payload_size,
+                               amqp_boolean_t *batch)
+{
+  /* The method and header frames can't be larger than frame_max each */
+  size_t reserve = 2 * (size_t)state->frame_max;
+
+  *batch = 0;
+
+  if (0 == state->batch_max_bytes) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (body.len < state->batch_max_bytes) {
+    size_t body_frames = (body.len + usable_body_payload_size - 1)
+                         / usable_body_payload_size;
+
+    reserve += body.len + body_frames * (HEADER_SIZE + FOOTER_SIZE);
+    *batch = 1;
+  }
+
+  return amqp_reserve_outbound_buffer(state, reserve);
+}
+
+/* Writes the method and header frames that are encoded in the outbound
+ * buffer up to encoded_len, followed by body */
+static int write_content(amqp_connection_state_t state,
+                         amqp_channel_t channel,
+                         size_t encoded_len,
+                         amqp_bytes_t body,
+                         size_t usable_body_payload_size)
+{
+  size_t body_offset;
+  int res;
+
+  /* Body frames are sent as [footer of the previous frame +] frame header,
+   * then the payload straight from body, so every body frame takes two
+   * iovecs */
+  struct iovec iov[PUBLISH_IOVEC_COUNT];
+  uint8_t frame_glue[PUBLISH_IOVEC_COUNT / 2][FOOTER_SIZE + HEADER_SIZE];
+  uint8_t frame_end_byte = AMQP_FRAME_END;
+  int iovcnt;
+  int gluecnt;
+
+  /* Whatever was batched goes out with this message */
+  state->outbound_offset = 0;
+  state->outbound_messages = 0;
+
+  iov[0].iov_base = state->outbound_buffer.bytes;
+  iov[0].iov_len = encoded_len;
+  iovcnt = 1;
+  gluecnt = 0;
+
+  body_offset = 0;
+  while (body_offset < body.len) {
+    size_t remaining = body.len - body_offset;
+    size_t fragment_len;
+    uint8_t *glue;
+    size_t glue_len = 0;
+
+    if (remaining >= usable_body_payload_size) {
+      fragment_len = usable_body_payload_size;
+    } else {
+      fragment_len = remaining;
+    }
+
+    if (iovcnt + 2 > PUBLISH_IOVEC_COUNT) {
+      res = amqp_socket_writev(state->socket, iov, iovcnt);
+      if (res < 0) {
+        return res;
+      }
+      iovcnt = 0;
+      gluecnt = 0;
+    }
+
+    glue = frame_glue[gluecnt++];
+    if (body_offset > 0) {
+      amqp_e8(glue, 0, AMQP_FRAME_END);
+      glue_len = FOOTER_SIZE;
+    }
+    amqp_e8(glue, glue_len, AMQP_FRAME_BODY);
+    amqp_e16(glue, glue_len + 1, channel);
+    amqp_e32(glue, glue_len + 3, fragment_len);
+
+    iov[iovcnt].iov_base = glue;
+    iov[iovcnt].iov_len = glue_len + HEADER_SIZE;
+    iov[iovcnt + 1].iov_base = amqp_offset(body.bytes, body_offset);
+    iov[iovcnt + 1].iov_len = fragment_len;
+    iovcnt += 2;
+
+    body_offset += fragment_len;
+  }
+
+  if (body.len > 0) {
+    if (iovcnt == PUBLISH_IOVEC_COUNT) {
+      res = amqp_socket_writev(state->socket, iov, iovcnt);
+      if (res < 0) {
+        return res;
+      }
+      iovcnt = 0;
+    }
+
+    iov[iovcnt].iov_base = &frame_end_byte;
+    iov[iovcnt].iov_len = FOOTER_SIZE;
+    iovcnt++;
+  }
+
+  res = amqp_socket_writev(state->socket, iov, iovcnt);
+  if (res < 0) {
+    return res;
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Sends the method and header frames that are encoded in the outbound
+ * buffer up to encoded_len, followed by body, or appends it all to the
+ * batch */
+static int send_content(amqp_connection_state_t state,
+                        amqp_channel_t channel,
+                        size_t encoded_len,
+                        amqp_bytes_t body,
+                        size_t usable_body_payload_size,
+                        amqp_boolean_t batch)
+{
+  int res;
+
+  if (batch) {
+    state->outbound_offset = encoded_len;
+    append_body_frames(state, channel, body, usable_body_payload_size);
+    res = batch_message_added(state);
+  } else {
+    /* The body is the caller's and may be sent without copying */
+    amqp_tcp_socket_set_zerocopy_range(state->socket, body.bytes, body.len);
+    res = write_content(state, channel, encoded_len, body,
+                        usable_body_payload_size);
+    amqp_tcp_socket_set_zerocopy_range(state->socket, NULL, 0);
+  }
+  if (res < 0) {
+    return res;
+  }
+
+  return amqp_confirm_published(state, channel);
+}
+
 int amqp_basic_publish(amqp_connection_state_t state,
                        amqp_channel_t channel,
                        amqp_bytes_t exchange,
@@ -172,23 +388,47 @@ int amqp_basic_publish(amqp_connection_state_t state,
                        amqp_bytes_t body)
 {
   amqp_frame_t f;
-  size_t body_offset;
+  amqp_bytes_t encoded;
+  size_t encoded_len;
   size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  amqp_boolean_t batch;
   int res;
 
   amqp_basic_publish_t m;
   amqp_basic_properties_t default_properties;
 
+  /* Waiting for confirms flushes the batch, so it has to happen before
+   * anything is encoded behind it */
+  res = amqp_confirm_wait_window(state, channel);
+  if (res < 0) {
+    return res;
+  }
+
+  res = reserve_for_publish(state, body, usable_body_payload_size, &batch);
+  if (res < 0) {
+    return res;
+  }
+
   m.exchange = exchange;
   m.routing_key = routing_key;
   m.mandatory = mandatory;
   m.immediate = immediate;
   m.ticket = 0;
 
-  res = amqp_send_method(state, channel, AMQP_BASIC_PUBLISH_METHOD, &m);
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
+
+  /* Frames are encoded behind any batched messages */
+  encoded_len = state->outbound_offset;
+  encoded.bytes = amqp_offset(state->outbound_buffer.bytes, encoded_len);
+  encoded.len = state->outbound_buffer.len - encoded_len;
+  res = amqp_encode_frame(encoded, &f);
   if (res < 0) {
     return res;
   }
+  encoded_len += res;
 
   if (properties == NULL) {
     memset(&default_properties, 0, sizeof(default_properties));
@@ -201,38 +441,210 @@ int amqp_basic_publish(amqp_connection_state_t state,
   f.payload.properties.body_size = body.len;
   f.payload.properties.decoded = (void *) properties;
 
-  res = amqp_send_frame(state, &f);
+  /* The header frame goes right behind the method frame so that both are
+   * sent together */
+  encoded.bytes = amqp_offset(state->outbound_buffer.bytes, encoded_len);
+  encoded.len = state->outbound_buffer.len - encoded_len;
+  res = amqp_encode_frame(encoded, &f);
+  if (res < 0) {
+    /* The two don't fit in the outbound buffer together: send the method
+     * frame on its own and give the header frame the whole buffer */
+    state->outbound_offset = 0;
+    state->outbound_messages = 0;
+    res = amqp_socket_send(state->socket, state->outbound_buffer.bytes,
+                           encoded_len);
+    if (res < 0) {
+      return res;
+    }
+
+    encoded_len = 0;
+    res = amqp_encode_frame(state->outbound_buffer, &f);
+    if (res < 0) {
+      return res;
+    }
+  }
+  encoded_len += res;
+
+  return send_content(state, channel, encoded_len, body,
+                      usable_body_payload_size, batch);
+}
+
+/* Length of the encoded properties up to the field with the given flag */
+static int properties_prefix_len(amqp_basic_properties_t const *properties,
+                                 amqp_flags_t flag, amqp_bytes_t scratch)
+{
+  amqp_basic_properties_t prefix = *properties;
+
+  prefix._flags &= ~((flag << 1) - 1);
+  return amqp_encode_properties(AMQP_BASIC_CLASS, &prefix, scratch);
+}
+
+int amqp_publish_template_init(amqp_connection_state_t state,
+                               amqp_publish_template_t *tmpl,
+                               amqp_channel_t channel,
+                               amqp_bytes_t exchange,
+                               amqp_bytes_t routing_key,
+                               amqp_boolean_t mandatory,
+                               amqp_boolean_t immediate,
+                               amqp_basic_properties_t const *properties)
+{
+  amqp_frame_t f;
+  amqp_bytes_t encoded;
+  amqp_basic_publish_t m;
+  amqp_basic_properties_t default_properties;
+  void *scratch;
+  size_t method_len;
+  size_t properties_offset;
+  int res;
+
+  memset(tmpl, 0, sizeof(amqp_publish_template_t));
+
+  if (properties == NULL) {
+    memset(&default_properties, 0, sizeof(default_properties));
+    properties = &default_properties;
+  }
+
+  /* Encode into the free part of the outbound buffer, then copy out */
+  res = amqp_reserve_outbound_buffer(state, 2 * (size_t)state->frame_max);
   if (res < 0) {
     return res;
   }
+  scratch = amqp_offset(state->outbound_buffer.bytes, state->outbound_offset);
+  encoded.bytes = scratch;
+  encoded.len = state->frame_max;
 
-  body_offset = 0;
-  while (body_offset < body.len) {
-    size_t remaining = body.len - body_offset;
+  m.exchange = exchange;
+  m.routing_key = routing_key;
+  m.mandatory = mandatory;
+  m.immediate = immediate;
+  m.ticket = 0;
 
-    if (remaining == 0) {
-      break;
-    }
+  f.frame_type = AMQP_FRAME_METHOD;
+  f.channel = channel;
+  f.payload.method.id = AMQP_BASIC_PUBLISH_METHOD;
+  f.payload.method.decoded = &m;
 
-    f.frame_type = AMQP_FRAME_BODY;
-    f.channel = channel;
-    f.payload.body_fragment.bytes = amqp_offset(body.bytes, body_offset);
-    if (remaining >= usable_body_payload_size) {
-      f.payload.body_fragment.len = usable_body_payload_size;
-    } else {
-      f.payload.body_fragment.len = remaining;
+  res = amqp_encode_frame(encoded, &f);
+  if (res < 0) {
+    return res;
+  }
+  method_len = res;
+
+  f.frame_type = AMQP_FRAME_HEADER;
+  f.payload.properties.class_id = AMQP_BASIC_CLASS;
+  f.payload.properties.body_size = 0;
+  f.payload.properties.decoded = (void *) properties;
+
+  encoded.bytes = amqp_offset(encoded.bytes, method_len);
+  res = amqp_encode_frame(encoded, &f);
+  if (res < 0) {
+    return res;
+  }
+
+  tmpl->frames = amqp_bytes_malloc(method_len + res);
+  if (NULL == tmpl->frames.bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  memcpy(tmpl->frames.bytes, scratch, tmpl->frames.len);
+
+  tmpl->channel = channel;
+  tmpl->body_size_offset = method_len + HEADER_SIZE + 4;
+
+  /* Work out where the mutable fields landed */
+  properties_offset = method_len + HEADER_SIZE + 12;
+  encoded.bytes = scratch;
+  encoded.len = state->frame_max;
+
+  if (properties->_flags & AMQP_BASIC_MESSAGE_ID_FLAG) {
+    res = properties_prefix_len(properties, AMQP_BASIC_MESSAGE_ID_FLAG,
+                                encoded);
+    if (res < 0) {
+      goto error_out;
     }
+    /* skip the short string's length byte */
+    tmpl->message_id_offset = properties_offset + res + 1;
+    tmpl->message_id_len = properties->message_id.len;
+  }
 
-    body_offset += f.payload.body_fragment.len;
-    res = amqp_send_frame(state, &f);
+  if (properties->_flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+    res = properties_prefix_len(properties, AMQP_BASIC_TIMESTAMP_FLAG,
+                                encoded);
     if (res < 0) {
-      return res;
+      goto error_out;
     }
+    tmpl->timestamp_offset = properties_offset + res;
+  }
+
+  return AMQP_STATUS_OK;
+
+error_out:
+  amqp_publish_template_destroy(tmpl);
+  return res;
+}
+
+void amqp_publish_template_destroy(amqp_publish_template_t *tmpl)
+{
+  amqp_bytes_free(tmpl->frames);
+  memset(tmpl, 0, sizeof(amqp_publish_template_t));
+}
+
+int amqp_publish_template_set_message_id(amqp_publish_template_t *tmpl,
+                                         amqp_bytes_t message_id)
+{
+  if (0 == tmpl->message_id_offset || message_id.len != tmpl->message_id_len) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  memcpy(amqp_offset(tmpl->frames.bytes, tmpl->message_id_offset),
+         message_id.bytes, message_id.len);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_publish_template_set_timestamp(amqp_publish_template_t *tmpl,
+                                        uint64_t timestamp)
+{
+  if (0 == tmpl->timestamp_offset) {
+    return AMQP_STATUS_INVALID_PARAMETER;
   }
 
+  amqp_e64(tmpl->frames.bytes, tmpl->timestamp_offset, timestamp);
   return AMQP_STATUS_OK;
 }
 
+int amqp_basic_publish_template(amqp_connection_state_t state,
+                                amqp_publish_template_t *tmpl,
+                                amqp_bytes_t body)
+{
+  size_t usable_body_payload_size = state->frame_max - (HEADER_SIZE + FOOTER_SIZE);
+  amqp_boolean_t batch;
+  void *out_frames;
+  int res;
+
+  res = amqp_confirm_wait_window(state, tmpl->channel);
+  if (res < 0) {
+    return res;
+  }
+
+  res = reserve_for_publish(state, body, usable_body_payload_size, &batch);
+  if (res < 0) {
+    return res;
+  }
+
+  /* Without batching the outbound buffer may still be only frame_max long */
+  res = amqp_reserve_outbound_buffer(state, tmpl->frames.len);
+  if (res < 0) {
+    return res;
+  }
+
+  out_frames = amqp_offset(state->outbound_buffer.bytes, state->outbound_offset);
+  memcpy(out_frames, tmpl->frames.bytes, tmpl->frames.len);
+  amqp_e64(out_frames, tmpl->body_size_offset, body.len);
+
+  return send_content(state, tmpl->channel,
+                      state->outbound_offset + tmpl->frames.len, body,
+                      usable_body_payload_size, batch);
+}
+
 amqp_rpc_reply_t amqp_channel_close(amqp_connection_state_t state,
                                     amqp_channel_t channel,
                                     int code)
@@ -274,9 +686,22 @@ int amqp_basic_ack(amqp_connection_state_t state,
                    amqp_boolean_t multiple)
 {
   amqp_basic_ack_t m;
+  int res;
+
+  res = amqp_ack_coalesce(state, channel, delivery_tag, multiple);
+  if (0 != res) {
+    return res < 0 ? res : AMQP_STATUS_OK;
+  }
+
   m.delivery_tag = delivery_tag;
   m.multiple = multiple;
-  return amqp_send_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
+  res = amqp_send_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
+  if (res < 0) {
+    return res;
+  }
+
+  amqp_ack_coalesce_settled(state, channel, delivery_tag, multiple);
+  return AMQP_STATUS_OK;
 }
 
 amqp_rpc_reply_t amqp_basic_get(amqp_connection_state_t state,
@@ -305,7 +730,121 @@ int amqp_basic_reject(amqp_connection_state_t state,
                       amqp_boolean_t requeue)
 {
   amqp_basic_reject_t req;
+  int res;
+
   req.delivery_tag = delivery_tag;
   req.requeue = requeue;
-  return amqp_send_method(state, channel, AMQP_BASIC_REJECT_METHOD, &req);
+  res = amqp_send_method(state, channel, AMQP_BASIC_REJECT_METHOD, &req);
+  if (res < 0) {
+    return res;
+  }
+
+  amqp_ack_coalesce_settled(state, channel, delivery_tag, 0);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_basic_nack(amqp_connection_state_t state,
+                    amqp_channel_t channel,
+                    uint64_t delivery_tag,
+                    amqp_boolean_t multiple,
+                    amqp_boolean_t requeue)
+{
+  amqp_basic_nack_t req;
+  int res;
+
+  req.delivery_tag = delivery_tag;
+  req.multiple = multiple;
+  req.requeue = requeue;
+  res = amqp_send_method(state, channel, AMQP_BASIC_NACK_METHOD, &req);
+  if (res < 0) {
+    return res;
+  }
+
+  amqp_ack_coalesce_settled(state, channel, delivery_tag, multiple);
+  return AMQP_STATUS_OK;
+}
+
+int amqp_basic_settle(amqp_connection_state_t state,
+                      amqp_channel_t channel,
+                      const amqp_settle_t *settles,
+                      int count)
+{
+  size_t outbound_offset;
+  int i;
+  int res;
+
+  if (count < 0 || (count > 0 && NULL == settles)) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  for (i = 0; i < count; ++i) {
+    if (settles[i].action != AMQP_SETTLE_ACK
+        && settles[i].action != AMQP_SETTLE_NACK
+        && (settles[i].action != AMQP_SETTLE_REJECT || settles[i].multiple)) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+  }
+
+  /* Acks held back on the channel go out first, as they would with any
+   * other frame. Nothing is taken as settled until the write went through,
+   * so a failed write leaves the held acks and any batched messages as they
+   * were. */
+  outbound_offset = state->outbound_offset;
+  res = amqp_ack_coalesce_append(state);
+  if (res < 0) {
+    state->outbound_offset = outbound_offset;
+    return res;
+  }
+
+  for (i = 0; i < count; ++i) {
+    const amqp_settle_t *settle = &settles[i];
+
+    switch (settle->action) {
+    case AMQP_SETTLE_ACK: {
+      amqp_basic_ack_t m;
+      m.delivery_tag = settle->delivery_tag;
+      m.multiple = settle->multiple;
+      res = amqp_append_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
+      break;
+    }
+    case AMQP_SETTLE_NACK: {
+      amqp_basic_nack_t m;
+      m.delivery_tag = settle->delivery_tag;
+      m.multiple = settle->multiple;
+      m.requeue = settle->requeue;
+      res = amqp_append_method(state, channel, AMQP_BASIC_NACK_METHOD, &m);
+      break;
+    }
+    default: {
+      amqp_basic_reject_t m;
+      m.delivery_tag = settle->delivery_tag;
+      m.requeue = settle->requeue;
+      res = amqp_append_method(state, channel, AMQP_BASIC_REJECT_METHOD, &m);
+      break;
+    }
+    }
+
+    if (res < 0) {
+      /* Send none of them rather than some */
+      state->outbound_offset = outbound_offset;
+      return res;
+    }
+  }
+
+  if (state->outbound_offset > 0) {
+    res = amqp_socket_send(state->socket, state->outbound_buffer.bytes,
+                           state->outbound_offset);
+    if (res < 0) {
+      state->outbound_offset = outbound_offset;
+      return res;
+    }
+  }
+  state->outbound_offset = 0;
+  state->outbound_messages = 0;
+  amqp_ack_coalesce_sent(state);
+
+  for (i = 0; i < count; ++i) {
+    amqp_ack_coalesce_settled(state, channel, settles[i].delivery_tag,
+                              settles[i].multiple);
+  }
+  return AMQP_STATUS_OK;
 }
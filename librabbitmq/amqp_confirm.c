@@ -0,0 +1,544 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Copyright 2013 Alan Antonuk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CONFIRM_CAPACITY 1024
+#define INITIAL_CONFIRM_QUEUE_SIZE 16
+
+static amqp_confirm_window_t *find_window(amqp_connection_state_t state,
+    amqp_channel_t channel)
+{
+  amqp_confirm_window_t *w;
+
+  for (w = state->confirm_windows; NULL != w; w = w->next) {
+    if (w->channel == channel) {
+      return w;
+    }
+  }
+  return NULL;
+}
+
+static void free_window(amqp_confirm_window_t *w)
+{
+  amqp_free(w->bits);
+  amqp_free(w);
+}
+
+static int queue_outcome(amqp_connection_state_t state,
+                         const amqp_confirm_t *confirm)
+{
+  amqp_confirm_t *last;
+
+  if (state->confirm_queue_head == state->confirm_queue_len) {
+    state->confirm_queue_head = 0;
+    state->confirm_queue_len = 0;
+  }
+
+  /* A multiple ack or a run of single ones often continues the last run */
+  if (state->confirm_queue_len > state->confirm_queue_head) {
+    last = &state->confirm_queue[state->confirm_queue_len - 1];
+    if (last->channel == confirm->channel && last->nacked == confirm->nacked
+        && last->last_seq + 1 == confirm->first_seq) {
+      last->last_seq = confirm->last_seq;
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  if (state->confirm_queue_len == state->confirm_queue_size) {
+    int new_size = state->confirm_queue_size
+                   ? 2 * state->confirm_queue_size : INITIAL_CONFIRM_QUEUE_SIZE;
+    amqp_confirm_t *new_queue = amqp_realloc(state->confirm_queue,
+                                        new_size * sizeof(amqp_confirm_t));
+    if (NULL == new_queue) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    state->confirm_queue = new_queue;
+    state->confirm_queue_size = new_size;
+  }
+
+  state->confirm_queue[state->confirm_queue_len++] = *confirm;
+  return AMQP_STATUS_OK;
+}
+
+static int report(amqp_connection_state_t state, amqp_confirm_window_t *w,
+                  uint64_t first_seq, uint64_t last_seq, amqp_boolean_t nacked)
+{
+  amqp_confirm_t confirm;
+
+  confirm.channel = w->channel;
+  confirm.first_seq = first_seq;
+  confirm.last_seq = last_seq;
+  confirm.nacked = nacked;
+
+  if (NULL != w->callback) {
+    w->callback(w->user_data, &confirm);
+    return AMQP_STATUS_OK;
+  }
+  return queue_outcome(state, &confirm);
+}
+
+/* A run of consecutive sequence numbers that settled the same way */
+typedef struct confirm_run_t_ {
+  uint64_t first_seq;
+  uint64_t last_seq;
+  amqp_boolean_t active;
+} confirm_run_t;
+
+static int extend_run(amqp_connection_state_t state, amqp_confirm_window_t *w,
+                      confirm_run_t *run, uint64_t first_seq,
+                      uint64_t last_seq, amqp_boolean_t nacked)
+{
+  int res;
+
+  if (run->active && run->last_seq + 1 == first_seq) {
+    run->last_seq = last_seq;
+    return AMQP_STATUS_OK;
+  }
+
+  if (run->active) {
+    res = report(state, w, run->first_seq, run->last_seq, nacked);
+    if (res < 0) {
+      return res;
+    }
+  }
+  run->first_seq = first_seq;
+  run->last_seq = last_seq;
+  run->active = 1;
+  return AMQP_STATUS_OK;
+}
+
+/*
+ * Clears the bits of the outstanding messages in [first, last] and reports
+ * them as runs of consecutive sequence numbers, then moves the window base
+ * past whatever is no longer outstanding. Messages that were settled
+ * already are skipped.
+ */
+static int settle(amqp_connection_state_t state, amqp_confirm_window_t *w,
+                  uint64_t first, uint64_t last, amqp_boolean_t nacked)
+{
+  uint64_t mask = w->capacity - 1;
+  confirm_run_t run;
+  uint64_t seq;
+  int res;
+
+  memset(&run, 0, sizeof(run));
+
+  if (first < w->base) {
+    first = w->base;
+  }
+  if (last >= w->next_seq) {
+    last = w->next_seq - 1;
+  }
+
+  for (seq = first; seq <= last; ) {
+    uint64_t index = seq & mask;
+    uint64_t *word = &w->bits[index / 64];
+    unsigned bit = (unsigned)(index % 64);
+    uint64_t n = 64 - bit;
+    uint64_t chunk;
+    uint64_t set;
+    uint64_t i;
+
+    if (n > last - seq + 1) {
+      n = last - seq + 1;
+    }
+    chunk = (64 == n ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << bit;
+    set = *word & chunk;
+    *word &= ~chunk;
+
+    if (set == chunk) {
+      /* the common case of a whole stretch still outstanding */
+      res = extend_run(state, w, &run, seq, seq + n - 1, nacked);
+      if (res < 0) {
+        return res;
+      }
+      w->in_flight -= (int)n;
+    } else {
+      for (i = 0; i < n; ++i) {
+        if (set & ((uint64_t)1 << (bit + i))) {
+          res = extend_run(state, w, &run, seq + i, seq + i, nacked);
+          if (res < 0) {
+            return res;
+          }
+          w->in_flight--;
+        }
+      }
+    }
+
+    seq += n;
+  }
+
+  if (run.active) {
+    res = report(state, w, run.first_seq, run.last_seq, nacked);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  while (w->base < w->next_seq) {
+    uint64_t index = w->base & mask;
+
+    if (0 == index % 64 && w->next_seq - w->base >= 64
+        && 0 == w->bits[index / 64]) {
+      w->base += 64;
+    } else if (0 == (w->bits[index / 64] & ((uint64_t)1 << (index % 64)))) {
+      w->base++;
+    } else {
+      break;
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Reports everything still outstanding on a channel as nacked and stops
+ * tracking it */
+static int close_window(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_confirm_window_t **link;
+  amqp_confirm_window_t *w;
+  int res = AMQP_STATUS_OK;
+
+  for (link = &state->confirm_windows; NULL != *link; link = &(*link)->next) {
+    if ((*link)->channel == channel) {
+      break;
+    }
+  }
+  w = *link;
+  if (NULL == w) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (w->in_flight > 0) {
+    res = settle(state, w, w->base, w->next_seq - 1, 1);
+  }
+  *link = w->next;
+  free_window(w);
+  return res;
+}
+
+static int grow_window(amqp_confirm_window_t *w)
+{
+  uint64_t new_capacity = 2 * w->capacity;
+  uint64_t *new_bits = amqp_calloc((size_t)(new_capacity / 64), sizeof(uint64_t));
+  uint64_t seq;
+
+  if (NULL == new_bits) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  for (seq = w->base; seq < w->next_seq; ++seq) {
+    uint64_t index = seq & (w->capacity - 1);
+    if (w->bits[index / 64] & ((uint64_t)1 << (index % 64))) {
+      index = seq & (new_capacity - 1);
+      new_bits[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+  }
+
+  amqp_free(w->bits);
+  w->bits = new_bits;
+  w->capacity = new_capacity;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_confirm_handle_frame(amqp_connection_state_t state,
+                              amqp_frame_t *frame)
+{
+  amqp_confirm_window_t *w;
+  uint64_t tag;
+  amqp_boolean_t multiple;
+  amqp_boolean_t nacked;
+  int res;
+
+  if (NULL == state->confirm_windows
+      || AMQP_FRAME_METHOD != frame->frame_type) {
+    return 0;
+  }
+
+  switch (frame->payload.method.id) {
+  case AMQP_BASIC_ACK_METHOD: {
+    amqp_basic_ack_t *ack = frame->payload.method.decoded;
+    tag = ack->delivery_tag;
+    multiple = ack->multiple;
+    nacked = 0;
+    break;
+  }
+  case AMQP_BASIC_NACK_METHOD: {
+    amqp_basic_nack_t *nack = frame->payload.method.decoded;
+    tag = nack->delivery_tag;
+    multiple = nack->multiple;
+    nacked = 1;
+    break;
+  }
+  case AMQP_CHANNEL_CLOSE_METHOD:
+  case AMQP_CHANNEL_CLOSE_OK_METHOD:
+    res = close_window(state, frame->channel);
+    return res < 0 ? res : 0;
+  case AMQP_CONNECTION_CLOSE_METHOD:
+  case AMQP_CONNECTION_CLOSE_OK_METHOD:
+    while (NULL != state->confirm_windows) {
+      res = close_window(state, state->confirm_windows->channel);
+      if (res < 0) {
+        return res;
+      }
+    }
+    return 0;
+  default:
+    return 0;
+  }
+
+  w = find_window(state, frame->channel);
+  if (NULL == w) {
+    return 0;
+  }
+
+  /* A multiple ack with tag 0 covers everything published so far */
+  if (multiple) {
+    res = settle(state, w, w->base, tag ? tag : w->next_seq - 1, nacked);
+  } else {
+    res = settle(state, w, tag, tag, nacked);
+  }
+  return res < 0 ? res : 1;
+}
+
+int amqp_confirm_wait_window(amqp_connection_state_t state,
+                             amqp_channel_t channel)
+{
+  amqp_confirm_window_t *w = find_window(state, channel);
+  int res;
+
+  while (NULL != w && w->max_in_flight > 0
+         && w->in_flight >= w->max_in_flight) {
+    res = amqp_wait_confirm_frame(state, NULL);
+    if (res < 0) {
+      return res;
+    }
+    /* the channel may have been closed in the meantime */
+    w = find_window(state, channel);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_confirm_published(amqp_connection_state_t state,
+                           amqp_channel_t channel)
+{
+  amqp_confirm_window_t *w = find_window(state, channel);
+  uint64_t index;
+  int res;
+
+  if (NULL == w) {
+    return AMQP_STATUS_OK;
+  }
+
+  if (w->next_seq - w->base == w->capacity) {
+    res = grow_window(w);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  index = w->next_seq & (w->capacity - 1);
+  w->bits[index / 64] |= (uint64_t)1 << (index % 64);
+  w->next_seq++;
+  w->in_flight++;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_confirm_destroy(amqp_connection_state_t state)
+{
+  while (NULL != state->confirm_windows) {
+    amqp_confirm_window_t *w = state->confirm_windows;
+    state->confirm_windows = w->next;
+    free_window(w);
+  }
+  amqp_free(state->confirm_queue);
+  state->confirm_queue = NULL;
+  state->confirm_queue_head = 0;
+  state->confirm_queue_len = 0;
+  state->confirm_queue_size = 0;
+}
+
+amqp_rpc_reply_t amqp_confirm_enable(amqp_connection_state_t state,
+                                     amqp_channel_t channel,
+                                     int max_in_flight,
+                                     amqp_confirm_callback_t callback,
+                                     void *user_data)
+{
+  amqp_method_number_t replies[2] = { AMQP_CONFIRM_SELECT_OK_METHOD, 0 };
+  amqp_confirm_select_t req;
+  amqp_confirm_window_t *w;
+  amqp_rpc_reply_t result;
+  int res;
+
+  memset(&result, 0, sizeof(result));
+
+  if (max_in_flight < 0) {
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = AMQP_STATUS_INVALID_PARAMETER;
+    return result;
+  }
+
+  /* Start over if the channel was in confirm mode already */
+  res = close_window(state, channel);
+  if (res < 0) {
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = res;
+    return result;
+  }
+
+  req.nowait = 0;
+  result = amqp_simple_rpc(state, channel, AMQP_CONFIRM_SELECT_METHOD,
+                           replies, &req);
+  if (AMQP_RESPONSE_NORMAL != result.reply_type) {
+    return result;
+  }
+
+  w = amqp_calloc(1, sizeof(amqp_confirm_window_t));
+  if (NULL != w) {
+    w->capacity = INITIAL_CONFIRM_CAPACITY;
+    while (w->capacity < (uint64_t)max_in_flight) {
+      w->capacity *= 2;
+    }
+    w->bits = amqp_calloc((size_t)(w->capacity / 64), sizeof(uint64_t));
+  }
+  if (NULL == w || NULL == w->bits) {
+    amqp_free(w);
+    result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
+    result.library_error = AMQP_STATUS_NO_MEMORY;
+    return result;
+  }
+
+  w->channel = channel;
+  w->base = 1;
+  w->next_seq = 1;
+  w->max_in_flight = max_in_flight;
+  w->callback = callback;
+  w->user_data = user_data;
+  w->next = state->confirm_windows;
+  state->confirm_windows = w;
+
+  return result;
+}
+
+uint64_t amqp_confirm_next_seq(amqp_connection_state_t state,
+                               amqp_channel_t channel)
+{
+  amqp_confirm_window_t *w = find_window(state, channel);
+  return NULL == w ? 0 : w->next_seq;
+}
+
+int amqp_confirm_in_flight(amqp_connection_state_t state,
+                           amqp_channel_t channel)
+{
+  amqp_confirm_window_t *w = find_window(state, channel);
+  return NULL == w ? 0 : w->in_flight;
+}
+
+int amqp_confirm_poll(amqp_connection_state_t state,
+                      amqp_confirm_t *confirms,
+                      int max_confirms,
+                      struct timeval *timeout)
+{
+  struct timeval left;
+  uint64_t deadline;
+  int count;
+  int res;
+
+  if (max_confirms <= 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_timeout_deadline(timeout, &deadline);
+  if (res < 0) {
+    return res;
+  }
+
+  while (state->confirm_queue_head == state->confirm_queue_len) {
+    if (NULL != timeout) {
+      res = amqp_timeout_left(deadline, &left);
+      if (res < 0) {
+        return res;
+      }
+    }
+    res = amqp_wait_confirm_frame(state, NULL == timeout ? NULL : &left);
+    if (res < 0) {
+      return res;
+    }
+    if (res > 0) {
+      /* Left for the caller, or it would pile up unread */
+      return AMQP_STATUS_UNEXPECTED_STATE;
+    }
+  }
+
+  count = state->confirm_queue_len - state->confirm_queue_head;
+  if (count > max_confirms) {
+    count = max_confirms;
+  }
+  memcpy(confirms, &state->confirm_queue[state->confirm_queue_head],
+         count * sizeof(amqp_confirm_t));
+  state->confirm_queue_head += count;
+  return count;
+}
+
+int amqp_confirm_wait(amqp_connection_state_t state,
+                      amqp_channel_t channel,
+                      struct timeval *timeout)
+{
+  amqp_confirm_window_t *w;
+  struct timeval left;
+  uint64_t deadline;
+  int res;
+
+  res = amqp_timeout_deadline(timeout, &deadline);
+  if (res < 0) {
+    return res;
+  }
+
+  for (w = find_window(state, channel); NULL != w && w->in_flight > 0;
+       w = find_window(state, channel)) {
+    if (NULL != timeout) {
+      res = amqp_timeout_left(deadline, &left);
+      if (res < 0) {
+        return res;
+      }
+    }
+    res = amqp_wait_confirm_frame(state, NULL == timeout ? NULL : &left);
+    if (res < 0) {
+      return res;
+    }
+    if (res > 0) {
+      return AMQP_STATUS_UNEXPECTED_STATE;
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
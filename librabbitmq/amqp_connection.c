@@ -40,6 +40,7 @@
 
 #include "amqp_tcp_socket.h"
 #include "amqp_private.h"
+#include "amqp_timer.h"
 #include <assert.h>
 #include <errno.h>
 #include <stdint.h>
@@ -49,7 +50,11 @@
 
 #define INITIAL_FRAME_POOL_PAGE_SIZE 65536
 #define INITIAL_DECODING_POOL_PAGE_SIZE 131072
-#define INITIAL_INBOUND_SOCK_BUFFER_SIZE 131072
+#define MIN_INBOUND_SOCK_BUFFER_SIZE 4096
+#define MAX_INBOUND_SOCK_BUFFER_SIZE 131072
+/* Frame remainders at least this large are received straight into the frame
+ * buffer rather than through sock_inbound_buffer */
+#define DIRECT_INPUT_THRESHOLD 16384
 
 #define ENFORCE_STATE(statevec, statenum)                                                 \
   {                                                                                       \
@@ -65,7 +70,7 @@ amqp_connection_state_t amqp_new_connection(void)
 {
   int res;
   amqp_connection_state_t state =
-    (amqp_connection_state_t) calloc(1, sizeof(struct amqp_connection_state_t_));
+    (amqp_connection_state_t) amqp_calloc(1, sizeof(struct amqp_connection_state_t_));
 
   if (state == NULL) {
     return NULL;
@@ -84,17 +89,16 @@ amqp_connection_state_t amqp_new_connection(void)
      is also the minimum frame size */
   state->target_size = 8;
 
-  state->sock_inbound_buffer.len = INITIAL_INBOUND_SOCK_BUFFER_SIZE;
-  state->sock_inbound_buffer.bytes = malloc(INITIAL_INBOUND_SOCK_BUFFER_SIZE);
-  if (state->sock_inbound_buffer.bytes == NULL) {
-    goto out_nomem;
-  }
+  /* allocated on the first read */
+  state->sock_inbound_min_size = MIN_INBOUND_SOCK_BUFFER_SIZE;
+  state->sock_inbound_max_size = MAX_INBOUND_SOCK_BUFFER_SIZE;
+
+  state->large_block_cache_max = DEFAULT_LARGE_BLOCK_CACHE;
 
   return state;
 
 out_nomem:
-  free(state->sock_inbound_buffer.bytes);
-  free(state);
+  amqp_free(state);
   return NULL;
 }
 
@@ -134,7 +138,7 @@ int amqp_tune_connection(amqp_connection_state_t state,
   state->heartbeat = heartbeat;
 
   state->outbound_buffer.len = frame_max;
-  newbuf = realloc(state->outbound_buffer.bytes, frame_max);
+  newbuf = amqp_realloc(state->outbound_buffer.bytes, frame_max);
   if (newbuf == NULL) {
     return AMQP_STATUS_NO_MEMORY;
   }
@@ -148,6 +152,211 @@ int amqp_get_channel_max(amqp_connection_state_t state)
   return state->channel_max;
 }
 
+void amqp_set_decode_in_place(amqp_connection_state_t state,
+                              amqp_boolean_t decode_in_place)
+{
+  state->decode_in_place = decode_in_place;
+}
+
+void amqp_set_lazy_properties(amqp_connection_state_t state,
+                              amqp_boolean_t lazy_properties)
+{
+  state->lazy_properties = lazy_properties;
+}
+
+int amqp_decode_frame_properties(amqp_connection_state_t state,
+                                 amqp_frame_t *frame)
+{
+  amqp_pool_t *channel_pool;
+
+  if (AMQP_FRAME_HEADER != frame->frame_type) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  if (NULL != frame->payload.properties.decoded) {
+    return AMQP_STATUS_OK;
+  }
+
+  channel_pool = amqp_get_or_create_channel_pool(state, frame->channel);
+  if (NULL == channel_pool) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  return amqp_decode_properties(frame->payload.properties.class_id,
+                                channel_pool, frame->payload.properties.raw,
+                                &frame->payload.properties.decoded);
+}
+
+/* Bytes of socket read buffers allocated by all connections, replaced ones
+ * that are still pinned included */
+static uint64_t sock_inbound_resident;
+
+static void free_sock_inbound_buffer(amqp_bytes_t buffer)
+{
+  if (NULL != buffer.bytes) {
+    atomic_add64(&sock_inbound_resident, (uint64_t)0 - buffer.len);
+    amqp_free(buffer.bytes);
+  }
+}
+
+void amqp_release_pinned_buffer(amqp_pinned_buffer_t *pin)
+{
+  if (atomic_add64(&pin->refcount, (uint64_t)-1) == 1) {
+    free_sock_inbound_buffer(pin->buffer);
+    amqp_free(pin);
+  }
+}
+
+static void unpin_channel_buffers(amqp_pool_table_entry_t *entry)
+{
+  amqp_link_t *link;
+
+  for (link = entry->pinned_buffers; NULL != link; link = link->next) {
+    amqp_release_pinned_buffer(link->data);
+  }
+  entry->pinned_buffers = NULL;
+}
+
+static int pin_sock_inbound_buffer(amqp_connection_state_t state,
+                                   amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry;
+  amqp_link_t *link;
+
+  entry = amqp_get_channel_pool_entry(state, channel);
+  if (NULL == entry) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  if (NULL == state->sock_inbound_pin) {
+    state->sock_inbound_pin = amqp_malloc(sizeof(amqp_pinned_buffer_t));
+    if (NULL == state->sock_inbound_pin) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    state->sock_inbound_pin->refcount = 1;
+    state->sock_inbound_pin->buffer = state->sock_inbound_buffer;
+  }
+
+  /* Frames are decoded in order, so if this channel already references the
+   * current buffer it was the most recent one it pinned */
+  if (NULL != entry->pinned_buffers
+      && entry->pinned_buffers->data == state->sock_inbound_pin) {
+    return AMQP_STATUS_OK;
+  }
+
+  link = amqp_pool_alloc(&entry->pool, sizeof(amqp_link_t));
+  if (NULL == link) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  link->data = state->sock_inbound_pin;
+  link->next = entry->pinned_buffers;
+  entry->pinned_buffers = link;
+  atomic_add64(&state->sock_inbound_pin->refcount, 1);
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_set_sock_inbound_buffer_policy(amqp_connection_state_t state,
+                                        size_t min_size,
+                                        size_t max_size)
+{
+  if (0 == min_size || min_size > max_size) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  state->sock_inbound_min_size = min_size;
+  state->sock_inbound_max_size = max_size;
+
+  return AMQP_STATUS_OK;
+}
+
+size_t amqp_get_sock_inbound_buffer_size(amqp_connection_state_t state)
+{
+  return state->sock_inbound_buffer.len;
+}
+
+uint64_t amqp_get_sock_inbound_resident_bytes(void)
+{
+  return atomic_add64(&sock_inbound_resident, 0);
+}
+
+/* Swaps the drained sock_inbound_buffer for a new one of the given size.
+ * Frames decoded in place keep the old one alive until they are released. */
+static int replace_sock_inbound_buffer(amqp_connection_state_t state,
+                                       size_t size)
+{
+  void *newbuf = amqp_malloc(size);
+  if (NULL == newbuf) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  atomic_add64(&sock_inbound_resident, size);
+
+  if (NULL != state->sock_inbound_pin) {
+    amqp_release_pinned_buffer(state->sock_inbound_pin);
+    state->sock_inbound_pin = NULL;
+  } else {
+    free_sock_inbound_buffer(state->sock_inbound_buffer);
+  }
+
+  state->sock_inbound_buffer.bytes = newbuf;
+  state->sock_inbound_buffer.len = size;
+  state->sock_inbound_offset = 0;
+  state->sock_inbound_limit = 0;
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_prepare_sock_inbound_buffer(amqp_connection_state_t state)
+{
+  amqp_pinned_buffer_t *pin = state->sock_inbound_pin;
+  size_t size = state->sock_inbound_buffer.len;
+
+  if (NULL == state->sock_inbound_buffer.bytes) {
+    size = state->sock_inbound_min_size;
+  } else if (state->sock_inbound_limit == size) {
+    /* The last read filled the buffer, there is likely more where that came
+     * from */
+    size *= 2;
+  }
+
+  if (size > state->sock_inbound_max_size) {
+    size = state->sock_inbound_max_size;
+  }
+  if (size < state->sock_inbound_min_size) {
+    size = state->sock_inbound_min_size;
+  }
+
+  if (NULL != state->sock_inbound_buffer.bytes
+      && size == state->sock_inbound_buffer.len) {
+    if (NULL == pin) {
+      return AMQP_STATUS_OK;
+    }
+
+    if (1 == atomic_add64(&pin->refcount, 0)) {
+      /* All the frames that pointed into it have been released */
+      amqp_free(pin);
+      state->sock_inbound_pin = NULL;
+      return AMQP_STATUS_OK;
+    }
+  }
+
+  return replace_sock_inbound_buffer(state, size);
+}
+
+void amqp_maybe_shrink_sock_inbound_buffer(amqp_connection_state_t state)
+{
+  if (NULL == state->sock_inbound_buffer.bytes
+      || state->sock_inbound_buffer.len <= state->sock_inbound_min_size
+      || state->sock_inbound_offset < state->sock_inbound_limit
+      || state->sock_inbound_limit > state->sock_inbound_min_size) {
+    return;
+  }
+
+  /* Keeping the larger buffer is fine if this fails */
+  replace_sock_inbound_buffer(state, state->sock_inbound_min_size);
+}
+
 int amqp_destroy_connection(amqp_connection_state_t state)
 {
   int status = AMQP_STATUS_OK;
@@ -157,16 +366,24 @@ int amqp_destroy_connection(amqp_connection_state_t state)
       amqp_pool_table_entry_t *entry = state->pool_table[i];
       while (NULL != entry) {
         amqp_pool_table_entry_t *todelete = entry;
+        unpin_channel_buffers(entry);
         empty_amqp_pool(&entry->pool);
         entry = entry->next;
-        free(todelete);
+        amqp_free(todelete);
       }
     }
 
-    free(state->outbound_buffer.bytes);
-    free(state->sock_inbound_buffer.bytes);
+    /* Retained buffers may still reference the current buffer */
+    if (NULL != state->sock_inbound_pin) {
+      amqp_release_pinned_buffer(state->sock_inbound_pin);
+    } else {
+      free_sock_inbound_buffer(state->sock_inbound_buffer);
+    }
+    amqp_confirm_destroy(state);
+    amqp_ack_coalesce_destroy(state);
+    amqp_free(state->outbound_buffer.bytes);
     status = amqp_socket_close(state->socket);
-    free(state);
+    amqp_free(state);
   }
   return status;
 }
@@ -198,6 +415,132 @@ static size_t consume_data(amqp_connection_state_t state,
   return bytes_consumed;
 }
 
+/* Decodes a complete raw frame: header, payload and footer */
+static int decode_frame(amqp_connection_state_t state,
+                        void *raw_frame,
+                        size_t frame_size,
+                        amqp_frame_t *decoded_frame)
+{
+  amqp_bytes_t encoded;
+  int res;
+  amqp_pool_t *channel_pool;
+
+  /* Check frame end marker (footer) */
+  if (amqp_d8(raw_frame, frame_size - 1) != AMQP_FRAME_END) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->frame_type = amqp_d8(raw_frame, 0);
+  decoded_frame->channel = amqp_d16(raw_frame, 1);
+
+  channel_pool = amqp_get_or_create_channel_pool(state, decoded_frame->channel);
+  if (NULL == channel_pool) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  switch (decoded_frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+    decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
+    encoded.len = frame_size - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_decode_method(decoded_frame->payload.method.id,
+                             channel_pool, encoded,
+                             &decoded_frame->payload.method.decoded);
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_HEADER:
+    decoded_frame->payload.properties.class_id
+      = amqp_d16(raw_frame, HEADER_SIZE);
+    /* unused 2-byte weight field goes here */
+    decoded_frame->payload.properties.body_size
+      = amqp_d64(raw_frame, HEADER_SIZE + 4);
+    encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
+    encoded.len = frame_size - HEADER_SIZE - 12 - FOOTER_SIZE;
+    decoded_frame->payload.properties.raw = encoded;
+
+    if (state->lazy_properties) {
+      /* left to amqp_decode_frame_properties() */
+      decoded_frame->payload.properties.decoded = NULL;
+      break;
+    }
+
+    res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
+                                 channel_pool, encoded,
+                                 &decoded_frame->payload.properties.decoded);
+    if (res < 0) {
+      return res;
+    }
+
+    break;
+
+  case AMQP_FRAME_BODY:
+    decoded_frame->payload.body_fragment.len
+      = frame_size - HEADER_SIZE - FOOTER_SIZE;
+    decoded_frame->payload.body_fragment.bytes
+      = amqp_offset(raw_frame, HEADER_SIZE);
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    break;
+
+  default:
+    /* Ignore the frame */
+    decoded_frame->frame_type = 0;
+    break;
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+void amqp_set_body_sink(amqp_connection_state_t state, amqp_channel_t channel,
+                        amqp_bytes_t sink)
+{
+  state->body_sink_channel = channel;
+  state->body_sink = sink;
+}
+
+static amqp_boolean_t body_sink_accepts(amqp_connection_state_t state,
+                                        uint8_t frame_type,
+                                        amqp_channel_t channel,
+                                        size_t payload_len)
+{
+  return NULL != state->body_sink.bytes
+         && AMQP_FRAME_BODY == frame_type
+         && state->body_sink_channel == channel
+         && state->body_sink.len >= FOOTER_SIZE
+         && payload_len <= state->body_sink.len - FOOTER_SIZE;
+}
+
+/* Completes a body frame read into the body sink. The frame end byte lands
+ * just past the payload: on the next frame's payload, or on the spare byte
+ * at the end of the sink. */
+static int finish_body_sink_frame(amqp_connection_state_t state,
+                                  amqp_frame_t *decoded_frame,
+                                  size_t bytes_consumed)
+{
+  size_t payload_len = state->target_size - FOOTER_SIZE;
+
+  if (amqp_d8(state->inbound_buffer.bytes, payload_len) != AMQP_FRAME_END) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  decoded_frame->frame_type = AMQP_FRAME_BODY;
+  decoded_frame->channel = state->body_sink_channel;
+  decoded_frame->payload.body_fragment.bytes = state->inbound_buffer.bytes;
+  decoded_frame->payload.body_fragment.len = payload_len;
+
+  state->body_sink.bytes = amqp_offset(state->body_sink.bytes, payload_len);
+  state->body_sink.len -= payload_len;
+
+  return_to_idle(state);
+  return bytes_consumed;
+}
+
 int amqp_handle_input(amqp_connection_state_t state,
                       amqp_bytes_t received_data,
                       amqp_frame_t *decoded_frame)
@@ -261,6 +604,28 @@ int amqp_handle_input(amqp_connection_state_t state,
       return AMQP_STATUS_NO_MEMORY;
     }
 
+    if (body_sink_accepts(state, amqp_d8(raw_frame, 0), channel,
+                          amqp_d32(raw_frame, 3))) {
+      size_t already_read = state->inbound_offset - HEADER_SIZE;
+
+      state->target_size = amqp_d32(raw_frame, 3) + FOOTER_SIZE;
+      state->inbound_buffer.bytes = state->body_sink.bytes;
+      state->inbound_buffer.len = state->target_size;
+      memcpy(state->inbound_buffer.bytes, state->header_buffer + HEADER_SIZE,
+             already_read);
+      state->inbound_offset = already_read;
+
+      state->state = CONNECTION_STATE_BODY_SINK;
+
+      bytes_consumed += consume_data(state, &received_data);
+
+      if (state->inbound_offset < state->target_size) {
+        return bytes_consumed;
+      }
+
+      return finish_body_sink_frame(state, decoded_frame, bytes_consumed);
+    }
+
     state->target_size
       = amqp_d32(raw_frame, 3) + HEADER_SIZE + FOOTER_SIZE;
 
@@ -268,7 +633,9 @@ int amqp_handle_input(amqp_connection_state_t state,
     if (NULL == state->inbound_buffer.bytes) {
       return AMQP_STATUS_NO_MEMORY;
     }
-    memcpy(state->inbound_buffer.bytes, state->header_buffer, HEADER_SIZE);
+    /* in the initial state one byte past the header has been read too */
+    memcpy(state->inbound_buffer.bytes, state->header_buffer,
+           state->inbound_offset);
     raw_frame = state->inbound_buffer.bytes;
 
     state->state = CONNECTION_STATE_BODY;
@@ -285,80 +652,129 @@ int amqp_handle_input(amqp_connection_state_t state,
     /* fall through to process body */
 
   case CONNECTION_STATE_BODY: {
-    amqp_bytes_t encoded;
-    int res;
-    amqp_pool_t *channel_pool;
-
-    /* Check frame end marker (footer) */
-    if (amqp_d8(raw_frame, state->target_size - 1) != AMQP_FRAME_END) {
-      return AMQP_STATUS_BAD_AMQP_DATA;
+    int res = decode_frame(state, raw_frame, state->target_size, decoded_frame);
+    if (res < 0) {
+      return res;
     }
 
-    decoded_frame->frame_type = amqp_d8(raw_frame, 0);
-    decoded_frame->channel = amqp_d16(raw_frame, 1);
+    return_to_idle(state);
+    return bytes_consumed;
+  }
 
-    channel_pool = amqp_get_or_create_channel_pool(state, decoded_frame->channel);
-    if (NULL == channel_pool) {
-      return AMQP_STATUS_NO_MEMORY;
-    }
+  case CONNECTION_STATE_BODY_SINK:
+    return finish_body_sink_frame(state, decoded_frame, bytes_consumed);
 
-    switch (decoded_frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      decoded_frame->payload.method.id = amqp_d32(raw_frame, HEADER_SIZE);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 4);
-      encoded.len = state->target_size - HEADER_SIZE - 4 - FOOTER_SIZE;
-
-      res = amqp_decode_method(decoded_frame->payload.method.id,
-                               channel_pool, encoded,
-                               &decoded_frame->payload.method.decoded);
-      if (res < 0) {
-        return res;
-      }
+  default:
+    amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
+    return bytes_consumed;
+  }
+}
 
-      break;
+int amqp_handle_input_in_place(amqp_connection_state_t state,
+                               amqp_frame_t *decoded_frame)
+{
+  size_t available;
+  size_t frame_size;
+  void *raw_frame;
+  int res;
 
-    case AMQP_FRAME_HEADER:
-      decoded_frame->payload.properties.class_id
-        = amqp_d16(raw_frame, HEADER_SIZE);
-      /* unused 2-byte weight field goes here */
-      decoded_frame->payload.properties.body_size
-        = amqp_d64(raw_frame, HEADER_SIZE + 4);
-      encoded.bytes = amqp_offset(raw_frame, HEADER_SIZE + 12);
-      encoded.len = state->target_size - HEADER_SIZE - 12 - FOOTER_SIZE;
-      decoded_frame->payload.properties.raw = encoded;
-
-      res = amqp_decode_properties(decoded_frame->payload.properties.class_id,
-                                   channel_pool, encoded,
-                                   &decoded_frame->payload.properties.decoded);
-      if (res < 0) {
-        return res;
-      }
+  decoded_frame->frame_type = 0;
 
-      break;
+  if (!state->decode_in_place || state->state != CONNECTION_STATE_IDLE) {
+    return 0;
+  }
 
-    case AMQP_FRAME_BODY:
-      decoded_frame->payload.body_fragment.len
-        = state->target_size - HEADER_SIZE - FOOTER_SIZE;
-      decoded_frame->payload.body_fragment.bytes
-        = amqp_offset(raw_frame, HEADER_SIZE);
-      break;
+  available = state->sock_inbound_limit - state->sock_inbound_offset;
+  if (available < HEADER_SIZE + FOOTER_SIZE) {
+    return 0;
+  }
 
-    case AMQP_FRAME_HEARTBEAT:
-      break;
+  raw_frame = amqp_offset(state->sock_inbound_buffer.bytes,
+                          state->sock_inbound_offset);
+  frame_size = amqp_d32(raw_frame, 3);
+  if (frame_size > available - HEADER_SIZE - FOOTER_SIZE) {
+    /* Straddles a recv boundary, this one has to be copied */
+    return 0;
+  }
+  if (body_sink_accepts(state, amqp_d8(raw_frame, 0), amqp_d16(raw_frame, 1),
+                        frame_size)) {
+    /* Copying it into the sink is the one copy it needs anyway */
+    return 0;
+  }
+  frame_size += HEADER_SIZE + FOOTER_SIZE;
 
-    default:
-      /* Ignore the frame */
-      decoded_frame->frame_type = 0;
-      break;
+  res = decode_frame(state, raw_frame, frame_size, decoded_frame);
+  if (res < 0) {
+    return res;
+  }
+
+  switch (decoded_frame->frame_type) {
+  case AMQP_FRAME_METHOD:
+  case AMQP_FRAME_HEADER:
+  case AMQP_FRAME_BODY:
+    res = pin_sock_inbound_buffer(state, decoded_frame->channel);
+    if (res < 0) {
+      return res;
     }
+    break;
 
-    return_to_idle(state);
-    return bytes_consumed;
+  default:
+    /* Nothing in the decoded frame points into the buffer */
+    break;
+  }
+
+  return (int)frame_size;
+}
+
+amqp_boolean_t amqp_direct_input_buffer(amqp_connection_state_t state,
+                                        amqp_bytes_t *dest)
+{
+  if (CONNECTION_STATE_BODY != state->state
+      && CONNECTION_STATE_BODY_SINK != state->state) {
+    return 0;
   }
 
+  if (state->target_size - state->inbound_offset < DIRECT_INPUT_THRESHOLD) {
+    return 0;
+  }
+
+  dest->bytes = amqp_offset(state->inbound_buffer.bytes, state->inbound_offset);
+  dest->len = state->target_size - state->inbound_offset;
+  return 1;
+}
+
+int amqp_handle_direct_input(amqp_connection_state_t state, size_t len,
+                             amqp_frame_t *decoded_frame)
+{
+  int res;
+
+  decoded_frame->frame_type = 0;
+
+  state->inbound_offset += len;
+  if (state->inbound_offset < state->target_size) {
+    return AMQP_STATUS_OK;
+  }
+
+  switch (state->state) {
+  case CONNECTION_STATE_BODY:
+    res = decode_frame(state, state->inbound_buffer.bytes, state->target_size,
+                       decoded_frame);
+    if (res < 0) {
+      return res;
+    }
+    return_to_idle(state);
+    return AMQP_STATUS_OK;
+
+  case CONNECTION_STATE_BODY_SINK:
+    res = finish_body_sink_frame(state, decoded_frame, 0);
+    if (res < 0) {
+      return res;
+    }
+    return AMQP_STATUS_OK;
+
   default:
     amqp_abort("Internal error: invalid amqp_connection_state_t->state %d", state->state);
-    return bytes_consumed;
+    return AMQP_STATUS_OK;
   }
 }
 
@@ -379,6 +795,8 @@ void amqp_release_buffers(amqp_connection_state_t state)
       amqp_maybe_release_buffers_on_channel(state, entry->channel);
     }
   }
+
+  amqp_maybe_shrink_sock_inbound_buffer(state);
 }
 
 void amqp_maybe_release_buffers(amqp_connection_state_t state)
@@ -388,41 +806,234 @@ void amqp_maybe_release_buffers(amqp_connection_state_t state)
   }
 }
 
-void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state, amqp_channel_t channel)
+static amqp_boolean_t release_buffers_on_channel_ok(
+  amqp_connection_state_t state, amqp_channel_t channel)
 {
   amqp_link_t *queued_link;
-  amqp_pool_t *pool;
+
   if (CONNECTION_STATE_IDLE != state->state) {
-    return;
+    return 0;
   }
 
-  queued_link = state->first_queued_frame;
-
-  while (NULL != queued_link) {
+  for (queued_link = state->first_queued_frame; NULL != queued_link;
+       queued_link = queued_link->next) {
     amqp_frame_t *frame = queued_link->data;
     if (channel == frame->channel) {
-      return;
+      return 0;
     }
+  }
+  return 1;
+}
 
-    queued_link = queued_link->next;
+void amqp_maybe_release_buffers_on_channel(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry;
+
+  if (!release_buffers_on_channel_ok(state, channel)) {
+    return;
   }
 
-  pool = amqp_get_channel_pool(state, channel);
+  entry = amqp_get_channel_pool_entry(state, channel);
 
-  if (pool != NULL) {
-    recycle_amqp_pool(pool);
+  if (entry != NULL) {
+    unpin_channel_buffers(entry);
+    recycle_amqp_pool(&entry->pool);
   }
 }
 
-int amqp_send_frame(amqp_connection_state_t state,
-                    const amqp_frame_t *frame)
+/* Blocks taken from a channel pool, and the pinned socket buffers that
+ * frames in them point into. The links are in the blocks. */
+struct amqp_retained_buffers_t_ {
+  uint64_t refcount;
+  amqp_pool_blocklist_t blocks;
+  amqp_link_t *pinned_buffers;
+};
+
+int amqp_retain_buffers_on_channel(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_retained_buffers_t **retained)
 {
-  void *out_frame = state->outbound_buffer.bytes;
+  amqp_pool_table_entry_t *entry;
+  amqp_retained_buffers_t *r;
+
+  *retained = NULL;
+  if (!release_buffers_on_channel_ok(state, channel)) {
+    return AMQP_STATUS_UNEXPECTED_STATE;
+  }
+
+  r = amqp_calloc(1, sizeof(amqp_retained_buffers_t));
+  if (NULL == r) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  r->refcount = 1;
+
+  entry = amqp_get_channel_pool_entry(state, channel);
+  if (NULL != entry) {
+    if (!amqp_pool_take_blocks(&entry->pool, &r->blocks)) {
+      amqp_pool_free_blocks(&r->blocks);
+      amqp_free(r);
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    r->pinned_buffers = entry->pinned_buffers;
+    entry->pinned_buffers = NULL;
+  }
+
+  *retained = r;
+  return AMQP_STATUS_OK;
+}
+
+void amqp_retained_buffers_add_ref(amqp_retained_buffers_t *retained)
+{
+  atomic_add64(&retained->refcount, 1);
+}
+
+void amqp_release_retained_buffers(amqp_retained_buffers_t *retained)
+{
+  amqp_link_t *link;
+
+  if (atomic_add64(&retained->refcount, (uint64_t)-1) != 1) {
+    return;
+  }
+
+  for (link = retained->pinned_buffers; NULL != link; link = link->next) {
+    amqp_release_pinned_buffer(link->data);
+  }
+  amqp_pool_free_blocks(&retained->blocks);
+  amqp_free(retained);
+}
+
+void amqp_set_large_block_cache(amqp_connection_state_t state,
+                                size_t max_bytes)
+{
+  int i;
+
+  state->large_block_cache_max = max_bytes;
+
+  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
+    amqp_pool_table_entry_t *entry = state->pool_table[i];
+
+    for ( ; NULL != entry; entry = entry->next) {
+      amqp_pool_set_large_cache(&entry->pool, max_bytes);
+    }
+  }
+}
+
+void amqp_trim_buffers(amqp_connection_state_t state)
+{
+  int i;
+
+  for (i = 0; i < POOL_TABLE_SIZE; ++i) {
+    amqp_pool_table_entry_t *entry = state->pool_table[i];
+
+    for ( ; NULL != entry; entry = entry->next) {
+      amqp_pool_trim(&entry->pool);
+    }
+  }
+}
+
+int amqp_encode_frame(amqp_bytes_t encoded, const amqp_frame_t *frame)
+{
+  void *out_frame = encoded.bytes;
+  size_t out_frame_len;
+  amqp_bytes_t payload;
   int res;
 
+  if (encoded.len < HEADER_SIZE + FOOTER_SIZE) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
   amqp_e8(out_frame, 0, frame->frame_type);
   amqp_e16(out_frame, 1, frame->channel);
 
+  switch (frame->frame_type) {
+  case AMQP_FRAME_BODY:
+    out_frame_len = frame->payload.body_fragment.len;
+    if (out_frame_len > encoded.len - HEADER_SIZE - FOOTER_SIZE) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+
+    memcpy(amqp_offset(out_frame, HEADER_SIZE),
+           frame->payload.body_fragment.bytes, out_frame_len);
+    break;
+
+  case AMQP_FRAME_METHOD:
+    if (encoded.len < HEADER_SIZE + 4 + FOOTER_SIZE) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+
+    amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+
+    payload.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
+    payload.len = encoded.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+
+    res = amqp_encode_method(frame->payload.method.id,
+                             frame->payload.method.decoded, payload);
+    if (res < 0) {
+      return res;
+    }
+
+    out_frame_len = res + 4;
+    break;
+
+  case AMQP_FRAME_HEADER:
+    if (encoded.len < HEADER_SIZE + 12 + FOOTER_SIZE) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+
+    amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
+    amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
+    amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+
+    payload.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
+    payload.len = encoded.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+
+    res = amqp_encode_properties(frame->payload.properties.class_id,
+                                 frame->payload.properties.decoded, payload);
+    if (res < 0) {
+      return res;
+    }
+
+    out_frame_len = res + 12;
+    break;
+
+  case AMQP_FRAME_HEARTBEAT:
+    out_frame_len = 0;
+    break;
+
+  default:
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  amqp_e32(out_frame, 3, out_frame_len);
+  amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
+
+  return (int)(out_frame_len + HEADER_SIZE + FOOTER_SIZE);
+}
+
+int amqp_send_frame(amqp_connection_state_t state,
+                    const amqp_frame_t *frame)
+{
+  /* Any batched messages and held acks go out in front of the frame, in the
+   * same write */
+  size_t pending;
+  void *out_frame;
+  int res;
+
+  res = amqp_ack_coalesce_encode(state, frame);
+  if (res < 0) {
+    return res;
+  }
+  pending = state->outbound_offset;
+
+  if (pending > 0) {
+    res = amqp_reserve_outbound_buffer(state, state->frame_max);
+    if (res < 0) {
+      return res;
+    }
+  }
+
+  out_frame = amqp_offset(state->outbound_buffer.bytes, pending);
+
   if (frame->frame_type == AMQP_FRAME_BODY) {
     /* For a body frame, rather than copying data around, we use
        writev to compose the frame */
@@ -430,66 +1041,171 @@ int amqp_send_frame(amqp_connection_state_t state,
     uint8_t frame_end_byte = AMQP_FRAME_END;
     const amqp_bytes_t *body = &frame->payload.body_fragment;
 
+    amqp_e8(out_frame, 0, frame->frame_type);
+    amqp_e16(out_frame, 1, frame->channel);
     amqp_e32(out_frame, 3, body->len);
 
-    iov[0].iov_base = out_frame;
-    iov[0].iov_len = HEADER_SIZE;
+    iov[0].iov_base = state->outbound_buffer.bytes;
+    iov[0].iov_len = pending + HEADER_SIZE;
     iov[1].iov_base = body->bytes;
     iov[1].iov_len = body->len;
     iov[2].iov_base = &frame_end_byte;
     iov[2].iov_len = FOOTER_SIZE;
 
+    state->outbound_offset = 0;
+    state->outbound_messages = 0;
+    amqp_tcp_socket_set_zerocopy_range(state->socket, body->bytes, body->len);
     res = amqp_socket_writev(state->socket, iov, 3);
+    amqp_tcp_socket_set_zerocopy_range(state->socket, NULL, 0);
   } else {
-    size_t out_frame_len;
     amqp_bytes_t encoded;
 
-    switch (frame->frame_type) {
-    case AMQP_FRAME_METHOD:
-      amqp_e32(out_frame, HEADER_SIZE, frame->payload.method.id);
+    encoded.bytes = out_frame;
+    encoded.len = state->outbound_buffer.len - pending;
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 4);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 4 - FOOTER_SIZE;
+    res = amqp_encode_frame(encoded, frame);
+    if (res < 0) {
+      return res;
+    }
 
-      res = amqp_encode_method(frame->payload.method.id,
-                               frame->payload.method.decoded, encoded);
-      if (res < 0) {
-        return res;
-      }
+    state->outbound_offset = 0;
+    state->outbound_messages = 0;
+    res = amqp_socket_send(state->socket, state->outbound_buffer.bytes,
+                           pending + res);
+  }
 
-      out_frame_len = res + 4;
-      break;
+  return res;
+}
 
-    case AMQP_FRAME_HEADER:
-      amqp_e16(out_frame, HEADER_SIZE, frame->payload.properties.class_id);
-      amqp_e16(out_frame, HEADER_SIZE+2, 0); /* "weight" */
-      amqp_e64(out_frame, HEADER_SIZE+4, frame->payload.properties.body_size);
+int amqp_append_method(amqp_connection_state_t state, amqp_channel_t channel,
+                       amqp_method_number_t id, void *decoded)
+{
+  amqp_frame_t frame;
+  amqp_bytes_t encoded;
+  int res;
 
-      encoded.bytes = amqp_offset(out_frame, HEADER_SIZE + 12);
-      encoded.len = state->outbound_buffer.len - HEADER_SIZE - 12 - FOOTER_SIZE;
+  /* Settling methods are small, frame_max bounds the rest */
+  res = amqp_reserve_outbound_buffer(state, state->frame_max);
+  if (res < 0) {
+    return res;
+  }
 
-      res = amqp_encode_properties(frame->payload.properties.class_id,
-                                   frame->payload.properties.decoded, encoded);
-      if (res < 0) {
-        return res;
-      }
+  frame.frame_type = AMQP_FRAME_METHOD;
+  frame.channel = channel;
+  frame.payload.method.id = id;
+  frame.payload.method.decoded = decoded;
+
+  encoded.bytes = amqp_offset(state->outbound_buffer.bytes,
+                              state->outbound_offset);
+  encoded.len = state->outbound_buffer.len - state->outbound_offset;
+  res = amqp_encode_frame(encoded, &frame);
+  if (res < 0) {
+    return res;
+  }
+  state->outbound_offset += res;
+  return AMQP_STATUS_OK;
+}
 
-      out_frame_len = res + 12;
-      break;
+int amqp_reserve_outbound_buffer(amqp_connection_state_t state, size_t amount)
+{
+  size_t needed = state->outbound_offset + amount;
+  size_t newlen = state->outbound_buffer.len;
+  void *newbuf;
 
-    case AMQP_FRAME_HEARTBEAT:
-      out_frame_len = 0;
-      break;
+  if (needed <= newlen) {
+    return AMQP_STATUS_OK;
+  }
 
-    default:
-      return AMQP_STATUS_INVALID_PARAMETER;
-    }
+  while (newlen < needed) {
+    newlen *= 2;
+  }
 
-    amqp_e32(out_frame, 3, out_frame_len);
-    amqp_e8(out_frame, out_frame_len + HEADER_SIZE, AMQP_FRAME_END);
-    res = amqp_socket_send(state->socket, out_frame,
-                           out_frame_len + HEADER_SIZE + FOOTER_SIZE);
+  newbuf = amqp_realloc(state->outbound_buffer.bytes, newlen);
+  if (newbuf == NULL) {
+    return AMQP_STATUS_NO_MEMORY;
   }
 
-  return res;
+  state->outbound_buffer.bytes = newbuf;
+  state->outbound_buffer.len = newlen;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_flush(amqp_connection_state_t state)
+{
+  size_t pending;
+  int res;
+
+  res = amqp_ack_coalesce_encode(state, NULL);
+  if (res < 0) {
+    return res;
+  }
+  pending = state->outbound_offset;
+
+  if (0 == pending) {
+    return AMQP_STATUS_OK;
+  }
+
+  state->outbound_offset = 0;
+  state->outbound_messages = 0;
+
+  return amqp_socket_send(state->socket, state->outbound_buffer.bytes,
+                          pending);
+}
+
+int amqp_flush_expired(amqp_connection_state_t state)
+{
+  uint64_t deadline = amqp_ack_coalesce_deadline(state);
+  uint64_t now;
+
+  if (state->outbound_messages > 0 && state->batch_max_latency > 0
+      && (0 == deadline || state->outbound_deadline < deadline)) {
+    deadline = state->outbound_deadline;
+  }
+  if (0 == deadline) {
+    return AMQP_STATUS_OK;
+  }
+
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+
+  return now >= deadline ? amqp_flush(state) : AMQP_STATUS_OK;
+}
+
+int amqp_set_publish_batching(amqp_connection_state_t state,
+                              size_t max_bytes, int max_messages,
+                              struct timeval *max_latency)
+{
+  int res;
+
+  if (max_messages < 0 || (max_latency != NULL
+                           && (max_latency->tv_sec < 0
+                               || max_latency->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  res = amqp_flush(state);
+  if (res < 0) {
+    return res;
+  }
+
+  state->batch_max_bytes = max_bytes;
+  state->batch_max_messages = max_messages;
+  state->batch_max_latency = 0;
+  if (max_latency != NULL) {
+    state->batch_max_latency = (uint64_t)max_latency->tv_sec * AMQP_NS_PER_S +
+                               (uint64_t)max_latency->tv_usec * AMQP_NS_PER_US;
+  }
+
+  /* Give back what batching grew the outbound buffer to */
+  if (0 == max_bytes && state->outbound_buffer.len > (size_t)state->frame_max) {
+    void *newbuf = amqp_realloc(state->outbound_buffer.bytes, state->frame_max);
+    if (newbuf != NULL) {
+      state->outbound_buffer.bytes = newbuf;
+      state->outbound_buffer.len = state->frame_max;
+    }
+  }
+
+  return AMQP_STATUS_OK;
 }
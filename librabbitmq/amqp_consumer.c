@@ -0,0 +1,731 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * Copyright 2013 Alan Antonuk
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amqp_private.h"
+#include "amqp_timer.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGE_POOL_PAGE_SIZE 4096
+
+static int pool_bytes_dup(amqp_pool_t *pool, amqp_bytes_t src,
+                          amqp_bytes_t *dest)
+{
+  if (0 == src.len) {
+    *dest = amqp_empty_bytes;
+    return AMQP_STATUS_OK;
+  }
+
+  amqp_pool_alloc_bytes(pool, src.len, dest);
+  if (NULL == dest->bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  memcpy(dest->bytes, src.bytes, src.len);
+  return AMQP_STATUS_OK;
+}
+
+/* Leaves frame to be returned by the next amqp_simple_wait_frame() */
+static int unexpected_frame(amqp_connection_state_t state,
+                            amqp_frame_t *frame)
+{
+  int res = amqp_put_back_frame(state, frame);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+  return AMQP_STATUS_UNEXPECTED_STATE;
+}
+
+static int read_message_into(amqp_connection_state_t state,
+                             amqp_channel_t channel,
+                             amqp_message_t *message)
+{
+  amqp_frame_t frame;
+  amqp_bytes_t raw;
+  amqp_bytes_t sink;
+  void *decoded;
+  uint64_t body_size;
+  size_t body_read;
+  int res;
+
+  res = amqp_simple_wait_content_frame(state, channel, &frame);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (AMQP_FRAME_HEADER != frame.frame_type
+      || AMQP_BASIC_CLASS != frame.payload.properties.class_id) {
+    return unexpected_frame(state, &frame);
+  }
+
+  /* Decode the properties again from a copy of the raw bytes so that
+   * nothing in them points into the connection's buffers */
+  res = pool_bytes_dup(&message->pool, frame.payload.properties.raw, &raw);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_decode_properties(AMQP_BASIC_CLASS, &message->pool, raw, &decoded);
+  if (res < 0) {
+    return res;
+  }
+  message->properties = *(amqp_basic_properties_t *)decoded;
+
+  body_size = frame.payload.properties.body_size;
+  if (body_size > SIZE_MAX - FOOTER_SIZE) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  /* One extra byte for the frame end of the last body frame to land on */
+  amqp_pool_alloc_bytes(&message->pool, (size_t)body_size + FOOTER_SIZE,
+                        &message->body);
+  if (NULL == message->body.bytes) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+  message->body.len = (size_t)body_size;
+
+  for (body_read = 0; body_read < message->body.len;
+       body_read += frame.payload.body_fragment.len) {
+    sink.bytes = amqp_offset(message->body.bytes, body_read);
+    sink.len = message->body.len - body_read + FOOTER_SIZE;
+
+    amqp_set_body_sink(state, channel, sink);
+    res = amqp_simple_wait_content_frame(state, channel, &frame);
+    amqp_set_body_sink(state, channel, amqp_empty_bytes);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (AMQP_FRAME_BODY != frame.frame_type) {
+      return unexpected_frame(state, &frame);
+    }
+
+    if (frame.payload.body_fragment.len > message->body.len - body_read) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+
+    /* Frames that were already queued or buffered before the sink was set
+     * up were read elsewhere */
+    if (frame.payload.body_fragment.bytes != sink.bytes) {
+      memcpy(sink.bytes, frame.payload.body_fragment.bytes,
+             frame.payload.body_fragment.len);
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_read_message(amqp_connection_state_t state,
+                      amqp_channel_t channel,
+                      amqp_message_t *message)
+{
+  int res;
+
+  memset(message, 0, sizeof(amqp_message_t));
+  init_amqp_pool(&message->pool, MESSAGE_POOL_PAGE_SIZE);
+  /* Message pools are emptied rather than recycled, so rounding the body's
+   * block up to a size class would only waste memory */
+  amqp_pool_set_large_cache(&message->pool, 0);
+
+  res = read_message_into(state, channel, message);
+  if (AMQP_STATUS_OK != res) {
+    amqp_destroy_message(message);
+  }
+
+  return res;
+}
+
+int amqp_consume_message(amqp_connection_state_t state,
+                         amqp_envelope_t *envelope,
+                         struct timeval *timeout)
+{
+  amqp_frame_t frame;
+  amqp_basic_deliver_t *deliver;
+  int res;
+
+  memset(envelope, 0, sizeof(amqp_envelope_t));
+
+  res = amqp_simple_wait_frame_noblock(state, &frame, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  if (AMQP_FRAME_METHOD != frame.frame_type
+      || AMQP_BASIC_DELIVER_METHOD != frame.payload.method.id) {
+    return unexpected_frame(state, &frame);
+  }
+
+  deliver = frame.payload.method.decoded;
+
+  init_amqp_pool(&envelope->message.pool, MESSAGE_POOL_PAGE_SIZE);
+  amqp_pool_set_large_cache(&envelope->message.pool, 0);
+
+  envelope->channel = frame.channel;
+  envelope->delivery_tag = deliver->delivery_tag;
+  envelope->redelivered = deliver->redelivered;
+
+  res = pool_bytes_dup(&envelope->message.pool, deliver->consumer_tag,
+                       &envelope->consumer_tag);
+  if (AMQP_STATUS_OK != res) {
+    goto error_out;
+  }
+  res = pool_bytes_dup(&envelope->message.pool, deliver->exchange,
+                       &envelope->exchange);
+  if (AMQP_STATUS_OK != res) {
+    goto error_out;
+  }
+  res = pool_bytes_dup(&envelope->message.pool, deliver->routing_key,
+                       &envelope->routing_key);
+  if (AMQP_STATUS_OK != res) {
+    goto error_out;
+  }
+
+  res = read_message_into(state, envelope->channel, &envelope->message);
+  if (AMQP_STATUS_OK != res) {
+    goto error_out;
+  }
+
+  return AMQP_STATUS_OK;
+
+error_out:
+  amqp_destroy_envelope(envelope);
+  return res;
+}
+
+void amqp_destroy_message(amqp_message_t *message)
+{
+  empty_amqp_pool(&message->pool);
+  message->body = amqp_empty_bytes;
+}
+
+void amqp_destroy_envelope(amqp_envelope_t *envelope)
+{
+  amqp_destroy_message(&envelope->message);
+  envelope->consumer_tag = amqp_empty_bytes;
+  envelope->exchange = amqp_empty_bytes;
+  envelope->routing_key = amqp_empty_bytes;
+}
+
+static amqp_ack_coalescer_t *find_coalescer(amqp_connection_state_t state,
+    amqp_channel_t channel)
+{
+  amqp_ack_coalescer_t *c;
+
+  for (c = state->ack_coalescers; NULL != c; c = c->next) {
+    if (c->channel == channel) {
+      return c;
+    }
+  }
+  return NULL;
+}
+
+int amqp_set_ack_coalescing(amqp_connection_state_t state,
+                            amqp_channel_t channel, int max_acks,
+                            struct timeval *max_latency)
+{
+  amqp_ack_coalescer_t **link;
+  amqp_ack_coalescer_t *c;
+  int res;
+
+  if (max_acks < 0 || (max_latency != NULL
+                       && (max_latency->tv_sec < 0
+                           || max_latency->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  for (link = &state->ack_coalescers; NULL != *link; link = &(*link)->next) {
+    if ((*link)->channel == channel) {
+      break;
+    }
+  }
+  c = *link;
+
+  if (0 == max_acks) {
+    if (NULL == c) {
+      return AMQP_STATUS_OK;
+    }
+    res = amqp_flush(state);
+    if (res < 0) {
+      return res;
+    }
+    *link = c->next;
+    amqp_free(c);
+    return AMQP_STATUS_OK;
+  }
+
+  if (NULL == c) {
+    c = amqp_calloc(1, sizeof(amqp_ack_coalescer_t));
+    if (NULL == c) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
+    c->channel = channel;
+    c->next = state->ack_coalescers;
+    state->ack_coalescers = c;
+  }
+
+  c->max_acks = max_acks;
+  c->max_latency = 0;
+  if (max_latency != NULL) {
+    c->max_latency = (uint64_t)max_latency->tv_sec * AMQP_NS_PER_S +
+                     (uint64_t)max_latency->tv_usec * AMQP_NS_PER_US;
+  }
+  return AMQP_STATUS_OK;
+}
+
+/* Moves held_through up to delivery_tag, which is past it */
+static void coalescer_advance(amqp_ack_coalescer_t *c, uint64_t delivery_tag)
+{
+  uint64_t shift = delivery_tag - c->held_through;
+
+  c->ahead = shift < 64 ? c->ahead >> shift : 0;
+  c->held_through = delivery_tag;
+
+  /* Re-base on deliveries already settled on their own right after it, so
+   * that acks after them can be held again */
+  while (c->ahead & 1) {
+    c->held_through++;
+    c->ahead >>= 1;
+  }
+  if (0 == c->held_acks) {
+    c->acked_through = c->held_through;
+  }
+}
+
+int amqp_ack_coalesce(amqp_connection_state_t state, amqp_channel_t channel,
+                      uint64_t delivery_tag, amqp_boolean_t multiple)
+{
+  amqp_ack_coalescer_t *c = find_coalescer(state, channel);
+
+  if (NULL == c) {
+    return 0;
+  }
+
+  /* A single ack can only be folded into a multiple one if every delivery
+   * before it is settled, a multiple ack if it covers something new */
+  if (multiple ? delivery_tag <= c->held_through
+      : delivery_tag != c->held_through + 1) {
+    return 0;
+  }
+
+  c->held_acks++;
+  c->last_held = delivery_tag;
+  coalescer_advance(c, delivery_tag);
+
+  if (c->held_acks >= c->max_acks) {
+    int res = amqp_flush(state);
+    return res < 0 ? res : 1;
+  }
+
+  if (c->max_latency > 0) {
+    uint64_t now = amqp_get_monotonic_timestamp();
+    if (0 == now) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+
+    if (1 == c->held_acks) {
+      c->deadline = now + c->max_latency;
+    } else if (now >= c->deadline) {
+      int res = amqp_flush(state);
+      return res < 0 ? res : 1;
+    }
+  }
+
+  return 1;
+}
+
+void amqp_ack_coalesce_settled(amqp_connection_state_t state,
+                               amqp_channel_t channel, uint64_t delivery_tag,
+                               amqp_boolean_t multiple)
+{
+  amqp_ack_coalescer_t *c = find_coalescer(state, channel);
+
+  if (NULL == c || delivery_tag <= c->held_through) {
+    return;
+  }
+
+  if (multiple || delivery_tag == c->held_through + 1) {
+    coalescer_advance(c, delivery_tag);
+  } else if (delivery_tag - c->held_through - 1 < 64) {
+    /* Can't be held past yet, there are unsettled deliveries before it */
+    c->ahead |= (uint64_t)1 << (delivery_tag - c->held_through - 1);
+  }
+}
+
+uint64_t amqp_ack_coalesce_deadline(amqp_connection_state_t state)
+{
+  amqp_ack_coalescer_t *c;
+  uint64_t deadline = 0;
+
+  for (c = state->ack_coalescers; NULL != c; c = c->next) {
+    if (c->held_acks > 0 && c->max_latency > 0
+        && (0 == deadline || c->deadline < deadline)) {
+      deadline = c->deadline;
+    }
+  }
+  return deadline;
+}
+
+/* Appends a basic.ack frame to the unsent frames in outbound_buffer */
+static int encode_ack(amqp_connection_state_t state, amqp_channel_t channel,
+                      uint64_t delivery_tag, amqp_boolean_t multiple)
+{
+  amqp_basic_ack_t m;
+
+  m.delivery_tag = delivery_tag;
+  m.multiple = multiple;
+  return amqp_append_method(state, channel, AMQP_BASIC_ACK_METHOD, &m);
+}
+
+int amqp_ack_coalesce_append(amqp_connection_state_t state)
+{
+  amqp_ack_coalescer_t *c;
+  int res;
+
+  for (c = state->ack_coalescers; NULL != c; c = c->next) {
+    if (c->held_acks > 0) {
+      res = encode_ack(state, c->channel, c->last_held, 1);
+      if (res < 0) {
+        return res;
+      }
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+void amqp_ack_coalesce_sent(amqp_connection_state_t state)
+{
+  amqp_ack_coalescer_t *c;
+
+  for (c = state->ack_coalescers; NULL != c; c = c->next) {
+    if (c->held_acks > 0) {
+      c->acked_through = c->held_through;
+      c->held_acks = 0;
+    }
+  }
+}
+
+int amqp_ack_coalesce_encode(amqp_connection_state_t state,
+                             const amqp_frame_t *next_frame)
+{
+  amqp_ack_coalescer_t *c;
+  int res;
+
+  res = amqp_ack_coalesce_append(state);
+  if (res < 0) {
+    return res;
+  }
+  amqp_ack_coalesce_sent(state);
+
+  for (c = state->ack_coalescers; NULL != c; c = c->next) {
+    /* Delivery tags start over on a channel that is opened again */
+    if (NULL != next_frame && next_frame->channel == c->channel
+        && AMQP_FRAME_METHOD == next_frame->frame_type
+        && AMQP_CHANNEL_OPEN_METHOD == next_frame->payload.method.id) {
+      c->acked_through = 0;
+      c->held_through = 0;
+      c->ahead = 0;
+    }
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+void amqp_ack_coalesce_destroy(amqp_connection_state_t state)
+{
+  while (NULL != state->ack_coalescers) {
+    amqp_ack_coalescer_t *c = state->ack_coalescers;
+    state->ack_coalescers = c->next;
+    amqp_free(c);
+  }
+}
+
+/* The completion bits are set from any thread, and only cleared, along
+ * with advancing base, by the thread flushing the tracker */
+struct amqp_ack_tracker_t_ {
+  amqp_channel_t channel;
+  /* the oldest delivery not acked yet */
+  uint64_t base;
+  /* bits in the rings, a power of two and a multiple of 64 */
+  uint64_t capacity;
+  /* deliveries completed, indexed by delivery tag modulo capacity */
+  uint64_t *done;
+  /* deliveries past the first incomplete one that were acked on their own */
+  uint64_t *sent;
+  /* how many completions past a gap are held, and for how long (ns, 0 for
+   * no limit), before they are acked on their own */
+  int max_held;
+  uint64_t max_age;
+  /* the base that deliveries are held past, and since when */
+  uint64_t gap_base;
+  uint64_t gap_since;
+};
+
+/* Mask of n bits starting at bit, n + bit <= 64 */
+static uint64_t bit_range(unsigned bit, unsigned n)
+{
+  return (64 == n ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << bit;
+}
+
+amqp_ack_tracker_t *amqp_ack_tracker_new(amqp_channel_t channel,
+    int max_unacked)
+{
+  amqp_ack_tracker_t *tracker;
+
+  if (max_unacked <= 0) {
+    return NULL;
+  }
+
+  tracker = amqp_calloc(1, sizeof(amqp_ack_tracker_t));
+  if (NULL == tracker) {
+    return NULL;
+  }
+
+  tracker->channel = channel;
+  tracker->base = 1;
+  tracker->max_held = max_unacked / 2;
+  tracker->capacity = 64;
+  while (tracker->capacity < (uint64_t)max_unacked) {
+    tracker->capacity *= 2;
+  }
+  tracker->done = amqp_calloc((size_t)(tracker->capacity / 64), sizeof(uint64_t));
+  tracker->sent = amqp_calloc((size_t)(tracker->capacity / 64), sizeof(uint64_t));
+  if (NULL == tracker->done || NULL == tracker->sent) {
+    amqp_ack_tracker_free(tracker);
+    return NULL;
+  }
+
+  return tracker;
+}
+
+void amqp_ack_tracker_free(amqp_ack_tracker_t *tracker)
+{
+  if (NULL != tracker) {
+    amqp_free(tracker->done);
+    amqp_free(tracker->sent);
+    amqp_free(tracker);
+  }
+}
+
+int amqp_ack_tracker_complete(amqp_ack_tracker_t *tracker,
+                              uint64_t delivery_tag)
+{
+  /* A stale base is lower than the real one, which only makes this
+   * stricter */
+  uint64_t base = atomic_add64(&tracker->base, 0);
+  uint64_t index;
+
+  if (delivery_tag < base || delivery_tag - base >= tracker->capacity) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  index = delivery_tag & (tracker->capacity - 1);
+  atomic_or64(&tracker->done[index / 64], (uint64_t)1 << (index % 64));
+  return AMQP_STATUS_OK;
+}
+
+int amqp_ack_tracker_set_gap_limits(amqp_ack_tracker_t *tracker,
+                                    int max_held,
+                                    struct timeval *max_age)
+{
+  if (max_held < 0 || (NULL != max_age
+                       && (max_age->tv_sec < 0 || max_age->tv_usec < 0))) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  tracker->max_held = max_held;
+  tracker->max_age = NULL == max_age ? 0 :
+                     (uint64_t)max_age->tv_sec * AMQP_NS_PER_S +
+                     (uint64_t)max_age->tv_usec * AMQP_NS_PER_US;
+  return AMQP_STATUS_OK;
+}
+
+/* Whether the completions held past the first incomplete delivery should
+ * be acked on their own now */
+static int ack_tracker_gap_expired(amqp_ack_tracker_t *tracker,
+                                   uint64_t base, uint64_t held)
+{
+  uint64_t now;
+
+  if (0 == held) {
+    return 0;
+  }
+  if (held >= (uint64_t)tracker->max_held) {
+    return 1;
+  }
+  if (0 == tracker->max_age) {
+    return 0;
+  }
+
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  if (0 == tracker->gap_since || tracker->gap_base != base) {
+    tracker->gap_base = base;
+    tracker->gap_since = now;
+    return 0;
+  }
+  return now - tracker->gap_since >= tracker->max_age;
+}
+
+int amqp_ack_tracker_flush(amqp_connection_state_t state,
+                           amqp_ack_tracker_t *tracker)
+{
+  uint64_t mask = tracker->capacity - 1;
+  uint64_t start = atomic_add64(&tracker->base, 0);
+  uint64_t base = start;
+  uint64_t end = base + tracker->capacity;
+  uint64_t last_unsent = 0;
+  uint64_t held;
+  amqp_boolean_t encoded = 0;
+  uint64_t seq;
+  int res;
+
+  /* Find the run of completed deliveries at base, and the last one in it
+   * that still needs acking */
+  for (seq = base; seq < end; ) {
+    uint64_t index = seq & mask;
+    unsigned bit = (unsigned)(index % 64);
+    unsigned n = 64 - bit;
+    uint64_t range = bit_range(bit, n);
+    uint64_t done = atomic_or64(&tracker->done[index / 64], 0) & range;
+    uint64_t unsent;
+    unsigned run;
+
+    if (done == range) {
+      run = n;
+    } else {
+      for (run = 0; done & ((uint64_t)1 << (bit + run)); ++run) {
+      }
+      range = bit_range(bit, run);
+    }
+
+    unsent = range & ~tracker->sent[index / 64];
+    if (0 != unsent) {
+      unsigned last = 63;
+      while (0 == (unsent & ((uint64_t)1 << last))) {
+        --last;
+      }
+      last_unsent = seq + (last - bit);
+    }
+
+    seq += run;
+    if (run < n) {
+      break;
+    }
+  }
+
+  if (0 != last_unsent) {
+    res = encode_ack(state, tracker->channel, last_unsent, 1);
+    if (res < 0) {
+      return res;
+    }
+    encoded = 1;
+  }
+
+  /* Forget the run before moving base past it, so that completions of the
+   * deliveries that come to use the same bits are not lost */
+  while (base < seq) {
+    uint64_t index = base & mask;
+    unsigned bit = (unsigned)(index % 64);
+    unsigned n = 64 - bit;
+    uint64_t range;
+
+    if (n > seq - base) {
+      n = (unsigned)(seq - base);
+    }
+    range = bit_range(bit, n);
+    atomic_and64(&tracker->done[index / 64], ~range);
+    tracker->sent[index / 64] &= ~range;
+    base += n;
+  }
+  atomic_add64(&tracker->base, base - start);
+
+  /* Deliveries completed past the first incomplete one can't be covered by
+   * a multiple ack. Keep them for one once the gap closes, unless too many
+   * have piled up or the gap is too old. */
+  end = base + tracker->capacity;
+  held = 0;
+  for (seq = base + 1; seq < end; ) {
+    uint64_t index = seq & mask;
+    unsigned bit = (unsigned)(index % 64);
+    unsigned n = 64 - bit;
+    uint64_t pending;
+
+    if (n > end - seq) {
+      n = (unsigned)(end - seq);
+    }
+    pending = atomic_or64(&tracker->done[index / 64], 0)
+              & ~tracker->sent[index / 64] & bit_range(bit, n);
+    for (; 0 != pending; pending &= pending - 1) {
+      ++held;
+    }
+
+    seq += n;
+  }
+
+  res = ack_tracker_gap_expired(tracker, base, held);
+  if (res < 0) {
+    return res;
+  }
+  if (0 == res) {
+    return encoded ? amqp_flush(state) : AMQP_STATUS_OK;
+  }
+
+  for (seq = base + 1; seq < end; ) {
+    uint64_t index = seq & mask;
+    unsigned bit = (unsigned)(index % 64);
+    unsigned n = 64 - bit;
+    uint64_t pending;
+    unsigned i;
+
+    if (n > end - seq) {
+      n = (unsigned)(end - seq);
+    }
+    pending = atomic_or64(&tracker->done[index / 64], 0)
+              & ~tracker->sent[index / 64] & bit_range(bit, n);
+
+    for (i = 0; 0 != pending && i < n; ++i) {
+      uint64_t flag = (uint64_t)1 << (bit + i);
+      if (pending & flag) {
+        res = encode_ack(state, tracker->channel, seq + i, 0);
+        if (res < 0) {
+          return res;
+        }
+        tracker->sent[index / 64] |= flag;
+        pending &= ~flag;
+        encoded = 1;
+      }
+    }
+
+    seq += n;
+  }
+
+  return encoded ? amqp_flush(state) : AMQP_STATUS_OK;
+}
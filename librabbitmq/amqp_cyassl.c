@@ -80,8 +80,8 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_free(self->buffer);
+    self->buffer = amqp_malloc(bytes);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = AMQP_STATUS_NO_MEMORY;
@@ -135,8 +135,8 @@ amqp_ssl_socket_close(void *base)
   if (self) {
     CyaSSL_free(self->ssl);
     CyaSSL_CTX_free(self->ctx);
-    free(self->buffer);
-    free(self);
+    amqp_free(self->buffer);
+    amqp_free(self);
   }
   return status;
 }
@@ -194,7 +194,7 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
 amqp_socket_t *
 amqp_ssl_socket_new(void)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_ssl_socket_t *self = amqp_calloc(1, sizeof(*self));
   if (!self) {
     goto error;
   }
@@ -264,6 +264,58 @@ amqp_ssl_socket_set_verify(AMQP_UNUSED amqp_socket_t *base,
   /* noop for CyaSSL */
 }
 
+amqp_ssl_context_t *
+amqp_ssl_context_new(void)
+{
+  /* shared contexts are not implemented for CyaSSL */
+  return NULL;
+}
+
+void
+amqp_ssl_context_release(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+}
+
+int
+amqp_ssl_context_set_cacert(AMQP_UNUSED amqp_ssl_context_t *context,
+                            AMQP_UNUSED const char *cacert)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int
+amqp_ssl_context_set_key(AMQP_UNUSED amqp_ssl_context_t *context,
+                         AMQP_UNUSED const char *cert,
+                         AMQP_UNUSED const char *key)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+amqp_socket_t *
+amqp_ssl_socket_new_with_context(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+  return NULL;
+}
+
+amqp_boolean_t
+amqp_ssl_socket_session_reused(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
+void
+amqp_ssl_socket_set_ktls(AMQP_UNUSED amqp_socket_t *base,
+                         AMQP_UNUSED amqp_boolean_t enable)
+{
+  /* noop for CyaSSL */
+}
+
+int
+amqp_ssl_socket_get_ktls(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
 void
 amqp_set_initialize_ssl_library(AMQP_UNUSED amqp_boolean_t do_initialize)
 {
@@ -1013,6 +1013,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 10: {
       amqp_connection_properties_t *p = (amqp_connection_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_connection_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_connection_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1020,6 +1022,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 20: {
       amqp_channel_properties_t *p = (amqp_channel_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_channel_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_channel_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1027,6 +1031,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 30: {
       amqp_access_properties_t *p = (amqp_access_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_access_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_access_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1034,6 +1040,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 40: {
       amqp_exchange_properties_t *p = (amqp_exchange_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_exchange_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_exchange_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1041,6 +1049,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 50: {
       amqp_queue_properties_t *p = (amqp_queue_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_queue_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_queue_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1048,6 +1058,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 60: {
       amqp_basic_properties_t *p = (amqp_basic_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_basic_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_basic_properties_t));
       p->_flags = flags;
       if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
       {
@@ -1150,6 +1162,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 90: {
       amqp_tx_properties_t *p = (amqp_tx_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_tx_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_tx_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -1157,6 +1171,8 @@ int amqp_decode_properties(uint16_t class_id,
     case 85: {
       amqp_confirm_properties_t *p = (amqp_confirm_properties_t *) amqp_pool_alloc(pool, sizeof(amqp_confirm_properties_t));
       if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }
+      /* pool memory is not zeroed, absent properties must be */
+      memset(p, 0, sizeof(amqp_confirm_properties_t));
       p->_flags = flags;
       *decoded = p;
       return 0;
@@ -81,8 +81,8 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_free(self->buffer);
+    self->buffer = amqp_malloc(bytes);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = AMQP_STATUS_NO_MEMORY;
@@ -125,8 +125,8 @@ amqp_ssl_socket_open(void *base, const char *host, int port)
   int status;
   self->last_error = 0;
 
-  free(self->host);
-  self->host = strdup(host);
+  amqp_free(self->host);
+  self->host = amqp_strdup(host);
   if (NULL == self->host) {
     self->last_error = AMQP_STATUS_NO_MEMORY;
     return -1;
@@ -161,9 +161,9 @@ amqp_ssl_socket_close(void *base)
   if (self) {
     gnutls_deinit(self->session);
     gnutls_certificate_free_credentials(self->credentials);
-    free(self->host);
-    free(self->buffer);
-    free(self);
+    amqp_free(self->host);
+    amqp_free(self->buffer);
+    amqp_free(self);
   }
   return status;
 }
@@ -254,7 +254,7 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
 amqp_socket_t *
 amqp_ssl_socket_new(void)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_ssl_socket_t *self = amqp_calloc(1, sizeof(*self));
   const char *error;
   int status;
   if (!self) {
@@ -356,6 +356,58 @@ amqp_ssl_socket_set_verify(amqp_socket_t *base,
   }
 }
 
+amqp_ssl_context_t *
+amqp_ssl_context_new(void)
+{
+  /* shared contexts are not implemented for GnuTLS */
+  return NULL;
+}
+
+void
+amqp_ssl_context_release(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+}
+
+int
+amqp_ssl_context_set_cacert(AMQP_UNUSED amqp_ssl_context_t *context,
+                            AMQP_UNUSED const char *cacert)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int
+amqp_ssl_context_set_key(AMQP_UNUSED amqp_ssl_context_t *context,
+                         AMQP_UNUSED const char *cert,
+                         AMQP_UNUSED const char *key)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+amqp_socket_t *
+amqp_ssl_socket_new_with_context(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+  return NULL;
+}
+
+amqp_boolean_t
+amqp_ssl_socket_session_reused(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
+void
+amqp_ssl_socket_set_ktls(AMQP_UNUSED amqp_socket_t *base,
+                         AMQP_UNUSED amqp_boolean_t enable)
+{
+  /* noop for GnuTLS */
+}
+
+int
+amqp_ssl_socket_get_ktls(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
 void
 amqp_set_initialize_ssl_library(AMQP_UNUSED amqp_boolean_t do_initialize)
 {
@@ -40,6 +40,7 @@
 
 #include "amqp_private.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,15 +52,277 @@ char const *amqp_version(void)
   return VERSION; /* defined in config.h */
 }
 
+static void *AMQP_CALL libc_malloc(void *user_data, size_t size)
+{
+  (void)user_data;
+  return malloc(size);
+}
+
+static void *AMQP_CALL libc_calloc(void *user_data, size_t nmemb, size_t size)
+{
+  (void)user_data;
+  return calloc(nmemb, size);
+}
+
+static void *AMQP_CALL libc_realloc(void *user_data, void *ptr, size_t size)
+{
+  (void)user_data;
+  return realloc(ptr, size);
+}
+
+static void AMQP_CALL libc_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  free(ptr);
+}
+
+static amqp_allocator_t allocator = {
+  libc_malloc, libc_calloc, libc_realloc, libc_free, NULL
+};
+
+int amqp_set_allocator(const amqp_allocator_t *new_allocator)
+{
+  if (new_allocator == NULL) {
+    allocator.malloc_fn = libc_malloc;
+    allocator.calloc_fn = libc_calloc;
+    allocator.realloc_fn = libc_realloc;
+    allocator.free_fn = libc_free;
+    allocator.user_data = NULL;
+    return AMQP_STATUS_OK;
+  }
+
+  if (new_allocator->malloc_fn == NULL || new_allocator->calloc_fn == NULL
+      || new_allocator->realloc_fn == NULL || new_allocator->free_fn == NULL) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+  allocator = *new_allocator;
+  return AMQP_STATUS_OK;
+}
+
+#ifdef AMQP_ALLOC_STATS
+
+#define MAX_ALLOCATION_SITES 512
+
+/* Sites are claimed by setting site, never released. The name of a site
+ * is a string literal, so comparing pointers is enough. */
+static amqp_allocation_stats_t allocation_sites[MAX_ALLOCATION_SITES];
+
+/* Each allocation starts with the site it was made at and its size, in a
+ * header that keeps what follows as aligned as malloc() does */
+#define ALLOC_HEADER_SIZE 16
+
+typedef struct alloc_header_t_ {
+  amqp_allocation_stats_t *site;
+  size_t size;
+} alloc_header_t;
+
+static amqp_allocation_stats_t *find_allocation_site(const char *name)
+{
+  size_t start = ((size_t)name >> 3) % MAX_ALLOCATION_SITES;
+  size_t i;
+
+  for (i = 0; i < MAX_ALLOCATION_SITES; i++) {
+    amqp_allocation_stats_t *site =
+      &allocation_sites[(start + i) % MAX_ALLOCATION_SITES];
+    const char *current = site->site;
+
+    if (current == NULL) {
+      current = atomic_cas_ptr(&site->site, (const char *)NULL, name);
+      if (current == NULL) {
+        return site;
+      }
+    }
+    if (current == name) {
+      return site;
+    }
+  }
+  /* full, the allocation goes uncounted */
+  return NULL;
+}
+
+static void *count_allocation(void *block, size_t size, const char *name)
+{
+  alloc_header_t *header = block;
+
+  if (block == NULL) {
+    return NULL;
+  }
+
+  header->site = name != NULL ? find_allocation_site(name) : NULL;
+  header->size = size;
+  if (header->site != NULL) {
+    atomic_add64(&header->site->allocations, 1);
+    atomic_add64(&header->site->bytes_allocated, size);
+  }
+  return (char *)block + ALLOC_HEADER_SIZE;
+}
+
+static void count_free(alloc_header_t *header)
+{
+  if (header->site != NULL) {
+    atomic_add64(&header->site->frees, 1);
+    atomic_add64(&header->site->bytes_freed, header->size);
+  }
+}
+
+void *amqp_malloc_at(size_t size, const char *site)
+{
+  if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+    return NULL;
+  }
+  return count_allocation(
+           allocator.malloc_fn(allocator.user_data, ALLOC_HEADER_SIZE + size),
+           size, site);
+}
+
+void *amqp_calloc_at(size_t nmemb, size_t size, const char *site)
+{
+  if (size != 0 && nmemb > (SIZE_MAX - ALLOC_HEADER_SIZE) / size) {
+    return NULL;
+  }
+  return count_allocation(
+           allocator.calloc_fn(allocator.user_data, 1,
+                               ALLOC_HEADER_SIZE + nmemb * size),
+           nmemb * size, site);
+}
+
+void *amqp_realloc_at(void *ptr, size_t size, const char *site)
+{
+  alloc_header_t old_header;
+  void *block;
+
+  if (ptr == NULL) {
+    return amqp_malloc_at(size, site);
+  }
+  if (size > SIZE_MAX - ALLOC_HEADER_SIZE) {
+    return NULL;
+  }
+
+  block = (char *)ptr - ALLOC_HEADER_SIZE;
+  old_header = *(alloc_header_t *)block;
+  block = allocator.realloc_fn(allocator.user_data, block,
+                               ALLOC_HEADER_SIZE + size);
+  if (block == NULL) {
+    return NULL;
+  }
+  count_free(&old_header);
+  return count_allocation(block, size, site);
+}
+
+void amqp_free(void *ptr)
+{
+  void *block;
+
+  if (ptr == NULL) {
+    return;
+  }
+  block = (char *)ptr - ALLOC_HEADER_SIZE;
+  count_free(block);
+  allocator.free_fn(allocator.user_data, block);
+}
+
+int amqp_get_allocation_stats(amqp_allocation_stats_t *stats, int max_sites)
+{
+  int count = 0;
+  int i;
+
+  for (i = 0; i < MAX_ALLOCATION_SITES; i++) {
+    amqp_allocation_stats_t *site = &allocation_sites[i];
+
+    if (site->site == NULL) {
+      continue;
+    }
+    if (count < max_sites) {
+      stats[count].site = site->site;
+      stats[count].allocations = atomic_add64(&site->allocations, 0);
+      stats[count].frees = atomic_add64(&site->frees, 0);
+      stats[count].bytes_allocated = atomic_add64(&site->bytes_allocated, 0);
+      stats[count].bytes_freed = atomic_add64(&site->bytes_freed, 0);
+    }
+    count++;
+  }
+  return count;
+}
+
+#else
+
+void *amqp_malloc_at(size_t size, const char *site)
+{
+  (void)site;
+  return allocator.malloc_fn(allocator.user_data, size);
+}
+
+void *amqp_calloc_at(size_t nmemb, size_t size, const char *site)
+{
+  (void)site;
+  return allocator.calloc_fn(allocator.user_data, nmemb, size);
+}
+
+void *amqp_realloc_at(void *ptr, size_t size, const char *site)
+{
+  (void)site;
+  return allocator.realloc_fn(allocator.user_data, ptr, size);
+}
+
+void amqp_free(void *ptr)
+{
+  allocator.free_fn(allocator.user_data, ptr);
+}
+
+int amqp_get_allocation_stats(amqp_allocation_stats_t *stats, int max_sites)
+{
+  (void)stats;
+  (void)max_sites;
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+#endif
+
+char *amqp_strdup_at(const char *str, const char *site)
+{
+  size_t len = strlen(str) + 1;
+  char *copy = amqp_malloc_at(len, site);
+
+  if (copy != NULL) {
+    memcpy(copy, str, len);
+  }
+  return copy;
+}
+
+/* Large blocks start with their size, in a header that keeps what follows
+ * as aligned as malloc() does */
+#define LARGE_BLOCK_HEADER_SIZE 16
+
+/* Block lists start with this many entries and double when full */
+#define INITIAL_BLOCKLIST_CAPACITY 16
+
+/* Pool memory is handed out as is, neither pages nor large blocks are
+ * zeroed. Building with AMQP_POOL_POISON fills every allocation with a
+ * pattern instead, so code that reads memory it did not write shows up. */
+#ifdef AMQP_POOL_POISON
+# define POOL_POISON_BYTE 0xA5
+# define poison_pool_memory(p, n) memset((p), POOL_POISON_BYTE, (n))
+#else
+# define poison_pool_memory(p, n) ((void)0)
+#endif
+
 void init_amqp_pool(amqp_pool_t *pool, size_t pagesize)
 {
   pool->pagesize = pagesize ? pagesize : 4096;
 
   pool->pages.num_blocks = 0;
   pool->pages.blocklist = NULL;
+  pool->pages.capacity = 0;
 
   pool->large_blocks.num_blocks = 0;
   pool->large_blocks.blocklist = NULL;
+  pool->large_blocks.capacity = 0;
+
+  pool->large_cache.num_blocks = 0;
+  pool->large_cache.blocklist = NULL;
+  pool->large_cache.capacity = 0;
+  pool->large_cache_bytes = 0;
+  pool->large_cache_max = DEFAULT_LARGE_BLOCK_CACHE;
 
   pool->next_page = 0;
   pool->alloc_block = NULL;
@@ -71,50 +334,186 @@ static void empty_blocklist(amqp_pool_blocklist_t *x)
   int i;
 
   for (i = 0; i < x->num_blocks; i++) {
-    free(x->blocklist[i]);
+    amqp_free(x->blocklist[i]);
   }
   if (x->blocklist != NULL) {
-    free(x->blocklist);
+    amqp_free(x->blocklist);
   }
   x->num_blocks = 0;
   x->blocklist = NULL;
+  x->capacity = 0;
+}
+
+/* Returns 1 on success, 0 on failure */
+static int record_pool_block(amqp_pool_blocklist_t *x, void *block)
+{
+  if (x->num_blocks == x->capacity) {
+    int capacity = INITIAL_BLOCKLIST_CAPACITY;
+    void **newbl;
+
+    if (x->capacity > 0) {
+      if (x->capacity > INT_MAX / 2
+          || (size_t)x->capacity > SIZE_MAX / 2 / sizeof(void *)) {
+        return 0;
+      }
+      capacity = x->capacity * 2;
+    }
+
+    newbl = amqp_realloc(x->blocklist, sizeof(void *) * capacity);
+    if (newbl == NULL) {
+      return 0;
+    }
+    x->blocklist = newbl;
+    x->capacity = capacity;
+  }
+
+  x->blocklist[x->num_blocks] = block;
+  x->num_blocks++;
+  return 1;
+}
+
+static size_t large_block_size(void *block)
+{
+  return *(size_t *)block;
 }
 
 void recycle_amqp_pool(amqp_pool_t *pool)
 {
-  empty_blocklist(&pool->large_blocks);
+  int i;
+
+  /* Keep what fits in the cache, the block list itself is kept too */
+  for (i = 0; i < pool->large_blocks.num_blocks; i++) {
+    void *block = pool->large_blocks.blocklist[i];
+    size_t size = large_block_size(block);
+
+    if (pool->large_cache_bytes <= pool->large_cache_max
+        && size <= pool->large_cache_max - pool->large_cache_bytes
+        && record_pool_block(&pool->large_cache, block)) {
+      pool->large_cache_bytes += size;
+    } else {
+      amqp_free(block);
+    }
+  }
+  pool->large_blocks.num_blocks = 0;
+
   pool->next_page = 0;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
 }
 
+int amqp_pool_take_blocks(amqp_pool_t *pool, amqp_pool_blocklist_t *taken)
+{
+  int used_pages = pool->next_page;
+  int taken_before = taken->num_blocks;
+  int i;
+
+  for (i = 0; i < used_pages; i++) {
+    if (!record_pool_block(taken, pool->pages.blocklist[i])) {
+      taken->num_blocks = taken_before;
+      return 0;
+    }
+  }
+  for (i = 0; i < pool->large_blocks.num_blocks; i++) {
+    if (!record_pool_block(taken, pool->large_blocks.blocklist[i])) {
+      taken->num_blocks = taken_before;
+      return 0;
+    }
+  }
+
+  memmove(pool->pages.blocklist, pool->pages.blocklist + used_pages,
+          sizeof(void *) * (pool->pages.num_blocks - used_pages));
+  pool->pages.num_blocks -= used_pages;
+  pool->large_blocks.num_blocks = 0;
+
+  pool->next_page = 0;
+  pool->alloc_block = NULL;
+  pool->alloc_used = 0;
+  return 1;
+}
+
+void amqp_pool_free_blocks(amqp_pool_blocklist_t *blocks)
+{
+  empty_blocklist(blocks);
+}
+
 void empty_amqp_pool(amqp_pool_t *pool)
 {
   recycle_amqp_pool(pool);
+  amqp_pool_trim(pool);
+  empty_blocklist(&pool->large_blocks);
   empty_blocklist(&pool->pages);
 }
 
-/* Returns 1 on success, 0 on failure */
-static int record_pool_block(amqp_pool_blocklist_t *x, void *block)
+void amqp_pool_set_large_cache(amqp_pool_t *pool, size_t max_bytes)
 {
-  size_t blocklistlength = sizeof(void *) * (x->num_blocks + 1);
+  pool->large_cache_max = max_bytes;
 
-  if (x->blocklist == NULL) {
-    x->blocklist = malloc(blocklistlength);
-    if (x->blocklist == NULL) {
-      return 0;
+  while (pool->large_cache_bytes > max_bytes) {
+    void *block = pool->large_cache.blocklist[--pool->large_cache.num_blocks];
+    pool->large_cache_bytes -= large_block_size(block);
+    amqp_free(block);
+  }
+}
+
+void amqp_pool_trim(amqp_pool_t *pool)
+{
+  empty_blocklist(&pool->large_cache);
+  pool->large_cache_bytes = 0;
+}
+
+/* Takes a cached large block of the given size, or returns NULL */
+static void *take_cached_block(amqp_pool_t *pool, size_t size)
+{
+  amqp_pool_blocklist_t *cache = &pool->large_cache;
+  int i;
+
+  for (i = 0; i < cache->num_blocks; i++) {
+    void *block = cache->blocklist[i];
+
+    if (large_block_size(block) == size) {
+      cache->blocklist[i] = cache->blocklist[--cache->num_blocks];
+      pool->large_cache_bytes -= size;
+      return block;
     }
-  } else {
-    void *newbl = realloc(x->blocklist, blocklistlength);
-    if (newbl == NULL) {
-      return 0;
+  }
+  return NULL;
+}
+
+static void *alloc_large_block(amqp_pool_t *pool, size_t amount)
+{
+  size_t size = amount;
+  void *block;
+
+  /* Size classes are the page size times a power of two, used only for
+   * blocks small enough to be cached */
+  if (amount <= pool->large_cache_max) {
+    size = pool->pagesize;
+    while (size < amount && size <= SIZE_MAX / 2) {
+      size *= 2;
+    }
+    if (size > pool->large_cache_max) {
+      size = amount;
     }
-    x->blocklist = newbl;
   }
 
-  x->blocklist[x->num_blocks] = block;
-  x->num_blocks++;
-  return 1;
+  block = take_cached_block(pool, size);
+  if (block == NULL) {
+    if (size > SIZE_MAX - LARGE_BLOCK_HEADER_SIZE) {
+      return NULL;
+    }
+    block = amqp_malloc(LARGE_BLOCK_HEADER_SIZE + size);
+    if (block == NULL) {
+      return NULL;
+    }
+    *(size_t *)block = size;
+  }
+
+  if (!record_pool_block(&pool->large_blocks, block)) {
+    amqp_free(block);
+    return NULL;
+  }
+  poison_pool_memory((char *)block + LARGE_BLOCK_HEADER_SIZE, amount);
+  return (char *)block + LARGE_BLOCK_HEADER_SIZE;
 }
 
 void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
@@ -126,14 +525,7 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > pool->pagesize) {
-    void *result = calloc(1, amount);
-    if (result == NULL) {
-      return NULL;
-    }
-    if (!record_pool_block(&pool->large_blocks, result)) {
-      return NULL;
-    }
-    return result;
+    return alloc_large_block(pool, amount);
   }
 
   if (pool->alloc_block != NULL) {
@@ -142,16 +534,19 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
     if (pool->alloc_used + amount <= pool->pagesize) {
       void *result = pool->alloc_block + pool->alloc_used;
       pool->alloc_used += amount;
+      poison_pool_memory(result, amount);
       return result;
     }
   }
 
   if (pool->next_page >= pool->pages.num_blocks) {
-    pool->alloc_block = calloc(1, pool->pagesize);
+    pool->alloc_block = amqp_malloc(pool->pagesize);
     if (pool->alloc_block == NULL) {
       return NULL;
     }
     if (!record_pool_block(&pool->pages, pool->alloc_block)) {
+      amqp_free(pool->alloc_block);
+      pool->alloc_block = NULL;
       return NULL;
     }
     pool->next_page = pool->pages.num_blocks;
@@ -161,6 +556,7 @@ void *amqp_pool_alloc(amqp_pool_t *pool, size_t amount)
   }
 
   pool->alloc_used = amount;
+  poison_pool_memory(pool->alloc_block, amount);
 
   return pool->alloc_block;
 }
@@ -183,7 +579,7 @@ amqp_bytes_t amqp_bytes_malloc_dup(amqp_bytes_t src)
 {
   amqp_bytes_t result;
   result.len = src.len;
-  result.bytes = malloc(src.len);
+  result.bytes = amqp_malloc(src.len);
   if (result.bytes != NULL) {
     memcpy(result.bytes, src.bytes, src.len);
   }
@@ -194,13 +590,13 @@ amqp_bytes_t amqp_bytes_malloc(size_t amount)
 {
   amqp_bytes_t result;
   result.len = amount;
-  result.bytes = malloc(amount); /* will return NULL if it fails */
+  result.bytes = amqp_malloc(amount); /* will return NULL if it fails */
   return result;
 }
 
 void amqp_bytes_free(amqp_bytes_t bytes)
 {
-  free(bytes.bytes);
+  amqp_free(bytes.bytes);
 }
 
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
@@ -216,21 +612,23 @@ amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t state, amqp
     }
   }
 
-  entry = malloc(sizeof(amqp_pool_table_entry_t));
+  entry = amqp_malloc(sizeof(amqp_pool_table_entry_t));
   if (NULL == entry) {
     return NULL;
   }
 
   entry->channel = channel;
+  entry->pinned_buffers = NULL;
   entry->next = state->pool_table[index];
   state->pool_table[index] = entry;
 
   init_amqp_pool(&entry->pool, state->frame_max);
+  amqp_pool_set_large_cache(&entry->pool, state->large_block_cache_max);
 
   return &entry->pool;
 }
 
-amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(amqp_connection_state_t state, amqp_channel_t channel)
 {
   amqp_pool_table_entry_t *entry;
   size_t index = channel % POOL_TABLE_SIZE;
@@ -239,9 +637,20 @@ amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t
 
   for ( ; NULL != entry; entry = entry->next) {
     if (channel == entry->channel) {
-      return &entry->pool;
+      return entry;
     }
   }
 
   return NULL;
 }
+
+amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel)
+{
+  amqp_pool_table_entry_t *entry = amqp_get_channel_pool_entry(state, channel);
+
+  if (NULL == entry) {
+    return NULL;
+  }
+
+  return &entry->pool;
+}
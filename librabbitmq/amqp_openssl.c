@@ -31,12 +31,28 @@
 #include "threads.h"
 
 #include <ctype.h>
+#include <limits.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* The most plaintext a single TLS record can carry */
+#define SSL_RECORD_SIZE SSL3_RT_MAX_PLAIN_LENGTH
+/* The largest multiple of SSL_RECORD_SIZE that SSL_write() takes at once */
+#define SSL_MAX_WRITE (INT_MAX / SSL_RECORD_SIZE * SSL_RECORD_SIZE)
+
+/* Kernel TLS needs an OpenSSL (3.0 or later) built with support for it */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) \
+  && !defined(_WIN32)
+#define AMQP_SSL_KTLS
+#include <errno.h>
+#include <sys/socket.h>
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
 
 static int initialize_openssl(void);
 static int destroy_openssl(void);
@@ -58,17 +74,80 @@ static pthread_mutex_t openssl_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t *amqp_openssl_lockarray = NULL;
 #endif /* ENABLE_THREAD_SAFETY */
 
+/* The last session negotiated with a broker, used to resume the next
+ * connection to it */
+struct amqp_ssl_session_t {
+  struct amqp_ssl_session_t *next;
+  char *host;
+  int port;
+  SSL_SESSION *session;
+};
+
+struct amqp_ssl_context_t_ {
+  SSL_CTX *ctx;
+  int refcount;
+  struct amqp_ssl_session_t *sessions;
+#ifdef ENABLE_THREAD_SAFETY
+  pthread_mutex_t mutex;
+#endif
+};
+
 struct amqp_ssl_socket_t {
   const struct amqp_socket_class_t *klass;
+  amqp_ssl_context_t *context;
   SSL_CTX *ctx;
+  struct amqp_ssl_session_t *session;
+  amqp_boolean_t session_reused;
   int sockfd;
   SSL *ssl;
   char *buffer;
-  size_t length;
   amqp_boolean_t verify;
+  amqp_boolean_t ktls;
+  int ktls_flags;
   int internal_error;
+  /* set once a read or write failed, other than on a clean close */
+  amqp_boolean_t failed;
 };
 
+#ifdef AMQP_SSL_KTLS
+/* With the kernel encrypting, application data is written to the socket
+ * as it is, without passing through OpenSSL or being copied at all */
+static ssize_t
+ktls_writev(struct amqp_ssl_socket_t *self, struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+  ssize_t res;
+
+  memset(&msg, 0, sizeof(msg));
+  while (iovcnt > 0) {
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    res = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL);
+    if (res < 0) {
+      self->internal_error = amqp_os_socket_error();
+      if (EINTR == self->internal_error) {
+        continue;
+      }
+      self->failed = 1;
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+
+    while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+      res -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + res;
+      iov->iov_len -= res;
+    }
+  }
+
+  self->internal_error = 0;
+  return AMQP_STATUS_OK;
+}
+#endif
+
 static ssize_t
 amqp_ssl_socket_send(void *base,
                      const void *buf,
@@ -76,6 +155,16 @@ amqp_ssl_socket_send(void *base,
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   ssize_t res;
+
+#ifdef AMQP_SSL_KTLS
+  if (self->ktls_flags & AMQP_SSL_KTLS_SEND) {
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = len;
+    return ktls_writev(self, &iov, 1);
+  }
+#endif
+
   ERR_clear_error();
   self->internal_error = 0;
 
@@ -91,6 +180,7 @@ amqp_ssl_socket_send(void *base,
         res = AMQP_STATUS_CONNECTION_CLOSED;
         break;
       default:
+        self->failed = 1;
         res = AMQP_STATUS_SSL_ERROR;
         break;
     }
@@ -108,31 +198,69 @@ amqp_ssl_socket_writev(void *base,
                        int iovcnt)
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
-  ssize_t ret = -1;
-  char *bufferp;
-  size_t bytes;
+  size_t staged = 0;
+  ssize_t res;
   int i;
-  bytes = 0;
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
+
+#ifdef AMQP_SSL_KTLS
+  if (self->ktls_flags & AMQP_SSL_KTLS_SEND) {
+    return ktls_writev(self, iov, iovcnt);
   }
-  if (self->length < bytes) {
-    self->buffer = realloc(self->buffer, bytes);
+#endif
+
+  if (!self->buffer) {
+    self->buffer = amqp_malloc(SSL_RECORD_SIZE);
     if (!self->buffer) {
-      self->length = 0;
-      ret = AMQP_STATUS_NO_MEMORY;
-      goto exit;
+      return AMQP_STATUS_NO_MEMORY;
     }
-    self->length = bytes;
   }
-  bufferp = self->buffer;
+
+  /* Small parts such as frame headers are gathered into full records in
+   * self->buffer. Whole records' worth of a larger part are handed to
+   * SSL_write() straight from the caller's memory, so at most a record per
+   * part is copied before encryption, and every record but the last one
+   * written is full. */
   for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
+    const char *p = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+
+    while (len > 0) {
+      size_t n;
+
+      if (0 == staged && len >= SSL_RECORD_SIZE) {
+        n = len - len % SSL_RECORD_SIZE;
+        if (n > SSL_MAX_WRITE) {
+          n = SSL_MAX_WRITE;
+        }
+        res = amqp_ssl_socket_send(self, p, n);
+        if (res < 0) {
+          return res;
+        }
+      } else {
+        n = SSL_RECORD_SIZE - staged;
+        if (n > len) {
+          n = len;
+        }
+        memcpy(self->buffer + staged, p, n);
+        staged += n;
+        if (SSL_RECORD_SIZE == staged) {
+          res = amqp_ssl_socket_send(self, self->buffer, staged);
+          if (res < 0) {
+            return res;
+          }
+          staged = 0;
+        }
+      }
+
+      p += n;
+      len -= n;
+    }
   }
-  ret = amqp_ssl_socket_send(self, self->buffer, bytes);
-exit:
-  return ret;
+
+  if (staged > 0) {
+    return amqp_ssl_socket_send(self, self->buffer, staged);
+  }
+  return AMQP_STATUS_OK;
 }
 
 static ssize_t
@@ -143,6 +271,10 @@ amqp_ssl_socket_recv(void *base,
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   ssize_t received;
+  /* Even with kTLS receive the kernel hands records other than application
+   * data (alerts, TLS 1.3 session tickets and key updates) to user space
+   * through a control message, which only OpenSSL knows how to deal with.
+   * SSL_read() is just a recvmsg() on the socket in that case. */
   ERR_clear_error();
   self->internal_error = 0;
 
@@ -154,6 +286,7 @@ amqp_ssl_socket_recv(void *base,
       received = AMQP_STATUS_CONNECTION_CLOSED;
       break;
     default:
+      self->failed = 1;
       received = AMQP_STATUS_SSL_ERROR;
       break;
     }
@@ -227,6 +360,78 @@ error:
   goto exit;
 }
 
+static void
+context_lock(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  if (pthread_mutex_lock(&context->mutex)) {
+    amqp_abort("Runtime error: Failure in trying to lock SSL context mutex");
+  }
+#endif
+}
+
+static void
+context_unlock(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+#ifdef ENABLE_THREAD_SAFETY
+  if (pthread_mutex_unlock(&context->mutex)) {
+    amqp_abort("Runtime error: Failure in trying to unlock SSL context mutex");
+  }
+#endif
+}
+
+/* Finds or adds the session cache entry for a broker. Entries live as long
+ * as the context, so sockets keep a pointer to theirs. */
+static struct amqp_ssl_session_t *
+context_session(amqp_ssl_context_t *context, const char *host, int port)
+{
+  struct amqp_ssl_session_t *entry;
+
+  for (entry = context->sessions; entry; entry = entry->next) {
+    if (entry->port == port && !strcmp(entry->host, host)) {
+      return entry;
+    }
+  }
+
+  entry = amqp_calloc(1, sizeof(*entry));
+  if (!entry) {
+    return NULL;
+  }
+  entry->host = amqp_strdup(host);
+  if (!entry->host) {
+    amqp_free(entry);
+    return NULL;
+  }
+  entry->port = port;
+  entry->next = context->sessions;
+  context->sessions = entry;
+  return entry;
+}
+
+/* Called by OpenSSL for every session the broker issues: once the handshake
+ * completes for TLS 1.2, and for each session ticket that arrives after it
+ * with TLS 1.3 */
+static int
+new_session_callback(SSL *ssl, SSL_SESSION *session)
+{
+  struct amqp_ssl_socket_t *self = SSL_get_app_data(ssl);
+  SSL_SESSION *old;
+
+  if (!self || !self->session) {
+    return 0;
+  }
+
+  context_lock(self->context);
+  old = self->session->session;
+  self->session->session = session;
+  context_unlock(self->context);
+
+  if (old) {
+    SSL_SESSION_free(old);
+  }
+  return 1;
+}
+
 static int
 amqp_ssl_socket_open(void *base, const char *host, int port)
 {
@@ -243,6 +448,23 @@ amqp_ssl_socket_open(void *base, const char *host, int port)
   }
 
   SSL_set_mode(self->ssl, SSL_MODE_AUTO_RETRY);
+  SSL_set_app_data(self->ssl, self);
+  self->session_reused = 0;
+  self->ktls_flags = 0;
+  self->failed = 0;
+
+  context_lock(self->context);
+  self->session = context_session(self->context, host, port);
+  if (self->session && self->session->session) {
+    SSL_set_session(self->ssl, self->session->session);
+  }
+  context_unlock(self->context);
+
+#ifdef AMQP_SSL_KTLS
+  if (self->ktls) {
+    SSL_set_options(self->ssl, SSL_OP_ENABLE_KTLS);
+  }
+#endif
   self->sockfd = amqp_open_socket(host, port);
   if (0 > self->sockfd) {
     status = self->sockfd;
@@ -280,6 +502,19 @@ amqp_ssl_socket_open(void *base, const char *host, int port)
     }
   }
 
+  self->session_reused = SSL_session_reused(self->ssl) ? 1 : 0;
+
+#ifdef AMQP_SSL_KTLS
+  /* OpenSSL falls back to encrypting itself when the kernel or the
+   * negotiated cipher doesn't support kTLS */
+  if (BIO_get_ktls_send(SSL_get_wbio(self->ssl))) {
+    self->ktls_flags |= AMQP_SSL_KTLS_SEND;
+  }
+  if (BIO_get_ktls_recv(SSL_get_rbio(self->ssl))) {
+    self->ktls_flags |= AMQP_SSL_KTLS_RECV;
+  }
+#endif
+
   self->internal_error = 0;
   status = AMQP_STATUS_OK;
 
@@ -293,6 +528,7 @@ error_out2:
   self->sockfd = -1;
 error_out1:
   SSL_free(self->ssl);
+  self->ssl = NULL;
   goto exit;
 }
 
@@ -301,11 +537,32 @@ amqp_ssl_socket_close(void *base)
 {
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   if (self) {
+    if (self->ssl) {
+      if (!self->failed && (0 == self->internal_error
+                            || SSL_ERROR_ZERO_RETURN == self->internal_error)) {
+        /* Without this, OpenSSL takes the connection for one that failed
+         * and marks its session as one that must not be resumed */
+        SSL_set_shutdown(self->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+      } else if (self->session) {
+        /* Don't resume a session from a connection that was torn down */
+        SSL_SESSION *session;
+
+        context_lock(self->context);
+        session = self->session->session;
+        self->session->session = NULL;
+        context_unlock(self->context);
+        if (session) {
+          SSL_SESSION_free(session);
+        }
+      }
+    }
     SSL_free(self->ssl);
     amqp_os_socket_close(self->sockfd);
-    SSL_CTX_free(self->ctx);
-    free(self->buffer);
-    free(self);
+    if (self->context) {
+      amqp_ssl_context_release(self->context);
+    }
+    amqp_free(self->buffer);
+    amqp_free(self);
   }
   destroy_openssl();
   return 0;
@@ -341,10 +598,107 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
   amqp_ssl_socket_get_sockfd /* get_sockfd */
 };
 
+amqp_ssl_context_t *
+amqp_ssl_context_new(void)
+{
+  amqp_ssl_context_t *context = amqp_calloc(1, sizeof(*context));
+  if (!context) {
+    return NULL;
+  }
+  if (initialize_openssl()) {
+    amqp_free(context);
+    return NULL;
+  }
+#ifdef ENABLE_THREAD_SAFETY
+  if (pthread_mutex_init(&context->mutex, NULL)) {
+    goto error;
+  }
+#endif
+  context->ctx = SSL_CTX_new(SSLv23_client_method());
+  if (!context->ctx) {
+    goto error_mutex;
+  }
+  /* Sessions are kept per broker in the context rather than in OpenSSL's
+   * cache, which it never consults on the client side */
+  SSL_CTX_set_session_cache_mode(context->ctx, SSL_SESS_CACHE_CLIENT
+                                 | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(context->ctx, new_session_callback);
+  context->refcount = 1;
+  return context;
+
+error_mutex:
+#if defined(ENABLE_THREAD_SAFETY) && !defined(_WIN32)
+  pthread_mutex_destroy(&context->mutex);
+#endif
+#ifdef ENABLE_THREAD_SAFETY
+error:
+#endif
+  amqp_free(context);
+  destroy_openssl();
+  return NULL;
+}
+
+void
+amqp_ssl_context_release(amqp_ssl_context_t *context)
+{
+  struct amqp_ssl_session_t *entry;
+  int refcount;
+
+  context_lock(context);
+  refcount = --context->refcount;
+  context_unlock(context);
+  if (refcount > 0) {
+    return;
+  }
+
+  while (context->sessions) {
+    entry = context->sessions;
+    context->sessions = entry->next;
+    if (entry->session) {
+      SSL_SESSION_free(entry->session);
+    }
+    amqp_free(entry->host);
+    amqp_free(entry);
+  }
+  SSL_CTX_free(context->ctx);
+#if defined(ENABLE_THREAD_SAFETY) && !defined(_WIN32)
+  pthread_mutex_destroy(&context->mutex);
+#endif
+  amqp_free(context);
+  destroy_openssl();
+}
+
+int
+amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                            const char *cacert)
+{
+  int status = SSL_CTX_load_verify_locations(context->ctx, cacert, NULL);
+  if (1 != status) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
+int
+amqp_ssl_context_set_key(amqp_ssl_context_t *context,
+                         const char *cert,
+                         const char *key)
+{
+  int status = SSL_CTX_use_certificate_chain_file(context->ctx, cert);
+  if (1 != status) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  status = SSL_CTX_use_PrivateKey_file(context->ctx, key, SSL_FILETYPE_PEM);
+  if (1 != status) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  return AMQP_STATUS_OK;
+}
+
 amqp_socket_t *
-amqp_ssl_socket_new(void)
+amqp_ssl_socket_new_with_context(amqp_ssl_context_t *context)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_ssl_socket_t *self = amqp_calloc(1, sizeof(*self));
   int status;
   if (!self) {
     goto error;
@@ -353,11 +707,13 @@ amqp_ssl_socket_new(void)
   if (status) {
     goto error;
   }
-  self->ctx = SSL_CTX_new(SSLv23_client_method());
-  if (!self->ctx) {
-    goto error;
-  }
+  context_lock(context);
+  ++context->refcount;
+  context_unlock(context);
+  self->context = context;
+  self->ctx = context->ctx;
   self->klass = &amqp_ssl_socket_class;
+  self->sockfd = -1;
   self->verify = 1;
   return (amqp_socket_t *)self;
 error:
@@ -365,21 +721,40 @@ error:
   return NULL;
 }
 
+amqp_socket_t *
+amqp_ssl_socket_new(void)
+{
+  amqp_ssl_context_t *context = amqp_ssl_context_new();
+  amqp_socket_t *self;
+  if (!context) {
+    return NULL;
+  }
+  self = amqp_ssl_socket_new_with_context(context);
+  amqp_ssl_context_release(context);
+  return self;
+}
+
+amqp_boolean_t
+amqp_ssl_socket_session_reused(amqp_socket_t *base)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return self->session_reused;
+}
+
 int
 amqp_ssl_socket_set_cacert(amqp_socket_t *base,
                            const char *cacert)
 {
-  int status;
   struct amqp_ssl_socket_t *self;
   if (base->klass != &amqp_ssl_socket_class) {
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
   self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_load_verify_locations(self->ctx, cacert, NULL);
-  if (1 != status) {
-    return AMQP_STATUS_SSL_ERROR;
-  }
-  return AMQP_STATUS_OK;
+  return amqp_ssl_context_set_cacert(self->context, cacert);
 }
 
 int
@@ -387,22 +762,12 @@ amqp_ssl_socket_set_key(amqp_socket_t *base,
                         const char *cert,
                         const char *key)
 {
-  int status;
   struct amqp_ssl_socket_t *self;
   if (base->klass != &amqp_ssl_socket_class) {
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
   self = (struct amqp_ssl_socket_t *)base;
-  status = SSL_CTX_use_certificate_chain_file(self->ctx, cert);
-  if (1 != status) {
-    return AMQP_STATUS_SSL_ERROR;
-  }
-  status = SSL_CTX_use_PrivateKey_file(self->ctx, key,
-                                       SSL_FILETYPE_PEM);
-  if (1 != status) {
-    return AMQP_STATUS_SSL_ERROR;
-  }
-  return AMQP_STATUS_OK;
+  return amqp_ssl_context_set_key(self->context, cert, key);
 }
 
 static int
@@ -483,6 +848,29 @@ amqp_ssl_socket_set_verify(amqp_socket_t *base,
   self->verify = verify;
 }
 
+void
+amqp_ssl_socket_set_ktls(amqp_socket_t *base,
+                         amqp_boolean_t enable)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  self->ktls = enable;
+}
+
+int
+amqp_ssl_socket_get_ktls(amqp_socket_t *base)
+{
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return self->ktls_flags;
+}
+
 void
 amqp_set_initialize_ssl_library(amqp_boolean_t do_initialize)
 {
@@ -542,14 +930,14 @@ initialize_openssl(void)
 #ifdef ENABLE_THREAD_SAFETY
     if (NULL == amqp_openssl_lockarray) {
       int i = 0;
-      amqp_openssl_lockarray = calloc(CRYPTO_num_locks(), sizeof(pthread_mutex_t));
+      amqp_openssl_lockarray = amqp_calloc(CRYPTO_num_locks(), sizeof(pthread_mutex_t));
       if (!amqp_openssl_lockarray) {
         pthread_mutex_unlock(&openssl_init_mutex);
         return -1;
       }
       for (i = 0; i < CRYPTO_num_locks(); ++i) {
         if (pthread_mutex_init(&amqp_openssl_lockarray[i], NULL)) {
-          free(amqp_openssl_lockarray);
+          amqp_free(amqp_openssl_lockarray);
           amqp_openssl_lockarray = NULL;
           pthread_mutex_unlock(&openssl_init_mutex);
           return -1;
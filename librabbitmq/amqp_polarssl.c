@@ -89,8 +89,8 @@ amqp_ssl_socket_writev(void *base,
     bytes += iov[i].iov_len;
   }
   if (self->length < bytes) {
-    free(self->buffer);
-    self->buffer = malloc(bytes);
+    amqp_free(self->buffer);
+    self->buffer = amqp_malloc(bytes);
     if (!self->buffer) {
       self->length = 0;
       self->last_error = AMQP_STATUS_NO_MEMORY;
@@ -169,23 +169,23 @@ amqp_ssl_socket_close(void *base)
   int status = -1;
   struct amqp_ssl_socket_t *self = (struct amqp_ssl_socket_t *)base;
   if (self) {
-    free(self->entropy);
-    free(self->ctr_drbg);
+    amqp_free(self->entropy);
+    amqp_free(self->ctr_drbg);
     x509_free(self->cacert);
-    free(self->cacert);
+    amqp_free(self->cacert);
     rsa_free(self->key);
-    free(self->key);
+    amqp_free(self->key);
     x509_free(self->cert);
-    free(self->cert);
+    amqp_free(self->cert);
     ssl_free(self->ssl);
-    free(self->ssl);
-    free(self->session);
-    free(self->buffer);
+    amqp_free(self->ssl);
+    amqp_free(self->session);
+    amqp_free(self->buffer);
     if (self->sockfd >= 0) {
       net_close(self->sockfd);
       status = 0;
     }
-    free(self);
+    amqp_free(self);
   }
   return status;
 }
@@ -222,18 +222,18 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
 amqp_socket_t *
 amqp_ssl_socket_new(void)
 {
-  struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_ssl_socket_t *self = amqp_calloc(1, sizeof(*self));
   int status;
   if (!self) {
     goto error;
   }
-  self->entropy = calloc(1, sizeof(*self->entropy));
+  self->entropy = amqp_calloc(1, sizeof(*self->entropy));
   if (!self->entropy) {
     goto error;
   }
   self->sockfd = -1;
   entropy_init(self->entropy);
-  self->ctr_drbg = calloc(1, sizeof(*self->ctr_drbg));
+  self->ctr_drbg = amqp_calloc(1, sizeof(*self->ctr_drbg));
   if (!self->ctr_drbg) {
     goto error;
   }
@@ -242,7 +242,7 @@ amqp_ssl_socket_new(void)
   if (status) {
     goto error;
   }
-  self->ssl = calloc(1, sizeof(*self->ssl));
+  self->ssl = amqp_calloc(1, sizeof(*self->ssl));
   if (!self->ssl) {
     goto error;
   }
@@ -254,7 +254,7 @@ amqp_ssl_socket_new(void)
   ssl_set_rng(self->ssl, ctr_drbg_random, self->ctr_drbg);
   ssl_set_ciphersuites(self->ssl, ssl_default_ciphersuites);
   ssl_set_authmode(self->ssl, SSL_VERIFY_REQUIRED);
-  self->session = calloc(1, sizeof(*self->session));
+  self->session = amqp_calloc(1, sizeof(*self->session));
   if (!self->session) {
     goto error;
   }
@@ -281,7 +281,7 @@ amqp_ssl_socket_set_cacert(amqp_socket_t *base,
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
   self = (struct amqp_ssl_socket_t *)base;
-  self->cacert = calloc(1, sizeof(*self->cacert));
+  self->cacert = amqp_calloc(1, sizeof(*self->cacert));
   if (!self->cacert) {
     return -1;
   }
@@ -303,7 +303,7 @@ amqp_ssl_socket_set_key(amqp_socket_t *base,
     amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
   }
   self = (struct amqp_ssl_socket_t *)base;
-  self->key = calloc(1, sizeof(*self->key));
+  self->key = amqp_calloc(1, sizeof(*self->key));
   if (!self->key) {
     return -1;
   }
@@ -311,7 +311,7 @@ amqp_ssl_socket_set_key(amqp_socket_t *base,
   if (status) {
     return -1;
   }
-  self->cert = calloc(1, sizeof(*self->cert));
+  self->cert = amqp_calloc(1, sizeof(*self->cert));
   if (!self->cert) {
     return -1;
   }
@@ -348,6 +348,58 @@ amqp_ssl_socket_set_verify(amqp_socket_t *base,
   }
 }
 
+amqp_ssl_context_t *
+amqp_ssl_context_new(void)
+{
+  /* shared contexts are not implemented for PolarSSL */
+  return NULL;
+}
+
+void
+amqp_ssl_context_release(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+}
+
+int
+amqp_ssl_context_set_cacert(AMQP_UNUSED amqp_ssl_context_t *context,
+                            AMQP_UNUSED const char *cacert)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+int
+amqp_ssl_context_set_key(AMQP_UNUSED amqp_ssl_context_t *context,
+                         AMQP_UNUSED const char *cert,
+                         AMQP_UNUSED const char *key)
+{
+  return AMQP_STATUS_UNSUPPORTED;
+}
+
+amqp_socket_t *
+amqp_ssl_socket_new_with_context(AMQP_UNUSED amqp_ssl_context_t *context)
+{
+  return NULL;
+}
+
+amqp_boolean_t
+amqp_ssl_socket_session_reused(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
+void
+amqp_ssl_socket_set_ktls(AMQP_UNUSED amqp_socket_t *base,
+                         AMQP_UNUSED amqp_boolean_t enable)
+{
+  /* noop for PolarSSL */
+}
+
+int
+amqp_ssl_socket_get_ktls(AMQP_UNUSED amqp_socket_t *base)
+{
+  return 0;
+}
+
 void
 amqp_set_initialize_ssl_library(AMQP_UNUSED amqp_boolean_t do_initialize)
 {
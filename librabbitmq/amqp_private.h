@@ -69,6 +69,52 @@
 #define AMQP_PRIVATE
 #endif
 
+/* Atomic operations on 64-bit counters and on pointers, each returning the
+ * previous value */
+#ifdef _MSC_VER
+# define atomic_or64(p, v) \
+  ((uint64_t)InterlockedOr64((volatile LONG64 *)(p), (LONG64)(v)))
+# define atomic_and64(p, v) \
+  ((uint64_t)InterlockedAnd64((volatile LONG64 *)(p), (LONG64)(v)))
+# define atomic_add64(p, v) \
+  ((uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)(p), (LONG64)(v)))
+# define atomic_cas_ptr(p, expected, desired) \
+  InterlockedCompareExchangePointer((PVOID volatile *)(p), (desired), \
+                                    (expected))
+#else
+# define atomic_or64(p, v) __sync_fetch_and_or((p), (uint64_t)(v))
+# define atomic_and64(p, v) __sync_fetch_and_and((p), (uint64_t)(v))
+# define atomic_add64(p, v) __sync_fetch_and_add((p), (uint64_t)(v))
+# define atomic_cas_ptr(p, expected, desired) \
+  __sync_val_compare_and_swap((p), (expected), (desired))
+#endif
+
+/*
+ * Heap allocation inside the library goes through these, and so through
+ * the allocator set with amqp_set_allocator(). Libraries built with
+ * AMQP_ALLOC_STATS also count allocations per call site, which
+ * AMQP_ALLOC_SITE names as "file:line".
+ */
+#ifdef AMQP_ALLOC_STATS
+# define AMQP_ALLOC_STRINGIFY_(x) #x
+# define AMQP_ALLOC_STRINGIFY(x) AMQP_ALLOC_STRINGIFY_(x)
+# define AMQP_ALLOC_SITE __FILE__ ":" AMQP_ALLOC_STRINGIFY(__LINE__)
+#else
+# define AMQP_ALLOC_SITE NULL
+#endif
+
+void *amqp_malloc_at(size_t size, const char *site);
+void *amqp_calloc_at(size_t nmemb, size_t size, const char *site);
+void *amqp_realloc_at(void *ptr, size_t size, const char *site);
+char *amqp_strdup_at(const char *str, const char *site);
+void amqp_free(void *ptr);
+
+#define amqp_malloc(size) amqp_malloc_at((size), AMQP_ALLOC_SITE)
+#define amqp_calloc(nmemb, size) \
+  amqp_calloc_at((nmemb), (size), AMQP_ALLOC_SITE)
+#define amqp_realloc(ptr, size) amqp_realloc_at((ptr), (size), AMQP_ALLOC_SITE)
+#define amqp_strdup(str) amqp_strdup_at((str), AMQP_ALLOC_SITE)
+
 char *
 amqp_os_error_string(int err);
 
@@ -100,12 +146,17 @@ amqp_ssl_error_string(int err);
  *   the frame is not yet complete. When it is completed, it will be
  *   returned, and the connection will return to IDLE state.
  *
+ * - CONNECTION_STATE_BODY_SINK: As CONNECTION_STATE_BODY, but the frame
+ *   is a body frame whose payload is being read straight into the
+ *   body_sink buffer rather than into a block from the channel pool.
+ *
  */
 typedef enum amqp_connection_state_enum_ {
   CONNECTION_STATE_IDLE = 0,
   CONNECTION_STATE_INITIAL,
   CONNECTION_STATE_HEADER,
-  CONNECTION_STATE_BODY
+  CONNECTION_STATE_BODY,
+  CONNECTION_STATE_BODY_SINK
 } amqp_connection_state_enum;
 
 /* 7 bytes up front, then payload, then 1 byte footer */
@@ -121,12 +172,63 @@ typedef struct amqp_link_t_ {
 
 #define POOL_TABLE_SIZE 16
 
+/* How many bytes of large blocks a pool keeps for reuse by default */
+#define DEFAULT_LARGE_BLOCK_CACHE (1024 * 1024)
+
+/* A socket inbound buffer that frames decoded in place still point into.
+ * The connection holds one reference while the buffer is its current
+ * sock_inbound_buffer, and each channel pool holding such frames holds one
+ * more until the pool is recycled. The memory is freed by whoever drops the
+ * last reference. Retained buffers drop theirs from any thread, so the
+ * count is only changed atomically. */
+typedef struct amqp_pinned_buffer_t_ {
+  uint64_t refcount;
+  amqp_bytes_t buffer;
+} amqp_pinned_buffer_t;
+
 typedef struct amqp_pool_table_entry_t_ {
   struct amqp_pool_table_entry_t_ *next;
   amqp_pool_t pool;
   amqp_channel_t channel;
+  /* amqp_pinned_buffer_t's referenced by frames living in pool, the links
+   * themselves are allocated from pool */
+  amqp_link_t *pinned_buffers;
 } amqp_pool_table_entry_t;
 
+/* Publisher confirm state of a channel in confirm mode. Sequence numbers
+ * [base, next_seq) are tracked in a ring of bits, set while a message is
+ * still waiting for its ack or nack, which grows when the span fills it. */
+typedef struct amqp_confirm_window_t_ {
+  struct amqp_confirm_window_t_ *next;
+  amqp_channel_t channel;
+  uint64_t base;
+  uint64_t next_seq;
+  uint64_t *bits;
+  uint64_t capacity; /* bits in the ring, a power of two */
+  int in_flight;
+  int max_in_flight; /* 0 for no limit */
+  amqp_confirm_callback_t callback;
+  void *user_data;
+} amqp_confirm_window_t;
+
+/* Ack coalescing state of a channel, see amqp_set_ack_coalescing(). Every
+ * delivery up to acked_through has been settled on the wire, those up to
+ * held_through have been acked by the application, the last one held
+ * being last_held. Bit i of ahead is set if delivery held_through + 1 + i
+ * was settled on the wire on its own. */
+typedef struct amqp_ack_coalescer_t_ {
+  struct amqp_ack_coalescer_t_ *next;
+  amqp_channel_t channel;
+  int max_acks;
+  uint64_t max_latency;
+  uint64_t acked_through;
+  uint64_t held_through;
+  uint64_t last_held;
+  uint64_t ahead;
+  int held_acks;
+  uint64_t deadline;
+} amqp_ack_coalescer_t;
+
 struct amqp_connection_state_t_ {
   amqp_pool_table_entry_t *pool_table[POOL_TABLE_SIZE];
 
@@ -146,21 +248,246 @@ struct amqp_connection_state_t_ {
   size_t target_size;
 
   amqp_bytes_t outbound_buffer;
+  /* Frames of batched messages at the start of outbound_buffer that have
+   * not been sent yet, see amqp_set_publish_batching() */
+  size_t outbound_offset;
+  int outbound_messages;
+  uint64_t outbound_deadline;
+  /* publish batching policy, batch_max_bytes is 0 when batching is off */
+  size_t batch_max_bytes;
+  int batch_max_messages;
+  uint64_t batch_max_latency;
 
   amqp_socket_t *socket;
 
   amqp_bytes_t sock_inbound_buffer;
   size_t sock_inbound_offset;
   size_t sock_inbound_limit;
+  /* sock_inbound_buffer sizing policy, see
+   * amqp_set_sock_inbound_buffer_policy() */
+  size_t sock_inbound_min_size;
+  size_t sock_inbound_max_size;
+  /* non-NULL once a frame has been decoded in place from sock_inbound_buffer */
+  amqp_pinned_buffer_t *sock_inbound_pin;
+  amqp_boolean_t decode_in_place;
+  amqp_boolean_t lazy_properties;
+
+  /* When body_sink.bytes is non-NULL, body frames on body_sink_channel that
+   * fit are received directly into it. body_sink.len includes room for the
+   * frame end byte of the last frame. */
+  amqp_channel_t body_sink_channel;
+  amqp_bytes_t body_sink;
 
   amqp_link_t *first_queued_frame;
   amqp_link_t *last_queued_frame;
 
+  /* channels in confirm mode, and the outcomes waiting for
+   * amqp_confirm_poll() from those without a callback */
+  amqp_confirm_window_t *confirm_windows;
+  amqp_confirm_t *confirm_queue;
+  int confirm_queue_head;
+  int confirm_queue_len;
+  int confirm_queue_size;
+
+  /* see amqp_set_large_block_cache() */
+  size_t large_block_cache_max;
+
+  /* channels with ack coalescing turned on */
+  amqp_ack_coalescer_t *ack_coalescers;
+
   amqp_rpc_reply_t most_recent_api_result;
 };
 
 amqp_pool_t *amqp_get_or_create_channel_pool(amqp_connection_state_t connection, amqp_channel_t channel);
 amqp_pool_t *amqp_get_channel_pool(amqp_connection_state_t state, amqp_channel_t channel);
+amqp_pool_table_entry_t *amqp_get_channel_pool_entry(amqp_connection_state_t state, amqp_channel_t channel);
+
+/*
+ * Decodes the next frame straight out of sock_inbound_buffer, without copying
+ * it, if in place decoding is enabled and the whole frame is buffered.
+ *
+ * Returns the number of bytes consumed, 0 if the frame cannot be decoded in
+ * place (the caller should fall back to amqp_handle_input()), or an
+ * amqp_status_enum value on error.
+ */
+int amqp_handle_input_in_place(amqp_connection_state_t state,
+                               amqp_frame_t *decoded_frame);
+
+/*
+ * Makes the drained sock_inbound_buffer ready to receive into: allocates it
+ * on first use and doubles it (up to the policy maximum) if the last read
+ * filled it. If frames decoded in place still reference the current buffer
+ * it is handed over to them and a fresh one is allocated.
+ */
+int amqp_prepare_sock_inbound_buffer(amqp_connection_state_t state);
+
+/*
+ * Drops a drained sock_inbound_buffer back to the policy minimum if the last
+ * read would have fit in that. Called when the connection goes quiet.
+ */
+void amqp_maybe_shrink_sock_inbound_buffer(amqp_connection_state_t state);
+
+void amqp_release_pinned_buffer(amqp_pinned_buffer_t *pin);
+
+/*
+ * Moves the pages and large blocks the pool has handed out since it was
+ * last recycled to the end of taken, and recycles the pool. Spare pages
+ * stay with the pool.
+ *
+ * Returns 1 on success, 0 (leaving the pool untouched) on failure.
+ */
+int amqp_pool_take_blocks(amqp_pool_t *pool, amqp_pool_blocklist_t *taken);
+
+/* Frees the blocks in a list filled by amqp_pool_take_blocks() */
+void amqp_pool_free_blocks(amqp_pool_blocklist_t *blocks);
+
+/*
+ * If the frame being read is large and its remainder is not buffered, sets
+ * dest to the part of the frame buffer that still has to be filled so that
+ * it can be received into directly, bypassing sock_inbound_buffer.
+ */
+amqp_boolean_t amqp_direct_input_buffer(amqp_connection_state_t state,
+                                        amqp_bytes_t *dest);
+
+/*
+ * Accounts for len bytes received into the buffer returned by
+ * amqp_direct_input_buffer(), decoding the frame if it is now complete.
+ */
+int amqp_handle_direct_input(amqp_connection_state_t state, size_t len,
+                             amqp_frame_t *decoded_frame);
+
+/*
+ * Directs the payload of the next body frames on channel into sink, which
+ * is advanced past each payload received into it. Pass amqp_empty_bytes to
+ * stop.
+ */
+void amqp_set_body_sink(amqp_connection_state_t state, amqp_channel_t channel,
+                        amqp_bytes_t sink);
+
+/*
+ * Waits for the next content header or body frame on the given channel, or
+ * a channel.close on it. Other frames that arrive in the meantime, methods
+ * on the same channel included, are queued for amqp_simple_wait_frame().
+ */
+int amqp_simple_wait_content_frame(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_frame_t *decoded_frame);
+
+/* Appends a frame to the end of the queued frame list */
+int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame);
+
+/* Puts a frame back at the front of the queued frame list */
+int amqp_put_back_frame(amqp_connection_state_t state, amqp_frame_t *frame);
+
+/*
+ * Tells a TCP socket with zero copy sends enabled which memory it may send
+ * without copying: the body being published, which the caller keeps
+ * unchanged until the send completes. Pass NULL to clear. Does nothing
+ * for other kinds of socket.
+ */
+void amqp_tcp_socket_set_zerocopy_range(amqp_socket_t *base,
+                                        const void *bytes, size_t len);
+
+/*
+ * Collects zero copy completion notifications from a TCP socket's error
+ * queue without blocking. Returns 1 if there were any, 0 if not (or for
+ * other kinds of socket), or an amqp_status_enum value on error.
+ */
+int amqp_tcp_socket_zerocopy_reap(amqp_socket_t *base);
+
+/*
+ * Turns a timeout into a monotonic deadline, 0 when timeout is NULL, and
+ * back into the time left until that deadline.
+ */
+int amqp_timeout_deadline(struct timeval *timeout, uint64_t *deadline);
+int amqp_timeout_left(uint64_t deadline, struct timeval *left);
+
+/*
+ * Reads one frame for the confirm engine. basic.ack and basic.nack frames
+ * are settled, anything else is queued for amqp_simple_wait_frame(), in
+ * which case 1 is returned.
+ */
+int amqp_wait_confirm_frame(amqp_connection_state_t state,
+                            struct timeval *timeout);
+
+/*
+ * Settles basic.ack and basic.nack frames on channels in confirm mode, and
+ * drops the confirm state of channels that are closed. Returns 1 if the
+ * frame was consumed, 0 if it should be passed on, or an amqp_status_enum
+ * value on error.
+ */
+int amqp_confirm_handle_frame(amqp_connection_state_t state,
+                              amqp_frame_t *frame);
+
+/*
+ * Called before publishing on channel: blocks while the channel has its
+ * maximum number of messages in flight.
+ */
+int amqp_confirm_wait_window(amqp_connection_state_t state,
+                             amqp_channel_t channel);
+
+/* Assigns the next sequence number to a message just published */
+int amqp_confirm_published(amqp_connection_state_t state,
+                           amqp_channel_t channel);
+
+/* Frees all confirm state without reporting outstanding messages */
+void amqp_confirm_destroy(amqp_connection_state_t state);
+
+/*
+ * Takes an ack on a channel with ack coalescing turned on. Returns 1 if the
+ * ack was held back (or already written along with the others held), 0 if
+ * the caller has to send it itself, or an amqp_status_enum value on error.
+ */
+int amqp_ack_coalesce(amqp_connection_state_t state, amqp_channel_t channel,
+                      uint64_t delivery_tag, amqp_boolean_t multiple);
+
+/* Notes that a delivery, or with multiple all up to it, was settled by a
+ * frame that has just been sent */
+void amqp_ack_coalesce_settled(amqp_connection_state_t state,
+                               amqp_channel_t channel, uint64_t delivery_tag,
+                               amqp_boolean_t multiple);
+
+/* Appends the acks held back on all channels to outbound_buffer, still
+ * holding them until amqp_ack_coalesce_sent() says they went out */
+int amqp_ack_coalesce_append(amqp_connection_state_t state);
+
+/* Notes that the acks appended by amqp_ack_coalesce_append() were sent */
+void amqp_ack_coalesce_sent(amqp_connection_state_t state);
+
+/*
+ * Encodes the acks held back on all channels into outbound_buffer, to go
+ * out in front of next_frame (NULL when flushing).
+ */
+int amqp_ack_coalesce_encode(amqp_connection_state_t state,
+                             const amqp_frame_t *next_frame);
+
+/* Returns the earliest time held acks have to be written out by, or 0 if
+ * none have a deadline */
+uint64_t amqp_ack_coalesce_deadline(amqp_connection_state_t state);
+
+/* Frees all ack coalescing state, dropping held acks */
+void amqp_ack_coalesce_destroy(amqp_connection_state_t state);
+
+/*
+ * Makes sure at least amount bytes of outbound_buffer are free past
+ * outbound_offset, growing it if needed.
+ */
+int amqp_reserve_outbound_buffer(amqp_connection_state_t state, size_t amount);
+
+/*
+ * Encodes a method frame behind the unsent frames in outbound_buffer, to go
+ * out with them.
+ */
+int amqp_append_method(amqp_connection_state_t state, amqp_channel_t channel,
+                       amqp_method_number_t id, void *decoded);
+
+/*
+ * Encodes a complete frame, frame end byte included, into encoded.
+ *
+ * Returns the number of bytes written, or an amqp_status_enum value on error
+ * (including when the frame does not fit).
+ */
+int amqp_encode_frame(amqp_bytes_t encoded, const amqp_frame_t *frame);
 
 static inline void *amqp_offset(void *data, size_t offset)
 {
@@ -349,6 +349,41 @@ amqp_boolean_t amqp_data_in_buffer(amqp_connection_state_t state)
   return (state->sock_inbound_offset < state->sock_inbound_limit);
 }
 
+/* Decodes the next complete frame held in sock_inbound_buffer. Leaves
+ * frame_type zero once the buffered data runs out mid-frame. */
+static int decode_buffered_frame(amqp_connection_state_t state,
+                                 amqp_frame_t *decoded_frame)
+{
+  int res;
+
+  decoded_frame->frame_type = 0;
+
+  while (amqp_data_in_buffer(state)) {
+    amqp_bytes_t buffer;
+    buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
+    buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
+
+    res = amqp_handle_input_in_place(state, decoded_frame);
+    if (0 == res) {
+      res = amqp_handle_input(state, buffer, decoded_frame);
+    }
+    if (res < 0) {
+      return res;
+    }
+
+    state->sock_inbound_offset += res;
+
+    if (decoded_frame->frame_type != 0) {
+      return AMQP_STATUS_OK;
+    }
+
+    /* Incomplete or ignored frame. Keep processing input. */
+    assert(res != 0);
+  }
+
+  return AMQP_STATUS_OK;
+}
+
 static int wait_frame_inner(amqp_connection_state_t state,
                             amqp_frame_t *decoded_frame,
                             struct timeval *timeout)
@@ -359,25 +394,28 @@ static int wait_frame_inner(amqp_connection_state_t state,
   while (1) {
     int res;
 
-    while (amqp_data_in_buffer(state)) {
-      amqp_bytes_t buffer;
-      buffer.len = state->sock_inbound_limit - state->sock_inbound_offset;
-      buffer.bytes = ((char *) state->sock_inbound_buffer.bytes) + state->sock_inbound_offset;
+    /* Batches and held acks are due even while frames keep arriving */
+    res = amqp_flush_expired(state);
+    if (res < 0) {
+      return res;
+    }
 
-      res = amqp_handle_input(state, buffer, decoded_frame);
-      if (res < 0) {
-        return res;
-      }
+    res = decode_buffered_frame(state, decoded_frame);
+    if (res < 0) {
+      return res;
+    }
 
-      state->sock_inbound_offset += res;
+    if (decoded_frame->frame_type != 0) {
+      /* Complete frame was read. Return it. */
+      return AMQP_STATUS_OK;
+    }
 
-      if (decoded_frame->frame_type != 0) {
-        /* Complete frame was read. Return it. */
-        return AMQP_STATUS_OK;
+    /* Don't keep batched messages back while waiting, unless only polling */
+    if (NULL == timeout || timeout->tv_sec != 0 || timeout->tv_usec != 0) {
+      res = amqp_flush(state);
+      if (res < 0) {
+        return res;
       }
-
-      /* Incomplete or ignored frame. Keep processing input. */
-      assert(res != 0);
     }
 
     if (timeout) {
@@ -421,6 +459,7 @@ static int wait_frame_inner(amqp_connection_state_t state,
         /* TODO: Heartbeat timeout goes here */
 
         if (current_timestamp > timeout_timestamp) {
+          amqp_maybe_shrink_sock_inbound_buffer(state);
           return AMQP_STATUS_TIMEOUT;
         }
 
@@ -433,10 +472,19 @@ static int wait_frame_inner(amqp_connection_state_t state,
         res = select(fd + 1, &read_fd, NULL, &except_fd, &tv);
 
         if (res > 0) {
+          /* Zero copy completions also wake select() up, but leave
+           * nothing to read */
+          res = amqp_tcp_socket_zerocopy_reap(state->socket);
+          if (res < 0) {
+            return res;
+          } else if (res > 0) {
+            continue;
+          }
           /* socket is ready to be read from */
           break;
         } else if (0 == res) {
           /* Timed out - return */
+          amqp_maybe_shrink_sock_inbound_buffer(state);
           return AMQP_STATUS_TIMEOUT;
         } else if (errno == EINTR) {
           /* Try again */
@@ -447,6 +495,39 @@ static int wait_frame_inner(amqp_connection_state_t state,
       }
     }
 
+    {
+      amqp_bytes_t direct;
+
+      if (amqp_direct_input_buffer(state, &direct)) {
+        int flags = 0;
+#ifdef MSG_WAITALL
+        /* Nothing else to wake up for when blocking indefinitely */
+        if (NULL == timeout) {
+          flags |= MSG_WAITALL;
+        }
+#endif
+        res = amqp_socket_recv(state->socket, direct.bytes, direct.len, flags);
+        if (res < 0) {
+          return res;
+        }
+
+        res = amqp_handle_direct_input(state, res, decoded_frame);
+        if (res < 0) {
+          return res;
+        }
+
+        if (decoded_frame->frame_type != 0) {
+          return AMQP_STATUS_OK;
+        }
+        continue;
+      }
+    }
+
+    res = amqp_prepare_sock_inbound_buffer(state);
+    if (res < 0) {
+      return res;
+    }
+
     res = amqp_socket_recv(state->socket, state->sock_inbound_buffer.bytes,
                            state->sock_inbound_buffer.len, 0);
     if (res < 0) {
@@ -458,26 +539,301 @@ static int wait_frame_inner(amqp_connection_state_t state,
   }
 }
 
+int amqp_timeout_deadline(struct timeval *timeout, uint64_t *deadline)
+{
+  uint64_t now;
+
+  *deadline = 0;
+  if (NULL == timeout) {
+    return AMQP_STATUS_OK;
+  }
+  if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  now = amqp_get_monotonic_timestamp();
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+  *deadline = now + timeout->tv_sec * AMQP_NS_PER_S +
+              timeout->tv_usec * AMQP_NS_PER_US;
+  return AMQP_STATUS_OK;
+}
+
+int amqp_timeout_left(uint64_t deadline, struct timeval *left)
+{
+  uint64_t now = amqp_get_monotonic_timestamp();
+  uint64_t ns_left;
+
+  if (0 == now) {
+    return AMQP_STATUS_TIMER_FAILURE;
+  }
+
+  /* Once the deadline has passed this polls, so that frames that are
+   * already there still get read */
+  ns_left = now < deadline ? deadline - now : 0;
+  left->tv_sec = ns_left / AMQP_NS_PER_S;
+  left->tv_usec = (ns_left % AMQP_NS_PER_S) / AMQP_NS_PER_US;
+  return AMQP_STATUS_OK;
+}
+
+/* Like wait_frame_inner(), but settles publisher confirms on the way */
+static int wait_frame_filtered(amqp_connection_state_t state,
+                               amqp_frame_t *decoded_frame,
+                               struct timeval *timeout)
+{
+  struct timeval left;
+  uint64_t deadline;
+  int res;
+
+  if (NULL == state->confirm_windows) {
+    return wait_frame_inner(state, decoded_frame, timeout);
+  }
+
+  res = amqp_timeout_deadline(timeout, &deadline);
+  if (res < 0) {
+    return res;
+  }
+
+  while (1) {
+    if (NULL != timeout) {
+      res = amqp_timeout_left(deadline, &left);
+      if (res < 0) {
+        return res;
+      }
+    }
+
+    res = wait_frame_inner(state, decoded_frame,
+                           NULL == timeout ? NULL : &left);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    res = amqp_confirm_handle_frame(state, decoded_frame);
+    if (res < 0) {
+      return res;
+    }
+    if (0 == res) {
+      return AMQP_STATUS_OK;
+    }
+  }
+}
+
+int amqp_wait_confirm_frame(amqp_connection_state_t state,
+                            struct timeval *timeout)
+{
+  amqp_frame_t frame;
+  int res;
+
+  res = wait_frame_inner(state, &frame, timeout);
+  if (AMQP_STATUS_OK != res) {
+    return res;
+  }
+
+  res = amqp_confirm_handle_frame(state, &frame);
+  if (res < 0) {
+    return res;
+  }
+  if (0 == res) {
+    res = amqp_queue_frame(state, &frame);
+    return res < 0 ? res : 1;
+  }
+  return AMQP_STATUS_OK;
+}
+
 int amqp_simple_wait_frame(amqp_connection_state_t state,
                            amqp_frame_t *decoded_frame)
 {
   return amqp_simple_wait_frame_noblock(state, decoded_frame, NULL);
 }
 
+static void dequeue_frame(amqp_connection_state_t state,
+                          amqp_frame_t *decoded_frame)
+{
+  amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
+  state->first_queued_frame = state->first_queued_frame->next;
+  if (state->first_queued_frame == NULL) {
+    state->last_queued_frame = NULL;
+  }
+  *decoded_frame = *f;
+}
+
 int amqp_simple_wait_frame_noblock(amqp_connection_state_t state,
                                    amqp_frame_t *decoded_frame,
                                    struct timeval *timeout)
 {
   if (state->first_queued_frame != NULL) {
-    amqp_frame_t *f = (amqp_frame_t *) state->first_queued_frame->data;
-    state->first_queued_frame = state->first_queued_frame->next;
-    if (state->first_queued_frame == NULL) {
-      state->last_queued_frame = NULL;
-    }
-    *decoded_frame = *f;
+    dequeue_frame(state, decoded_frame);
     return AMQP_STATUS_OK;
   } else {
-    return wait_frame_inner(state, decoded_frame, timeout);
+    return wait_frame_filtered(state, decoded_frame, timeout);
+  }
+}
+
+int amqp_simple_wait_frames(amqp_connection_state_t state,
+                            amqp_frame_t *decoded_frames,
+                            int max_frames,
+                            struct timeval *timeout)
+{
+  int count = 0;
+  int res;
+
+  if (max_frames <= 0) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  while (count < max_frames && state->first_queued_frame != NULL) {
+    dequeue_frame(state, &decoded_frames[count]);
+    count++;
+  }
+
+  if (0 == count) {
+    res = wait_frame_filtered(state, &decoded_frames[0], timeout);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+    count++;
+  }
+
+  /* Take whatever else the last read brought in without reading again */
+  while (count < max_frames && amqp_data_in_buffer(state)) {
+    res = decode_buffered_frame(state, &decoded_frames[count]);
+    if (res < 0) {
+      return res;
+    }
+    if (0 == decoded_frames[count].frame_type) {
+      break;
+    }
+    res = amqp_confirm_handle_frame(state, &decoded_frames[count]);
+    if (res < 0) {
+      return res;
+    }
+    if (0 == res) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+static amqp_link_t *copy_frame_to_link(amqp_connection_state_t state,
+                                       amqp_frame_t *frame)
+{
+  amqp_pool_t *channel_pool;
+  amqp_frame_t *frame_copy;
+  amqp_link_t *link;
+
+  channel_pool = amqp_get_or_create_channel_pool(state, frame->channel);
+  if (NULL == channel_pool) {
+    return NULL;
+  }
+
+  frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
+  link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
+
+  if (frame_copy == NULL || link == NULL) {
+    return NULL;
+  }
+
+  *frame_copy = *frame;
+  link->next = NULL;
+  link->data = frame_copy;
+
+  return link;
+}
+
+int amqp_queue_frame(amqp_connection_state_t state, amqp_frame_t *frame)
+{
+  amqp_link_t *link = copy_frame_to_link(state, frame);
+  if (NULL == link) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  if (state->last_queued_frame == NULL) {
+    state->first_queued_frame = link;
+  } else {
+    state->last_queued_frame->next = link;
+  }
+  state->last_queued_frame = link;
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_put_back_frame(amqp_connection_state_t state, amqp_frame_t *frame)
+{
+  amqp_link_t *link = copy_frame_to_link(state, frame);
+  if (NULL == link) {
+    return AMQP_STATUS_NO_MEMORY;
+  }
+
+  link->next = state->first_queued_frame;
+  state->first_queued_frame = link;
+  if (state->last_queued_frame == NULL) {
+    state->last_queued_frame = link;
+  }
+
+  return AMQP_STATUS_OK;
+}
+
+/* Whether read_message_into() has to see frame: the content on channel, or
+ * the channel closing before it is complete */
+static amqp_boolean_t ends_content_wait(const amqp_frame_t *frame,
+                                        amqp_channel_t channel)
+{
+  if (frame->channel != channel) {
+    return 0;
+  }
+
+  switch (frame->frame_type) {
+  case AMQP_FRAME_HEADER:
+  case AMQP_FRAME_BODY:
+    return 1;
+  case AMQP_FRAME_METHOD:
+    return AMQP_CHANNEL_CLOSE_METHOD == frame->payload.method.id;
+  default:
+    return 0;
+  }
+}
+
+int amqp_simple_wait_content_frame(amqp_connection_state_t state,
+                                   amqp_channel_t channel,
+                                   amqp_frame_t *decoded_frame)
+{
+  amqp_link_t *prev = NULL;
+  amqp_link_t *link;
+  int res;
+
+  for (link = state->first_queued_frame; NULL != link; link = link->next) {
+    amqp_frame_t *f = (amqp_frame_t *) link->data;
+    if (ends_content_wait(f, channel)) {
+      if (NULL == prev) {
+        state->first_queued_frame = link->next;
+      } else {
+        prev->next = link->next;
+      }
+      if (state->last_queued_frame == link) {
+        state->last_queued_frame = prev;
+      }
+      *decoded_frame = *f;
+      return AMQP_STATUS_OK;
+    }
+    prev = link;
+  }
+
+  while (1) {
+    res = wait_frame_filtered(state, decoded_frame, NULL);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
+
+    if (ends_content_wait(decoded_frame, channel)) {
+      return AMQP_STATUS_OK;
+    }
+
+    res = amqp_queue_frame(state, decoded_frame);
+    if (AMQP_STATUS_OK != res) {
+      return res;
+    }
   }
 }
 
@@ -550,7 +906,7 @@ amqp_rpc_reply_t amqp_simple_rpc(amqp_connection_state_t state,
     amqp_frame_t frame;
 
 retry:
-    status = wait_frame_inner(state, &frame, NULL);
+    status = wait_frame_filtered(state, &frame, NULL);
     if (status < 0) {
       result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
       result.library_error = status;
@@ -575,38 +931,13 @@ retry:
              && (frame.payload.method.id == AMQP_CONNECTION_CLOSE_METHOD))
           )
          )) {
-      amqp_pool_t *channel_pool;
-      amqp_frame_t *frame_copy;
-      amqp_link_t *link;
-
-      channel_pool = amqp_get_or_create_channel_pool(state, frame.channel);
-      if (NULL == channel_pool) {
-        result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
-        return result;
-      }
-
-      frame_copy = amqp_pool_alloc(channel_pool, sizeof(amqp_frame_t));
-      link = amqp_pool_alloc(channel_pool, sizeof(amqp_link_t));
-
-      if (frame_copy == NULL || link == NULL) {
+      status = amqp_queue_frame(state, &frame);
+      if (status < 0) {
         result.reply_type = AMQP_RESPONSE_LIBRARY_EXCEPTION;
-        result.library_error = AMQP_STATUS_NO_MEMORY;
+        result.library_error = status;
         return result;
       }
 
-      *frame_copy = frame;
-
-      link->next = NULL;
-      link->data = frame_copy;
-
-      if (state->last_queued_frame == NULL) {
-        state->first_queued_frame = link;
-      } else {
-        state->last_queued_frame->next = link;
-      }
-      state->last_queued_frame = link;
-
       goto retry;
     }
 
@@ -44,6 +44,105 @@ amqp_socket_t *
 AMQP_CALL
 amqp_ssl_socket_new(void);
 
+/**
+ * An SSL/TLS client context that can be shared by many sockets.
+ *
+ * A context holds the CA certificates and client key that sockets verify
+ * and authenticate with, so they are loaded once rather than for every
+ * socket. It also remembers the last session negotiated with each broker
+ * (host and port), and sockets opened to that broker again offer it, so
+ * that reconnecting resumes the session instead of doing a full handshake.
+ *
+ * Contexts are reference counted. Each socket created from a context holds
+ * a reference to it until it is closed.
+ */
+typedef struct amqp_ssl_context_t_ amqp_ssl_context_t;
+
+/**
+ * Create a new SSL/TLS context.
+ *
+ * Call amqp_ssl_context_release() to drop the reference returned.
+ *
+ * \return A new context or NULL if an error occurred.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_ssl_context_t *
+AMQP_CALL
+amqp_ssl_context_new(void);
+
+/**
+ * Drop a reference to an SSL/TLS context.
+ *
+ * The context is freed once it is released and every socket using it has
+ * been closed.
+ *
+ * \param [in] context An SSL/TLS context.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL
+amqp_ssl_context_release(amqp_ssl_context_t *context);
+
+/**
+ * Set the CA certificate of a context.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cacert Path to the CA cert file in PEM format.
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_cacert(amqp_ssl_context_t *context,
+                            const char *cacert);
+
+/**
+ * Set the client key of a context.
+ *
+ * \param [in,out] context An SSL/TLS context.
+ * \param [in] cert Path to the client certificate in PEM format.
+ * \param [in] key Path to the client key in PEM format.
+ *
+ * \return AMQP_STATUS_OK on success, an amqp_status_enum value otherwise.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_context_set_key(amqp_ssl_context_t *context,
+                         const char *cert,
+                         const char *key);
+
+/**
+ * Create a new SSL/TLS socket object that uses a shared context.
+ *
+ * The socket takes a reference to the context. Setting the CA certificate
+ * or key on the socket changes them for every socket using the context.
+ *
+ * Call amqp_socket_close() to release socket resources.
+ *
+ * \param [in] context An SSL/TLS context.
+ *
+ * \return A new socket object or NULL if an error occurred.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *
+AMQP_CALL
+amqp_ssl_socket_new_with_context(amqp_ssl_context_t *context);
+
+/**
+ * Check whether the last amqp_socket_open() resumed an earlier session.
+ *
+ * \param [in] self An SSL/TLS socket object.
+ *
+ * \return Non-zero if the handshake resumed a cached session, zero if it
+ *         was a full handshake.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t
+AMQP_CALL
+amqp_ssl_socket_session_reused(amqp_socket_t *self);
+
 /**
  * Set the CA certificate.
  *
@@ -108,6 +207,49 @@ AMQP_CALL
 amqp_ssl_socket_set_verify(amqp_socket_t *self,
                            amqp_boolean_t verify);
 
+/**
+ * Kernel TLS offload in use on an SSL/TLS socket.
+ */
+typedef enum {
+  AMQP_SSL_KTLS_SEND = 0x1, /**< records are encrypted by the kernel */
+  AMQP_SSL_KTLS_RECV = 0x2  /**< records are decrypted by the kernel */
+} amqp_ssl_ktls_t;
+
+/**
+ * Enable or disable kernel TLS offload.
+ *
+ * When enabled, the socket asks the SSL library to hand the session keys
+ * to the kernel once the handshake is done, so that records are encrypted
+ * and decrypted by the kernel rather than in user space. Whether that
+ * happens depends on the SSL library, the kernel and the negotiated cipher;
+ * if any of them does not support it the socket silently keeps encrypting
+ * in user space. Use amqp_ssl_socket_get_ktls() after amqp_socket_open()
+ * to find out. kTLS is disabled by default.
+ *
+ * This must be called before amqp_socket_open().
+ *
+ * \param [in,out] self An SSL/TLS socket object.
+ * \param [in] enable Enable or disable kernel TLS.
+ */
+AMQP_PUBLIC_FUNCTION
+void
+AMQP_CALL
+amqp_ssl_socket_set_ktls(amqp_socket_t *self,
+                         amqp_boolean_t enable);
+
+/**
+ * Get the kernel TLS offload in use on an open socket.
+ *
+ * \param [in] self An SSL/TLS socket object.
+ *
+ * \return A combination of amqp_ssl_ktls_t flags, zero when all records
+ *         are handled in user space.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_ssl_socket_get_ktls(amqp_socket_t *self);
+
 /**
  * Sets whether rabbitmq-c initializes the underlying SSL library.
  *
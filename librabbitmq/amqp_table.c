@@ -59,6 +59,89 @@ static int amqp_encode_field_value(amqp_bytes_t encoded,
 
 /*---------------------------------------------------------------------------*/
 
+/* Moves *offset past the field value of the given kind without decoding it */
+static int amqp_skip_field_value(amqp_bytes_t encoded, uint8_t kind,
+                                 size_t *offset)
+{
+  size_t len;
+  uint32_t len32;
+
+  switch (kind) {
+  case AMQP_FIELD_KIND_VOID:
+    len = 0;
+    break;
+
+  case AMQP_FIELD_KIND_BOOLEAN:
+  case AMQP_FIELD_KIND_I8:
+  case AMQP_FIELD_KIND_U8:
+    len = 1;
+    break;
+
+  case AMQP_FIELD_KIND_I16:
+  case AMQP_FIELD_KIND_U16:
+    len = 2;
+    break;
+
+  case AMQP_FIELD_KIND_I32:
+  case AMQP_FIELD_KIND_U32:
+  case AMQP_FIELD_KIND_F32:
+    len = 4;
+    break;
+
+  case AMQP_FIELD_KIND_DECIMAL:
+    len = 5;
+    break;
+
+  case AMQP_FIELD_KIND_I64:
+  case AMQP_FIELD_KIND_U64:
+  case AMQP_FIELD_KIND_F64:
+  case AMQP_FIELD_KIND_TIMESTAMP:
+    len = 8;
+    break;
+
+  case AMQP_FIELD_KIND_UTF8:
+  case AMQP_FIELD_KIND_BYTES:
+  case AMQP_FIELD_KIND_ARRAY:
+  case AMQP_FIELD_KIND_TABLE:
+    if (!amqp_decode_32(encoded, offset, &len32)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+    len = len32;
+    break;
+
+  default:
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  if (len > encoded.len - *offset) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  *offset += len;
+
+  return AMQP_STATUS_OK;
+}
+
+/* Entries are decoded straight into pool memory. When they outgrow it a
+ * block twice the size is taken from the pool and the old one is left there
+ * unused until the pool is recycled; that costs at most as much pool space
+ * as the entries themselves, and no heap traffic. */
+static void *grow_pool_entries(amqp_pool_t *pool, void *entries,
+                               int num_entries, int *allocated_entries,
+                               size_t entry_size)
+{
+  int new_allocated_entries = *allocated_entries * 2;
+  void *new_entries;
+
+  new_entries = amqp_pool_alloc(pool, new_allocated_entries * entry_size);
+  if (new_entries == NULL) {
+    return NULL;
+  }
+
+  memcpy(new_entries, entries, num_entries * entry_size);
+  *allocated_entries = new_allocated_entries;
+  return new_entries;
+}
+
 static int amqp_decode_array(amqp_bytes_t encoded,
                              amqp_pool_t *pool,
                              amqp_array_t *output,
@@ -67,7 +150,7 @@ static int amqp_decode_array(amqp_bytes_t encoded,
   uint32_t arraysize;
   int num_entries = 0;
   int allocated_entries = INITIAL_ARRAY_SIZE;
-  amqp_field_value_t *entries;
+  amqp_field_value_t *entries = NULL;
   size_t limit;
   int res;
 
@@ -75,48 +158,41 @@ static int amqp_decode_array(amqp_bytes_t encoded,
     return AMQP_STATUS_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_field_value_t));
-  if (entries == NULL) {
-    return AMQP_STATUS_NO_MEMORY;
+  /* every value takes at least one byte */
+  if (arraysize < (uint32_t)allocated_entries) {
+    allocated_entries = arraysize;
+  }
+  if (allocated_entries > 0) {
+    entries = amqp_pool_alloc(pool, allocated_entries * sizeof(amqp_field_value_t));
+    if (entries == NULL) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
   }
 
   limit = *offset + arraysize;
   while (*offset < limit) {
     if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_field_value_t));
-      res = AMQP_STATUS_NO_MEMORY;
-      if (newentries == NULL) {
-        goto out;
+      entries = grow_pool_entries(pool, entries, num_entries,
+                                  &allocated_entries,
+                                  sizeof(amqp_field_value_t));
+      if (entries == NULL) {
+        return AMQP_STATUS_NO_MEMORY;
       }
-
-      entries = newentries;
     }
 
     res = amqp_decode_field_value(encoded, pool, &entries[num_entries],
                                   offset);
     if (res < 0) {
-      goto out;
+      return res;
     }
 
     num_entries++;
   }
 
   output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_field_value_t));
-  res = AMQP_STATUS_NO_MEMORY;
-  /* NULL is legitimate if we requested a zero-length block. */
-  if (output->entries == NULL && num_entries > 0) {
-    goto out;
-  }
+  output->entries = entries;
 
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_field_value_t));
-  res = 0;
-
-out:
-  free(entries);
-  return res;
+  return AMQP_STATUS_OK;
 }
 
 int amqp_decode_table(amqp_bytes_t encoded,
@@ -126,7 +202,7 @@ int amqp_decode_table(amqp_bytes_t encoded,
 {
   uint32_t tablesize;
   int num_entries = 0;
-  amqp_table_entry_t *entries;
+  amqp_table_entry_t *entries = NULL;
   int allocated_entries = INITIAL_TABLE_SIZE;
   size_t limit;
   int res;
@@ -135,60 +211,51 @@ int amqp_decode_table(amqp_bytes_t encoded,
     return AMQP_STATUS_BAD_AMQP_DATA;
   }
 
-  entries = malloc(allocated_entries * sizeof(amqp_table_entry_t));
-  if (entries == NULL) {
-    return AMQP_STATUS_NO_MEMORY;
+  /* every entry takes at least a key length and a kind byte */
+  if (tablesize / 2 < (uint32_t)allocated_entries) {
+    allocated_entries = tablesize / 2;
+  }
+  if (allocated_entries > 0) {
+    entries = amqp_pool_alloc(pool, allocated_entries * sizeof(amqp_table_entry_t));
+    if (entries == NULL) {
+      return AMQP_STATUS_NO_MEMORY;
+    }
   }
 
   limit = *offset + tablesize;
   while (*offset < limit) {
     uint8_t keylen;
 
-    res = AMQP_STATUS_BAD_AMQP_DATA;
     if (!amqp_decode_8(encoded, offset, &keylen)) {
-      goto out;
+      return AMQP_STATUS_BAD_AMQP_DATA;
     }
 
     if (num_entries >= allocated_entries) {
-      void *newentries;
-      allocated_entries = allocated_entries * 2;
-      newentries = realloc(entries, allocated_entries * sizeof(amqp_table_entry_t));
-      res = AMQP_STATUS_NO_MEMORY;
-      if (newentries == NULL) {
-        goto out;
+      entries = grow_pool_entries(pool, entries, num_entries,
+                                  &allocated_entries,
+                                  sizeof(amqp_table_entry_t));
+      if (entries == NULL) {
+        return AMQP_STATUS_NO_MEMORY;
       }
-
-      entries = newentries;
     }
 
-    res = AMQP_STATUS_BAD_AMQP_DATA;
     if (!amqp_decode_bytes(encoded, offset, &entries[num_entries].key, keylen)) {
-      goto out;
+      return AMQP_STATUS_BAD_AMQP_DATA;
     }
 
     res = amqp_decode_field_value(encoded, pool, &entries[num_entries].value,
                                   offset);
     if (res < 0) {
-      goto out;
+      return res;
     }
 
     num_entries++;
   }
 
   output->num_entries = num_entries;
-  output->entries = amqp_pool_alloc(pool, num_entries * sizeof(amqp_table_entry_t));
-  res = AMQP_STATUS_NO_MEMORY;
-  /* NULL is legitimate if we requested a zero-length block. */
-  if (output->entries == NULL && num_entries > 0) {
-    goto out;
-  }
-
-  memcpy(output->entries, entries, num_entries * sizeof(amqp_table_entry_t));
-  res = AMQP_STATUS_OK;
+  output->entries = entries;
 
-out:
-  free(entries);
-  return res;
+  return AMQP_STATUS_OK;
 }
 
 static int amqp_decode_field_value(amqp_bytes_t encoded,
@@ -283,6 +350,151 @@ out:
 
 /*---------------------------------------------------------------------------*/
 
+int amqp_table_iter_init(amqp_table_iter_t *iter,
+                         amqp_bytes_t encoded,
+                         size_t *offset)
+{
+  uint32_t tablesize;
+
+  if (!amqp_decode_32(encoded, offset, &tablesize)
+      || tablesize > encoded.len - *offset) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  iter->encoded.bytes = amqp_offset(encoded.bytes, *offset);
+  iter->encoded.len = tablesize;
+  iter->offset = 0;
+  iter->value_offset = 0;
+  iter->kind = 0;
+
+  *offset += tablesize;
+
+  return AMQP_STATUS_OK;
+}
+
+int amqp_table_iter_next(amqp_table_iter_t *iter,
+                         amqp_bytes_t *key,
+                         uint8_t *kind)
+{
+  uint8_t keylen;
+
+  if (iter->offset >= iter->encoded.len) {
+    return 0;
+  }
+
+  if (!amqp_decode_8(iter->encoded, &iter->offset, &keylen)
+      || !amqp_decode_bytes(iter->encoded, &iter->offset, &iter->key, keylen)
+      || !amqp_decode_8(iter->encoded, &iter->offset, &iter->kind)) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  iter->value_offset = iter->offset;
+
+  /* Find the next entry now, so the value never has to be looked at */
+  if (amqp_skip_field_value(iter->encoded, iter->kind, &iter->offset) < 0) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+
+  if (NULL != key) {
+    *key = iter->key;
+  }
+  if (NULL != kind) {
+    *kind = iter->kind;
+  }
+
+  return 1;
+}
+
+int amqp_table_iter_find(amqp_table_iter_t *iter,
+                         amqp_bytes_t key,
+                         uint8_t *kind)
+{
+  int res;
+
+  while ((res = amqp_table_iter_next(iter, NULL, kind)) > 0) {
+    if (iter->key.len == key.len
+        && 0 == memcmp(iter->key.bytes, key.bytes, key.len)) {
+      return 1;
+    }
+  }
+
+  return res;
+}
+
+int amqp_table_iter_value(amqp_table_iter_t *iter,
+                          amqp_pool_t *pool,
+                          amqp_field_value_t *value)
+{
+  /* Back up over the kind byte, amqp_decode_field_value() reads it */
+  size_t offset = iter->value_offset - 1;
+
+  if (0 == iter->kind) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  return amqp_decode_field_value(iter->encoded, pool, value, &offset);
+}
+
+int amqp_table_iter_child(amqp_table_iter_t *iter,
+                          amqp_table_iter_t *child)
+{
+  size_t offset = iter->value_offset;
+
+  if (AMQP_FIELD_KIND_TABLE != iter->kind) {
+    return AMQP_STATUS_INVALID_PARAMETER;
+  }
+
+  return amqp_table_iter_init(child, iter->encoded, &offset);
+}
+
+int amqp_table_iter_init_headers(amqp_table_iter_t *iter,
+                                 amqp_bytes_t raw_properties)
+{
+  size_t offset = 0;
+  uint16_t flags;
+  uint16_t partial_flags;
+  uint8_t len;
+  amqp_bytes_t skipped;
+  int res;
+
+  if (!amqp_decode_16(raw_properties, &offset, &flags)) {
+    return AMQP_STATUS_BAD_AMQP_DATA;
+  }
+  /* The basic class only needs the first flag word, skip any others */
+  partial_flags = flags;
+  while (partial_flags & 1) {
+    if (!amqp_decode_16(raw_properties, &offset, &partial_flags)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+  }
+
+  if (!(flags & AMQP_BASIC_HEADERS_FLAG)) {
+    return 0;
+  }
+
+  if (flags & AMQP_BASIC_CONTENT_TYPE_FLAG) {
+    if (!amqp_decode_8(raw_properties, &offset, &len)
+        || !amqp_decode_bytes(raw_properties, &offset, &skipped, len)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+  }
+  if (flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+    if (!amqp_decode_8(raw_properties, &offset, &len)
+        || !amqp_decode_bytes(raw_properties, &offset, &skipped, len)) {
+      return AMQP_STATUS_BAD_AMQP_DATA;
+    }
+  }
+
+  res = amqp_table_iter_init(iter, raw_properties, &offset);
+  if (res < 0) {
+    return res;
+  }
+
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+
 static int amqp_encode_array(amqp_bytes_t encoded,
                              amqp_array_t *input,
                              size_t *offset)
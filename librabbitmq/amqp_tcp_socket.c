@@ -27,17 +27,52 @@
 
 #include "amqp_private.h"
 #include "amqp_tcp_socket.h"
+#include "amqp_timer.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+# include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+# define AMQP_TCP_ZEROCOPY
+# include <linux/errqueue.h>
+# include <netinet/in.h>
+# include <poll.h>
+#endif
+
+typedef struct zerocopy_range_t_ {
+  uint32_t lo;
+  uint32_t hi;
+} zerocopy_range_t;
 
 struct amqp_tcp_socket_t {
   const struct amqp_socket_class_t *klass;
   int sockfd;
-  void *buffer;
-  size_t buffer_length;
   int internal_error;
+  /* the most iovecs a single writev()/sendmsg() call accepts */
+  int iov_max;
+  /* cleared when sendmsg() turns out not to work on sockfd */
+  int use_sendmsg;
+
+  /* Zero copy sends, see amqp_tcp_socket_set_zerocopy(). Only iovecs of at
+   * least zc_threshold bytes within [zc_begin, zc_end) go out that way. */
+  size_t zc_threshold;
+  const char *zc_begin;
+  const char *zc_end;
+  /* the kernel numbers zero copy sends from 0, completions come back as
+   * ranges of those ids */
+  uint32_t zc_next;
+  /* every send before this id has completed */
+  uint32_t zc_completed;
+  /* ranges that completed ahead of zc_completed */
+  zerocopy_range_t *zc_ranges;
+  int zc_num_ranges;
+  int zc_ranges_size;
 };
 
 
@@ -55,7 +90,7 @@ amqp_tcp_socket_send_inner(void *base, const void *buf, size_t len, int flags)
 #endif
 
 start:
-  res = send(self->sockfd, buf, len, flags);
+  res = send(self->sockfd, buf_left, len_left, flags);
 
   if (res < 0) {
     self->internal_error = amqp_os_socket_error();
@@ -84,62 +119,78 @@ amqp_tcp_socket_send(void *base, const void *buf, size_t len)
   return amqp_tcp_socket_send_inner(base, buf, len, 0);
 }
 
+#ifndef _WIN32
+#ifdef MSG_MORE
+# define TCP_MORE MSG_MORE
+#else
+# define TCP_MORE 0
+#endif
+#ifdef AMQP_TCP_ZEROCOPY
+# define TCP_ZEROCOPY MSG_ZEROCOPY
+#else
+# define TCP_ZEROCOPY 0
+#endif
+
+/* Sends the whole iovec list, resuming after partial writes */
 static ssize_t
-amqp_tcp_socket_writev(void *base, struct iovec *iov, int iovcnt)
+tcp_socket_sendv(struct amqp_tcp_socket_t *self, struct iovec *iov,
+                 int iovcnt, int flags)
 {
-  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
   ssize_t ret;
-
-#if defined(_WIN32)
-  DWORD res;
-  /* Making the assumption here that WSAsend won't do a partial send
-   * unless an error occured, in which case we're hosed so it doesn't matter */
-  if (WSASend(self->sockfd, (LPWSABUF)iov, iovcnt, &res, 0, NULL, NULL) == 0) {
-    self->internal_error = 0;
-    ret = AMQP_STATUS_OK;
-  } else {
-    self->internal_error = WSAGetLastError();
-    ret = AMQP_STATUS_SOCKET_ERROR;
-  }
-  return ret;
-
-#elif defined(MSG_MORE)
-  int i;
-  for (i = 0; i < iovcnt - 1; ++i) {
-    ret = amqp_tcp_socket_send_inner(self, iov[i].iov_base, iov[i].iov_len, MSG_MORE);
-    if (ret != AMQP_STATUS_OK) {
-      goto exit;
-    }
-  }
-  ret = amqp_tcp_socket_send_inner(self, iov[i].iov_base, iov[i].iov_len, 0);
-
-exit:
-  return ret;
-
-#elif defined(SO_NOSIGPIPE) || !defined(MSG_NOSIGNAL)
   int i;
   ssize_t len_left = 0;
 
-
   struct iovec *iov_left = iov;
   int iovcnt_left = iovcnt;
+  int iovcnt_send;
+#ifdef MSG_NOSIGNAL
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+#endif
 
   for (i = 0; i < iovcnt; ++i) {
     len_left += iov[i].iov_len;
   }
 
 start:
-  ret = writev(self->sockfd, iov_left, iovcnt_left);
+  /* Longer lists go out in several calls, which the partial write handling
+   * below takes care of */
+  iovcnt_send = iovcnt_left < self->iov_max ? iovcnt_left : self->iov_max;
+
+#ifdef MSG_NOSIGNAL
+  if (self->use_sendmsg) {
+    /* sendmsg() rather than writev() so that MSG_NOSIGNAL can be passed */
+    msg.msg_iov = iov_left;
+    msg.msg_iovlen = iovcnt_send;
+    ret = sendmsg(self->sockfd, &msg, flags | MSG_NOSIGNAL);
+    if (ret < 0 && ENOTSOCK == amqp_os_socket_error()) {
+      /* not a socket (e.g. a pipe), so SIGPIPE can't be suppressed anyway */
+      self->use_sendmsg = 0;
+      goto start;
+    }
+  } else
+#endif
+  {
+    ret = writev(self->sockfd, iov_left, iovcnt_send);
+  }
 
   if (ret < 0) {
     self->internal_error = amqp_os_socket_error();
     if (EINTR == self->internal_error) {
       goto start;
+    } else if (ENOBUFS == self->internal_error && (flags & TCP_ZEROCOPY)) {
+      /* out of memory to pin pages with, copy this one instead */
+      flags &= ~TCP_ZEROCOPY;
+      goto start;
     } else {
-      self->internal_error = amqp_os_socket_error();
       ret = AMQP_STATUS_SOCKET_ERROR;
     }
   } else {
+    if (flags & TCP_ZEROCOPY) {
+      self->zc_next++;
+    }
+
     if (ret == len_left) {
       self->internal_error = 0;
       ret = AMQP_STATUS_OK;
@@ -162,37 +213,62 @@ start:
   }
 
   return ret;
+}
+#endif
+
+static ssize_t
+amqp_tcp_socket_writev(void *base, struct iovec *iov, int iovcnt)
+{
+  struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
+  ssize_t ret;
+
+#if defined(_WIN32)
+  DWORD res;
+  /* Making the assumption here that WSAsend won't do a partial send
+   * unless an error occured, in which case we're hosed so it doesn't matter */
+  if (WSASend(self->sockfd, (LPWSABUF)iov, iovcnt, &res, 0, NULL, NULL) == 0) {
+    self->internal_error = 0;
+    ret = AMQP_STATUS_OK;
+  } else {
+    self->internal_error = WSAGetLastError();
+    ret = AMQP_STATUS_SOCKET_ERROR;
+  }
+  return ret;
 
 #else
   int i;
-  size_t bytes = 0;
-  void *bufferp;
+  int first = 0;
 
-  for (i = 0; i < iovcnt; ++i) {
-    bytes += iov[i].iov_len;
+  if (0 == self->zc_threshold || NULL == self->zc_begin) {
+    return tcp_socket_sendv(self, iov, iovcnt, 0);
   }
 
-  if (self->buffer_length < bytes) {
-    self->buffer = realloc(self->buffer, bytes);
-    if (NULL == self->buffer) {
-      self->buffer_length = 0;
-      self->internal_error = 0;
-      ret = AMQP_STATUS_NO_MEMORY;
-      goto exit;
+  /* Each iovec eligible for zero copy is sent by a call of its own, as
+   * MSG_ZEROCOPY applies to everything passed with it */
+  for (i = 0; i < iovcnt; ++i) {
+    if (iov[i].iov_len >= self->zc_threshold
+        && (const char *)iov[i].iov_base >= self->zc_begin
+        && (const char *)iov[i].iov_base + iov[i].iov_len <= self->zc_end) {
+      if (i > first) {
+        ret = tcp_socket_sendv(self, iov + first, i - first, TCP_MORE);
+        if (ret < 0) {
+          return ret;
+        }
+      }
+
+      ret = tcp_socket_sendv(self, iov + i, 1, TCP_ZEROCOPY
+                             | (i + 1 < iovcnt ? TCP_MORE : 0));
+      if (ret < 0) {
+        return ret;
+      }
+      first = i + 1;
     }
-    self->buffer_length = bytes;
   }
 
-  bufferp = self->buffer;
-  for (i = 0; i < iovcnt; ++i) {
-    memcpy(bufferp, iov[i].iov_base, iov[i].iov_len);
-    bufferp += iov[i].iov_len;
+  if (first < iovcnt) {
+    return tcp_socket_sendv(self, iov + first, iovcnt - first, 0);
   }
-
-  ret = amqp_tcp_socket_send_inner(self, self->buffer, bytes, 0);
-
-exit:
-  return ret;
+  return AMQP_STATUS_OK;
 #endif
 }
 
@@ -224,6 +300,7 @@ amqp_tcp_socket_open(void *base, const char *host, int port)
 {
   struct amqp_tcp_socket_t *self = (struct amqp_tcp_socket_t *)base;
   self->sockfd = amqp_open_socket(host, port);
+  self->use_sendmsg = 1;
   if (0 > self->sockfd) {
     int err = self->sockfd;
     self->sockfd = -1;
@@ -239,8 +316,8 @@ amqp_tcp_socket_close(void *base)
   int status = -1;
   if (self) {
     status = amqp_os_socket_close(self->sockfd);
-    free(self->buffer);
-    free(self);
+    amqp_free(self->zc_ranges);
+    amqp_free(self);
   }
 
   if (0 == status) {
@@ -274,25 +351,273 @@ static const struct amqp_socket_class_t amqp_tcp_socket_class = {
   amqp_tcp_socket_get_sockfd /* get_sockfd */
 };
 
+static int
+tcp_socket_iov_max(void)
+{
+#if defined(_SC_IOV_MAX)
+  long iov_max = sysconf(_SC_IOV_MAX);
+  if (iov_max < 0 || iov_max > INT_MAX) {
+    /* no limit */
+    return INT_MAX;
+  }
+  return iov_max > 0 ? (int)iov_max : 1;
+#elif defined(IOV_MAX)
+  return IOV_MAX;
+#else
+  return 16; /* the POSIX minimum */
+#endif
+}
+
 amqp_socket_t *
 amqp_tcp_socket_new(void)
 {
-  struct amqp_tcp_socket_t *self = calloc(1, sizeof(*self));
+  struct amqp_tcp_socket_t *self = amqp_calloc(1, sizeof(*self));
   if (!self) {
     return NULL;
   }
   self->klass = &amqp_tcp_socket_class;
   self->sockfd = -1;
+  self->iov_max = tcp_socket_iov_max();
+  self->use_sendmsg = 1;
   return (amqp_socket_t *)self;
 }
 
+static struct amqp_tcp_socket_t *
+tcp_socket_cast(amqp_socket_t *base)
+{
+  if (base->klass != &amqp_tcp_socket_class) {
+    amqp_abort("<%p> is not of type amqp_tcp_socket_t", base);
+  }
+  return (struct amqp_tcp_socket_t *)base;
+}
+
 void
 amqp_tcp_socket_set_sockfd(amqp_socket_t *base, int sockfd)
+{
+  struct amqp_tcp_socket_t *self = tcp_socket_cast(base);
+  self->sockfd = sockfd;
+  self->use_sendmsg = 1;
+}
+
+int
+amqp_tcp_socket_set_zerocopy(amqp_socket_t *base, size_t threshold)
+{
+  struct amqp_tcp_socket_t *self = tcp_socket_cast(base);
+#ifdef AMQP_TCP_ZEROCOPY
+  int one = 1;
+
+  if (0 == threshold) {
+    self->zc_threshold = 0;
+    return AMQP_STATUS_OK;
+  }
+
+  /* Fails on kernels before 4.14 and for anything but TCP sockets */
+  if (setsockopt(self->sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one))) {
+    self->internal_error = amqp_os_socket_error();
+    return AMQP_STATUS_UNSUPPORTED;
+  }
+
+  self->zc_threshold = threshold;
+  return AMQP_STATUS_OK;
+#else
+  if (0 == threshold) {
+    return AMQP_STATUS_OK;
+  }
+  (void)self;
+  return AMQP_STATUS_UNSUPPORTED;
+#endif
+}
+
+uint32_t
+amqp_tcp_socket_zerocopy_mark(amqp_socket_t *base)
+{
+  return tcp_socket_cast(base)->zc_next;
+}
+
+void
+amqp_tcp_socket_set_zerocopy_range(amqp_socket_t *base, const void *bytes,
+                                   size_t len)
 {
   struct amqp_tcp_socket_t *self;
-  if (base->klass != &amqp_tcp_socket_class) {
-    amqp_abort("<%p> is not of type amqp_tcp_socket_t", base);
+
+  if (NULL == base || base->klass != &amqp_tcp_socket_class) {
+    return;
   }
+
   self = (struct amqp_tcp_socket_t *)base;
-  self->sockfd = sockfd;
+  self->zc_begin = bytes;
+  self->zc_end = (const char *)bytes + len;
+}
+
+#ifdef AMQP_TCP_ZEROCOPY
+static int
+zerocopy_completed(struct amqp_tcp_socket_t *self, uint32_t lo, uint32_t hi)
+{
+  int i;
+
+  if (lo != self->zc_completed) {
+    if (self->zc_num_ranges == self->zc_ranges_size) {
+      int new_size = self->zc_ranges_size ? 2 * self->zc_ranges_size : 8;
+      zerocopy_range_t *new_ranges =
+        amqp_realloc(self->zc_ranges, new_size * sizeof(zerocopy_range_t));
+      if (NULL == new_ranges) {
+        return AMQP_STATUS_NO_MEMORY;
+      }
+      self->zc_ranges = new_ranges;
+      self->zc_ranges_size = new_size;
+    }
+    self->zc_ranges[self->zc_num_ranges].lo = lo;
+    self->zc_ranges[self->zc_num_ranges].hi = hi;
+    self->zc_num_ranges++;
+    return AMQP_STATUS_OK;
+  }
+
+  self->zc_completed = hi + 1;
+
+  /* Pick up ranges that completed early and now join on */
+  for (i = 0; i < self->zc_num_ranges; ) {
+    if (self->zc_ranges[i].lo == self->zc_completed) {
+      self->zc_completed = self->zc_ranges[i].hi + 1;
+      self->zc_ranges[i] = self->zc_ranges[--self->zc_num_ranges];
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+  return AMQP_STATUS_OK;
+}
+#endif
+
+int
+amqp_tcp_socket_zerocopy_reap(amqp_socket_t *base)
+{
+#ifdef AMQP_TCP_ZEROCOPY
+  struct amqp_tcp_socket_t *self;
+  int reaped = 0;
+
+  if (NULL == base || base->klass != &amqp_tcp_socket_class) {
+    return 0;
+  }
+  self = (struct amqp_tcp_socket_t *)base;
+  if (self->zc_completed == self->zc_next) {
+    return 0;
+  }
+
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int res;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(self->sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      self->internal_error = amqp_os_socket_error();
+      if (EINTR == self->internal_error) {
+        continue;
+      }
+      if (EAGAIN == self->internal_error
+          || EWOULDBLOCK == self->internal_error) {
+        return reaped;
+      }
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *serr;
+
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+          && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+
+      /* The kernel copied the data after all (e.g. over loopback), so zero
+       * copy only adds overhead on this socket */
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        self->zc_threshold = 0;
+      }
+
+      res = zerocopy_completed(self, serr->ee_info, serr->ee_data);
+      if (res < 0) {
+        return res;
+      }
+      reaped = 1;
+    }
+  }
+#else
+  (void)base;
+  return 0;
+#endif
+}
+
+int
+amqp_tcp_socket_zerocopy_wait(amqp_socket_t *base, uint32_t mark,
+                              struct timeval *timeout)
+{
+  struct amqp_tcp_socket_t *self = tcp_socket_cast(base);
+#ifdef AMQP_TCP_ZEROCOPY
+  uint64_t timeout_timestamp = 0;
+
+  if (timeout) {
+    if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+      return AMQP_STATUS_INVALID_PARAMETER;
+    }
+    timeout_timestamp = amqp_get_monotonic_timestamp();
+    if (0 == timeout_timestamp) {
+      return AMQP_STATUS_TIMER_FAILURE;
+    }
+    timeout_timestamp += (uint64_t)timeout->tv_sec * AMQP_NS_PER_S +
+                         (uint64_t)timeout->tv_usec * AMQP_NS_PER_US;
+  }
+
+  while (1) {
+    struct pollfd pfd;
+    int poll_timeout = -1;
+    int res;
+
+    res = amqp_tcp_socket_zerocopy_reap(base);
+    if (res < 0) {
+      return res;
+    }
+
+    /* ids wrap around */
+    if ((int32_t)(mark - self->zc_completed) <= 0) {
+      return AMQP_STATUS_OK;
+    }
+
+    if (timeout) {
+      uint64_t now = amqp_get_monotonic_timestamp();
+      if (0 == now) {
+        return AMQP_STATUS_TIMER_FAILURE;
+      }
+      if (now >= timeout_timestamp) {
+        return AMQP_STATUS_TIMEOUT;
+      }
+      /* round up so as not to spin */
+      poll_timeout = (int)((timeout_timestamp - now + 999999) / 1000000);
+    }
+
+    /* completions are signalled as POLLERR, which needs no request */
+    pfd.fd = self->sockfd;
+    pfd.events = 0;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, poll_timeout) < 0 && EINTR != errno) {
+      self->internal_error = errno;
+      return AMQP_STATUS_SOCKET_ERROR;
+    }
+  }
+#else
+  /* nothing is ever sent without copying */
+  (void)self;
+  (void)mark;
+  (void)timeout;
+  return AMQP_STATUS_OK;
+#endif
 }
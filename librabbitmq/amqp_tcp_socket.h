@@ -59,6 +59,64 @@ void
 AMQP_CALL
 amqp_tcp_socket_set_sockfd(amqp_socket_t *base, int sockfd);
 
+/**
+ * Enable zero-copy transmission of large message bodies (MSG_ZEROCOPY on
+ * Linux 4.14 and later).
+ *
+ * Body frame payloads of at least threshold bytes are then handed to the
+ * kernel without being copied. The body passed to amqp_basic_publish() must
+ * therefore stay unchanged until the kernel is done with it: take a mark
+ * with amqp_tcp_socket_zerocopy_mark() after publishing and wait for it
+ * with amqp_tcp_socket_zerocopy_wait() before reusing or freeing the body.
+ * Bodies copied into a publish batch are never sent this way.
+ *
+ * If the kernel reports having copied the data anyway (as over loopback),
+ * zero-copy is turned off again for the socket.
+ *
+ * \param [in,out] self A TCP socket object, already open.
+ * \param [in] threshold The smallest payload to send without copying, 0
+ *             turns zero-copy off.
+ *
+ * \return AMQP_STATUS_OK, or AMQP_STATUS_UNSUPPORTED if the platform,
+ *         kernel or socket doesn't support it, in which case sends keep
+ *         copying.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_tcp_socket_set_zerocopy(amqp_socket_t *self, size_t threshold);
+
+/**
+ * Get a mark covering every zero-copy send made so far.
+ *
+ * \param [in] self A TCP socket object.
+ *
+ * \return A mark to pass to amqp_tcp_socket_zerocopy_wait().
+ */
+AMQP_PUBLIC_FUNCTION
+uint32_t
+AMQP_CALL
+amqp_tcp_socket_zerocopy_mark(amqp_socket_t *self);
+
+/**
+ * Wait until the kernel is done with every zero-copy send covered by a
+ * mark, after which the bodies they were made from may be reused or freed.
+ *
+ * \param [in,out] self A TCP socket object.
+ * \param [in] mark A mark from amqp_tcp_socket_zerocopy_mark().
+ * \param [in] timeout How long to wait, NULL waits indefinitely and a zero
+ *             timeout only checks.
+ *
+ * \return AMQP_STATUS_OK once the sends have completed,
+ *         AMQP_STATUS_TIMEOUT if they haven't within the timeout, or another
+ *         amqp_status_enum value on error.
+ */
+AMQP_PUBLIC_FUNCTION
+int
+AMQP_CALL
+amqp_tcp_socket_zerocopy_wait(amqp_socket_t *self, uint32_t mark,
+                              struct timeval *timeout);
+
 AMQP_END_DECLS
 
 #endif /* AMQP_TCP_SOCKET_H */
@@ -297,6 +297,8 @@ def genErl(spec):
         print "      %s *p = (%s *) amqp_pool_alloc(pool, sizeof(%s));" % \
               (c.structName(), c.structName(), c.structName())
         print "      if (p == NULL) { return AMQP_STATUS_NO_MEMORY; }"
+        print "      /* pool memory is not zeroed, absent properties must be */"
+        print "      memset(p, 0, sizeof(%s));" % (c.structName(),)
         print "      p->_flags = flags;"
 
         emitter = Emitter("      ")
@@ -0,0 +1,231 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Acks deliveries on a channel with ack coalescing turned on, and checks
+ * the acks written to the other end of a socket pair: a run of acks goes
+ * out as one multiple ack, an ack out of order goes out on its own without
+ * stopping later acks from being held, and held acks are written once
+ * their latency is up while frames are being read.
+ */
+
+static int peer;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+/* Reads a basic.ack (method 80) or basic.nack (method 120) frame */
+static void expect_settle(int method, uint64_t tag, int multiple)
+{
+  unsigned char frame[21];
+  uint64_t got = 0;
+  size_t len = 0;
+  int i;
+
+  while (len < sizeof(frame)) {
+    ssize_t res = recv(peer, frame + len, sizeof(frame) - len, MSG_DONTWAIT);
+    if (res <= 0) {
+      fprintf(stderr, "Expected method %d for %d\n", method, (int)tag);
+      abort();
+    }
+    len += res;
+  }
+
+  if (AMQP_FRAME_METHOD != frame[0] || 1 != frame[2] || 13 != frame[6]
+      || 0 != frame[7] || 60 != frame[8] || 0 != frame[9]
+      || method != frame[10] || AMQP_FRAME_END != frame[20]) {
+    fprintf(stderr, "Expected method %d on channel 1\n", method);
+    abort();
+  }
+  for (i = 0; i < 8; ++i) {
+    got = (got << 8) | frame[11 + i];
+  }
+  if (got != tag || (frame[19] & 1) != multiple) {
+    fprintf(stderr, "Expected %d multiple %d, got %d multiple %d\n",
+            (int)tag, multiple, (int)got, frame[19] & 1);
+    abort();
+  }
+}
+
+static void expect_ack(uint64_t tag, int multiple)
+{
+  expect_settle(80, tag, multiple);
+}
+
+static void expect_nothing(void)
+{
+  char c;
+
+  if (recv(peer, &c, 1, MSG_DONTWAIT) > 0) {
+    fail("Expected nothing to be written");
+  }
+}
+
+static void ack(amqp_connection_state_t conn, uint64_t tag)
+{
+  check("acking", amqp_basic_ack(conn, 1, tag, 0));
+}
+
+static void read_heartbeat(amqp_connection_state_t conn)
+{
+  static const char heartbeat[] = { AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0,
+                                    (char)AMQP_FRAME_END
+                                  };
+  struct timeval poll;
+  amqp_frame_t frame;
+
+  if (send(peer, heartbeat, sizeof(heartbeat), 0) != sizeof(heartbeat)) {
+    fail("sending a heartbeat");
+  }
+  poll.tv_sec = 0;
+  poll.tv_usec = 0;
+  check("reading", amqp_simple_wait_frame_noblock(conn, &frame, &poll));
+  if (AMQP_FRAME_HEARTBEAT != frame.frame_type) {
+    fail("Expected a heartbeat frame");
+  }
+}
+
+int main(void)
+{
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  amqp_bytes_t header;
+  struct timeval max_latency;
+  uint64_t tag;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  header.bytes = "AMQP\0\0\x09\x01";
+  header.len = 8;
+  if (amqp_handle_input(conn, header, &frame) != 8) {
+    fail("reading the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+
+  check("coalescing", amqp_set_ack_coalescing(conn, 1, 8, NULL));
+
+  for (tag = 1; tag <= 3; ++tag) {
+    ack(conn, tag);
+  }
+  expect_nothing();
+  check("flushing", amqp_flush(conn));
+  expect_ack(3, 1);
+
+  /* max_acks held go out on their own */
+  for (tag = 4; tag <= 11; ++tag) {
+    ack(conn, tag);
+  }
+  expect_ack(11, 1);
+  expect_nothing();
+
+  /* 14 can't be held before 12 and 13 are settled, but once they are,
+   * acks after it are held again */
+  ack(conn, 14);
+  expect_ack(14, 0);
+  ack(conn, 12);
+  check("nacking", amqp_basic_nack(conn, 1, 13, 0, 1));
+  expect_ack(12, 1);
+  expect_settle(120, 13, 0);
+  ack(conn, 15);
+  ack(conn, 16);
+  expect_nothing();
+  check("flushing", amqp_flush(conn));
+  expect_ack(16, 1);
+
+  /* Gaps that are filled by acks that get held */
+  ack(conn, 19);
+  expect_ack(19, 0);
+  ack(conn, 17);
+  ack(conn, 18);
+  ack(conn, 20);
+  expect_nothing();
+  check("flushing", amqp_flush(conn));
+  expect_ack(20, 1);
+
+  /* Reading frames writes out held acks that are due, and only those */
+  max_latency.tv_sec = 0;
+  max_latency.tv_usec = 20000;
+  check("coalescing", amqp_set_ack_coalescing(conn, 1, 100, &max_latency));
+  ack(conn, 21);
+  read_heartbeat(conn);
+  expect_nothing();
+  usleep(40000);
+  read_heartbeat(conn);
+  expect_ack(21, 1);
+  expect_nothing();
+
+  check("coalescing", amqp_set_ack_coalescing(conn, 1, 0, NULL));
+  amqp_destroy_connection(conn);
+  close(peer);
+  return 0;
+}
@@ -0,0 +1,219 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Completes deliveries out of order on an ack tracker and checks the acks
+ * each flush writes to the other end of a socket pair: completions past a
+ * gap are held for one multiple ack until the gap closes, and only acked on
+ * their own once too many are held or the gap gets too old.
+ */
+
+static int peer;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+static void expect_ack(uint64_t tag, int multiple)
+{
+  unsigned char frame[21];
+  uint64_t got = 0;
+  size_t len = 0;
+  int i;
+
+  while (len < sizeof(frame)) {
+    ssize_t res = recv(peer, frame + len, sizeof(frame) - len, MSG_DONTWAIT);
+    if (res <= 0) {
+      fprintf(stderr, "Expected an ack for %d\n", (int)tag);
+      abort();
+    }
+    len += res;
+  }
+
+  if (AMQP_FRAME_METHOD != frame[0] || 1 != frame[2] || 13 != frame[6]
+      || 0 != frame[7] || 60 != frame[8] || 0 != frame[9] || 80 != frame[10]
+      || AMQP_FRAME_END != frame[20]) {
+    fail("Expected a basic.ack frame on channel 1");
+  }
+  for (i = 0; i < 8; ++i) {
+    got = (got << 8) | frame[11 + i];
+  }
+  if (got != tag || frame[19] != multiple) {
+    fprintf(stderr, "Expected ack for %d multiple %d, got %d multiple %d\n",
+            (int)tag, multiple, (int)got, frame[19]);
+    abort();
+  }
+}
+
+static void expect_nothing(void)
+{
+  char c;
+
+  if (recv(peer, &c, 1, MSG_DONTWAIT) > 0) {
+    fail("Expected nothing to be written");
+  }
+}
+
+static void complete(amqp_ack_tracker_t *tracker, uint64_t tag)
+{
+  check("completing", amqp_ack_tracker_complete(tracker, tag));
+}
+
+int main(void)
+{
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_ack_tracker_t *tracker;
+  amqp_frame_t frame;
+  amqp_bytes_t header;
+  struct timeval max_age;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  header.bytes = "AMQP\0\0\x09\x01";
+  header.len = 8;
+  if (amqp_handle_input(conn, header, &frame) != 8) {
+    fail("reading the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+
+  /* max_unacked 8 holds up to 4 completions past a gap */
+  tracker = amqp_ack_tracker_new(1, 8);
+  if (!tracker) {
+    fail("creating the tracker");
+  }
+
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_nothing();
+
+  complete(tracker, 2);
+  complete(tracker, 3);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_nothing();
+
+  complete(tracker, 1);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(3, 1);
+  expect_nothing();
+
+  /* Three held past 4, then a fourth one is too many */
+  complete(tracker, 5);
+  complete(tracker, 6);
+  complete(tracker, 8);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_nothing();
+  complete(tracker, 7);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(5, 0);
+  expect_ack(6, 0);
+  expect_ack(7, 0);
+  expect_ack(8, 0);
+  expect_nothing();
+
+  /* Only 4 is left to ack once the gap closes */
+  complete(tracker, 4);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(4, 1);
+  expect_nothing();
+
+  if (amqp_ack_tracker_set_gap_limits(tracker, -1, NULL)
+      != AMQP_STATUS_INVALID_PARAMETER) {
+    fail("Expected a negative max_held to be refused");
+  }
+
+  check("setting limits", amqp_ack_tracker_set_gap_limits(tracker, 0, NULL));
+  complete(tracker, 10);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(10, 0);
+  expect_nothing();
+
+  max_age.tv_sec = 0;
+  max_age.tv_usec = 20000;
+  check("setting limits",
+        amqp_ack_tracker_set_gap_limits(tracker, 100, &max_age));
+  complete(tracker, 11);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_nothing();
+  usleep(40000);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(11, 0);
+  expect_nothing();
+
+  complete(tracker, 9);
+  check("flushing", amqp_ack_tracker_flush(conn, tracker));
+  expect_ack(9, 1);
+  expect_nothing();
+
+  amqp_ack_tracker_free(tracker);
+  amqp_destroy_connection(conn);
+  close(peer);
+  return 0;
+}
@@ -0,0 +1,277 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Settles deliveries with amqp_basic_settle() on a channel with ack
+ * coalescing turned on. Over a packet socket pair, each write shows up as
+ * one packet, so the held ack and all the settle frames have to arrive
+ * together. When the write fails, whether straight away or after part of
+ * it went out, nothing may be taken as settled: the held ack has to still
+ * be held and go out with the next flush, on a new socket.
+ */
+
+#define FRAME_SIZE 21
+#define BULK_COUNT 500
+#define SHORT_COUNT 3000
+
+static int peer;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+/* Checks a basic.ack (method 80), basic.nack (method 120) or basic.reject
+ * (method 90) frame on channel 1 and its bits: multiple, requeue or both */
+static void check_settle(const unsigned char *frame, int method,
+                         uint64_t tag, int bits)
+{
+  uint64_t got = 0;
+  int i;
+
+  if (AMQP_FRAME_METHOD != frame[0] || 1 != frame[2] || 13 != frame[6]
+      || 0 != frame[7] || 60 != frame[8] || 0 != frame[9]
+      || method != frame[10] || AMQP_FRAME_END != frame[20]) {
+    fprintf(stderr, "Expected method %d on channel 1\n", method);
+    abort();
+  }
+  for (i = 0; i < 8; ++i) {
+    got = (got << 8) | frame[11 + i];
+  }
+  if (got != tag || frame[19] != bits) {
+    fprintf(stderr, "Expected %d bits %d, got %d bits %d\n",
+            (int)tag, bits, (int)got, frame[19]);
+    abort();
+  }
+}
+
+/* Reads one packet, which has to hold count frames */
+static unsigned char *read_packet(int count)
+{
+  static unsigned char packet[FRAME_SIZE * (BULK_COUNT + 1)];
+  ssize_t res;
+
+  res = recv(peer, packet, sizeof(packet), MSG_DONTWAIT);
+  if (res != FRAME_SIZE * count) {
+    fprintf(stderr, "Expected %d frames in one write, got %d bytes\n",
+            count, (int)res);
+    abort();
+  }
+  return packet;
+}
+
+static void expect_nothing(void)
+{
+  char c;
+
+  if (recv(peer, &c, 1, MSG_DONTWAIT) > 0) {
+    fail("Expected nothing to be written");
+  }
+}
+
+/* Moves the connection over to a new socket pair */
+static void new_socket(amqp_socket_t *socket, int type)
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, type, 0, sv)) {
+    fail("socketpair");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  peer = sv[1];
+}
+
+static void ack(amqp_connection_state_t conn, uint64_t tag)
+{
+  check("acking", amqp_basic_ack(conn, 1, tag, 0));
+}
+
+/* Flushes on a new socket, which has to get just the held ack */
+static void expect_held(amqp_connection_state_t conn, amqp_socket_t *socket,
+                        int fd, uint64_t tag)
+{
+  close(fd);
+  new_socket(socket, SOCK_SEQPACKET);
+  expect_nothing();
+  check("flushing", amqp_flush(conn));
+  check_settle(read_packet(1), 80, tag, 1);
+  expect_nothing();
+}
+
+int main(void)
+{
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  amqp_bytes_t header;
+  amqp_settle_t settles[SHORT_COUNT];
+  unsigned char *packet;
+  int sndbuf = 4096;
+  int status;
+  int fd;
+  int i;
+  pid_t pid;
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  new_socket(socket, SOCK_SEQPACKET);
+  amqp_set_socket(conn, socket);
+  header.bytes = "AMQP\0\0\x09\x01";
+  header.len = 8;
+  if (amqp_handle_input(conn, header, &frame) != 8) {
+    fail("reading the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+  check("coalescing", amqp_set_ack_coalescing(conn, 1, 100, NULL));
+
+  /* The held ack goes out in front, in the same write */
+  ack(conn, 1);
+  ack(conn, 2);
+  expect_nothing();
+  memset(settles, 0, sizeof(settles));
+  settles[0].delivery_tag = 3;
+  settles[0].action = AMQP_SETTLE_ACK;
+  settles[1].delivery_tag = 5;
+  settles[1].action = AMQP_SETTLE_NACK;
+  settles[1].multiple = 1;
+  settles[1].requeue = 1;
+  settles[2].delivery_tag = 6;
+  settles[2].action = AMQP_SETTLE_REJECT;
+  settles[2].requeue = 1;
+  check("settling", amqp_basic_settle(conn, 1, settles, 3));
+  packet = read_packet(4);
+  check_settle(packet, 80, 2, 1);
+  check_settle(packet + FRAME_SIZE, 80, 3, 0);
+  check_settle(packet + 2 * FRAME_SIZE, 120, 5, 3);
+  check_settle(packet + 3 * FRAME_SIZE, 90, 6, 1);
+  expect_nothing();
+
+  /* More than a frame_max worth is still one write */
+  memset(settles, 0, sizeof(settles));
+  for (i = 0; i < BULK_COUNT; ++i) {
+    settles[i].delivery_tag = 7 + i;
+    settles[i].action = AMQP_SETTLE_ACK;
+  }
+  check("settling", amqp_basic_settle(conn, 1, settles, BULK_COUNT));
+  packet = read_packet(BULK_COUNT);
+  for (i = 0; i < BULK_COUNT; ++i) {
+    check_settle(packet + i * FRAME_SIZE, 80, 7 + i, 0);
+  }
+  expect_nothing();
+
+  /* A write that fails keeps the held ack held */
+  ack(conn, 507);
+  close(peer);
+  fd = amqp_get_sockfd(conn);
+  settles[0].delivery_tag = 508;
+  if (amqp_basic_settle(conn, 1, settles, 1) >= 0) {
+    fail("Expected settling to fail with the other end closed");
+  }
+  expect_held(conn, socket, fd, 507);
+  ack(conn, 508);
+  check("flushing", amqp_flush(conn));
+  check_settle(read_packet(1), 80, 508, 1);
+
+  /* So does a write that only part of went out */
+  ack(conn, 509);
+  close(peer);
+  close(amqp_get_sockfd(conn));
+  new_socket(socket, SOCK_STREAM);
+  fd = amqp_get_sockfd(conn);
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) {
+    fail("setting the send buffer size");
+  }
+  pid = fork();
+  if (pid < 0) {
+    fail("fork");
+  }
+  if (0 == pid) {
+    unsigned char part[FRAME_SIZE * 8];
+    size_t len = 0;
+
+    close(fd);
+    while (len < sizeof(part)) {
+      ssize_t res = recv(peer, part + len, sizeof(part) - len, 0);
+      if (res <= 0) {
+        _exit(1);
+      }
+      len += res;
+    }
+    _exit(0);
+  }
+  close(peer);
+  for (i = 0; i < SHORT_COUNT; ++i) {
+    settles[i].delivery_tag = 510 + i;
+    settles[i].action = AMQP_SETTLE_ACK;
+  }
+  if (amqp_basic_settle(conn, 1, settles, SHORT_COUNT) >= 0) {
+    fail("Expected settling to fail with the other end closed");
+  }
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0) {
+    fail("Expected the first frames to be written");
+  }
+  expect_held(conn, socket, fd, 509);
+
+  amqp_destroy_connection(conn);
+  close(peer);
+  return 0;
+}
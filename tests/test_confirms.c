@@ -0,0 +1,328 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Publishes on two channels in confirm mode over a socket pair and feeds
+ * back acks and nacks, single and multiple, checking the outcomes reported
+ * by amqp_confirm_poll() and by a callback. A basic.return read while
+ * waiting for confirms has to be handed back to the caller, and closing a
+ * channel, from either end, has to report what is still in flight on it
+ * as nacked.
+ */
+
+#define MAX_CALLBACKS 8
+
+static int peer;
+static amqp_confirm_t callbacks[MAX_CALLBACKS];
+static int callback_count;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+static void send_method(amqp_channel_t channel, amqp_method_number_t id,
+                        void *decoded)
+{
+  unsigned char frame[4096];
+  amqp_bytes_t encoded;
+  int len;
+
+  frame[0] = AMQP_FRAME_METHOD;
+  frame[1] = (unsigned char)(channel >> 8);
+  frame[2] = (unsigned char)channel;
+  frame[7] = (unsigned char)(id >> 24);
+  frame[8] = (unsigned char)(id >> 16);
+  frame[9] = (unsigned char)(id >> 8);
+  frame[10] = (unsigned char)id;
+  encoded.bytes = frame + 11;
+  encoded.len = sizeof(frame) - 12;
+  len = amqp_encode_method(id, decoded, encoded);
+  if (len < 0) {
+    fail("encoding a method");
+  }
+  len += 4;
+  frame[3] = 0;
+  frame[4] = 0;
+  frame[5] = (unsigned char)(len >> 8);
+  frame[6] = (unsigned char)len;
+  frame[7 + len] = AMQP_FRAME_END;
+  if (send(peer, frame, len + 8, 0) != len + 8) {
+    fail("sending a method");
+  }
+}
+
+static void send_ack(amqp_channel_t channel, uint64_t tag, int multiple)
+{
+  amqp_basic_ack_t ack;
+
+  ack.delivery_tag = tag;
+  ack.multiple = multiple;
+  send_method(channel, AMQP_BASIC_ACK_METHOD, &ack);
+}
+
+static void send_nack(amqp_channel_t channel, uint64_t tag, int multiple)
+{
+  amqp_basic_nack_t nack;
+
+  nack.delivery_tag = tag;
+  nack.multiple = multiple;
+  nack.requeue = 0;
+  send_method(channel, AMQP_BASIC_NACK_METHOD, &nack);
+}
+
+/* Throws away what the client wrote */
+static void drain(void)
+{
+  char buf[4096];
+
+  while (recv(peer, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+  }
+}
+
+static void publish(amqp_connection_state_t conn, amqp_channel_t channel,
+                    int count)
+{
+  while (count-- > 0) {
+    check("publishing",
+          amqp_basic_publish(conn, channel, amqp_cstring_bytes("amq.direct"),
+                             amqp_cstring_bytes("test"), 0, 0, NULL,
+                             amqp_cstring_bytes("hello")));
+  }
+  drain();
+}
+
+static void match(const amqp_confirm_t *got, amqp_channel_t channel,
+                  uint64_t first_seq, uint64_t last_seq, int nacked)
+{
+  if (got->channel != channel || got->first_seq != first_seq
+      || got->last_seq != last_seq || !got->nacked != !nacked) {
+    fprintf(stderr, "Expected %s of %d-%d on channel %d, got %s of %d-%d "
+            "on channel %d\n", nacked ? "nack" : "ack", (int)first_seq,
+            (int)last_seq, channel, got->nacked ? "nack" : "ack",
+            (int)got->first_seq, (int)got->last_seq, got->channel);
+    abort();
+  }
+}
+
+static void expect_poll(amqp_connection_state_t conn, uint64_t first_seq,
+                        uint64_t last_seq, int nacked)
+{
+  amqp_confirm_t confirm;
+
+  if (amqp_confirm_poll(conn, &confirm, 1, NULL) != 1) {
+    fail("Expected an outcome");
+  }
+  match(&confirm, 1, first_seq, last_seq, nacked);
+}
+
+static void expect_in_flight(amqp_connection_state_t conn,
+                             amqp_channel_t channel, int count)
+{
+  if (amqp_confirm_in_flight(conn, channel) != count) {
+    fprintf(stderr, "Expected %d in flight on channel %d, got %d\n", count,
+            channel, amqp_confirm_in_flight(conn, channel));
+    abort();
+  }
+}
+
+static void expect_method(amqp_connection_state_t conn, amqp_channel_t channel,
+                          amqp_method_number_t id)
+{
+  amqp_frame_t frame;
+
+  check("reading a frame", amqp_simple_wait_frame(conn, &frame));
+  if (AMQP_FRAME_METHOD != frame.frame_type || channel != frame.channel
+      || id != frame.payload.method.id) {
+    fprintf(stderr, "Expected method %08x on channel %d\n", id, channel);
+    abort();
+  }
+}
+
+static void AMQP_CALL on_confirm(void *user_data,
+                                 const amqp_confirm_t *confirm)
+{
+  if (user_data != &callback_count || callback_count == MAX_CALLBACKS) {
+    fail("Unexpected callback");
+  }
+  callbacks[callback_count++] = *confirm;
+}
+
+static void enable(amqp_connection_state_t conn, amqp_channel_t channel,
+                   amqp_confirm_callback_t callback)
+{
+  amqp_confirm_select_ok_t select_ok;
+  amqp_rpc_reply_t reply;
+
+  send_method(channel, AMQP_CONFIRM_SELECT_OK_METHOD, &select_ok);
+  reply = amqp_confirm_enable(conn, channel, 0, callback, &callback_count);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type) {
+    fail("enabling confirms");
+  }
+  drain();
+}
+
+int main(void)
+{
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  amqp_bytes_t header;
+  amqp_confirm_t confirms[4];
+  amqp_basic_return_t ret;
+  amqp_channel_close_t channel_close;
+  amqp_channel_close_ok_t close_ok;
+  struct timeval poll;
+  amqp_rpc_reply_t reply;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  header.bytes = "AMQP\0\0\x09\x01";
+  header.len = 8;
+  if (amqp_handle_input(conn, header, &frame) != 8) {
+    fail("reading the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+
+  enable(conn, 1, NULL);
+  publish(conn, 1, 10);
+  expect_in_flight(conn, 1, 10);
+  if (amqp_confirm_next_seq(conn, 1) != 11) {
+    fail("Expected sequence number 11 next");
+  }
+
+  send_ack(1, 3, 1);
+  expect_poll(conn, 1, 3, 0);
+  send_nack(1, 5, 1);
+  expect_poll(conn, 4, 5, 1);
+  send_ack(1, 7, 0);
+  expect_poll(conn, 7, 7, 0);
+  send_nack(1, 6, 0);
+  expect_poll(conn, 6, 6, 1);
+  /* 7 is settled already */
+  send_ack(1, 7, 1);
+  expect_in_flight(conn, 1, 3);
+
+  /* A basic.return is the caller's to read */
+  memset(&ret, 0, sizeof(ret));
+  ret.reply_code = AMQP_NO_ROUTE;
+  ret.reply_text = amqp_cstring_bytes("NO_ROUTE");
+  ret.exchange = amqp_cstring_bytes("amq.direct");
+  ret.routing_key = amqp_cstring_bytes("test");
+  send_method(1, AMQP_BASIC_RETURN_METHOD, &ret);
+  if (amqp_confirm_wait(conn, 1, NULL) != AMQP_STATUS_UNEXPECTED_STATE) {
+    fail("Expected the basic.return to be handed back");
+  }
+  expect_method(conn, 1, AMQP_BASIC_RETURN_METHOD);
+
+  /* The broker closing the channel nacks what is left */
+  send_ack(1, 9, 1);
+  memset(&channel_close, 0, sizeof(channel_close));
+  channel_close.reply_code = AMQP_PRECONDITION_FAILED;
+  channel_close.reply_text = amqp_cstring_bytes("closed");
+  send_method(1, AMQP_CHANNEL_CLOSE_METHOD, &channel_close);
+  if (amqp_confirm_wait(conn, 1, NULL) != AMQP_STATUS_UNEXPECTED_STATE) {
+    fail("Expected the channel.close to be handed back");
+  }
+  expect_method(conn, 1, AMQP_CHANNEL_CLOSE_METHOD);
+  poll.tv_sec = 0;
+  poll.tv_usec = 0;
+  if (amqp_confirm_poll(conn, confirms, 4, &poll) != 2) {
+    fail("Expected two outcomes");
+  }
+  match(&confirms[0], 1, 8, 9, 0);
+  match(&confirms[1], 1, 10, 10, 1);
+  expect_in_flight(conn, 1, 0);
+  if (amqp_confirm_next_seq(conn, 1) != 0) {
+    fail("Expected channel 1 to have left confirm mode");
+  }
+
+  /* Closing a channel from this end nacks what is left, through the
+   * callback */
+  enable(conn, 2, on_confirm);
+  publish(conn, 2, 3);
+  send_ack(2, 2, 0);
+  send_method(2, AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok);
+  reply = amqp_channel_close(conn, 2, AMQP_REPLY_SUCCESS);
+  if (AMQP_RESPONSE_NORMAL != reply.reply_type) {
+    fail("closing channel 2");
+  }
+  if (3 != callback_count) {
+    fail("Expected three callbacks");
+  }
+  match(&callbacks[0], 2, 2, 2, 0);
+  match(&callbacks[1], 2, 1, 1, 1);
+  match(&callbacks[2], 2, 3, 3, 1);
+  expect_in_flight(conn, 2, 0);
+
+  amqp_destroy_connection(conn);
+  close(peer);
+  return 0;
+}
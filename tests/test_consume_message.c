@@ -0,0 +1,293 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Feeds deliveries through a socket pair, in small writes, to
+ * amqp_consume_message(). The bodies are large enough to be received
+ * straight into the message, and other frames arrive between a delivery's
+ * frames: a heartbeat, a method on another channel and a basic.ack on the
+ * delivery's own channel. They have to come out of amqp_simple_wait_frame()
+ * afterwards, in order, with the message read in full. A channel.close in the middle of
+ * a delivery has to end it with AMQP_STATUS_UNEXPECTED_STATE and be left
+ * queued. Runs with and without decoding in place.
+ */
+
+#define FRAME_MAX 131072
+#define BODY_SIZE 300000
+#define SMALL_BODY_SIZE 100
+
+static unsigned char *out;
+static size_t out_len;
+static char body[BODY_SIZE];
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void put_frame(int type, amqp_channel_t channel, const void *payload,
+                      size_t len)
+{
+  unsigned char *p = out + out_len;
+
+  p[0] = (unsigned char)type;
+  p[1] = (unsigned char)(channel >> 8);
+  p[2] = (unsigned char)channel;
+  p[3] = (unsigned char)(len >> 24);
+  p[4] = (unsigned char)(len >> 16);
+  p[5] = (unsigned char)(len >> 8);
+  p[6] = (unsigned char)len;
+  memcpy(p + 7, payload, len);
+  p[7 + len] = AMQP_FRAME_END;
+  out_len += len + 8;
+}
+
+static void put_method(amqp_channel_t channel, amqp_method_number_t id,
+                       void *decoded)
+{
+  unsigned char payload[4096];
+  amqp_bytes_t encoded;
+  int res;
+
+  payload[0] = (unsigned char)(id >> 24);
+  payload[1] = (unsigned char)(id >> 16);
+  payload[2] = (unsigned char)(id >> 8);
+  payload[3] = (unsigned char)id;
+  encoded.bytes = payload + 4;
+  encoded.len = sizeof(payload) - 4;
+  res = amqp_encode_method(id, decoded, encoded);
+  if (res < 0) {
+    fail("encoding a method");
+  }
+  put_frame(AMQP_FRAME_METHOD, channel, payload, res + 4);
+}
+
+static void put_deliver(uint64_t delivery_tag)
+{
+  amqp_basic_deliver_t deliver;
+
+  memset(&deliver, 0, sizeof(deliver));
+  deliver.consumer_tag = amqp_cstring_bytes("ctag");
+  deliver.delivery_tag = delivery_tag;
+  deliver.exchange = amqp_cstring_bytes("ex");
+  deliver.routing_key = amqp_cstring_bytes("rk");
+  put_method(1, AMQP_BASIC_DELIVER_METHOD, &deliver);
+}
+
+static void put_header(uint64_t body_size)
+{
+  unsigned char payload[4096];
+  amqp_basic_properties_t properties;
+  amqp_bytes_t encoded;
+  int res;
+  int i;
+
+  memset(&properties, 0, sizeof(properties));
+  properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG;
+  properties.content_type = amqp_cstring_bytes("text/plain");
+
+  payload[0] = 0;
+  payload[1] = AMQP_BASIC_CLASS;
+  payload[2] = 0;
+  payload[3] = 0;
+  for (i = 0; i < 8; ++i) {
+    payload[4 + i] = (unsigned char)(body_size >> (56 - 8 * i));
+  }
+  encoded.bytes = payload + 12;
+  encoded.len = sizeof(payload) - 12;
+  res = amqp_encode_properties(AMQP_BASIC_CLASS, &properties, encoded);
+  if (res < 0) {
+    fail("encoding properties");
+  }
+  put_frame(AMQP_FRAME_HEADER, 1, payload, res + 12);
+}
+
+static void build_stream(void)
+{
+  amqp_basic_ack_t ack;
+  amqp_channel_close_t close;
+  amqp_channel_flow_t flow;
+  size_t i;
+
+  out = malloc(2 * BODY_SIZE);
+  if (!out) {
+    fail("allocating the stream");
+  }
+  memcpy(out, "AMQP\0\0\x09\x01", 8);
+  out_len = 8;
+
+  /* A large delivery with other frames between its frames */
+  put_deliver(1);
+  put_header(BODY_SIZE);
+  put_frame(AMQP_FRAME_HEARTBEAT, 0, "", 0);
+  for (i = 0; i < BODY_SIZE; i += FRAME_MAX - 8) {
+    size_t len = BODY_SIZE - i < FRAME_MAX - 8 ? BODY_SIZE - i : FRAME_MAX - 8;
+    put_frame(AMQP_FRAME_BODY, 1, body + i, len);
+    if (0 == i) {
+      flow.active = 1;
+      put_method(2, AMQP_CHANNEL_FLOW_METHOD, &flow);
+      ack.delivery_tag = 7;
+      ack.multiple = 1;
+      put_method(1, AMQP_BASIC_ACK_METHOD, &ack);
+    }
+  }
+
+  /* A small delivery whose channel is closed before its body arrives */
+  put_deliver(2);
+  put_header(SMALL_BODY_SIZE);
+  memset(&close, 0, sizeof(close));
+  close.reply_code = AMQP_CHANNEL_ERROR;
+  close.reply_text = amqp_cstring_bytes("closed");
+  put_method(1, AMQP_CHANNEL_CLOSE_METHOD, &close);
+}
+
+static void expect_method(amqp_connection_state_t conn, amqp_channel_t channel,
+                          amqp_method_number_t id)
+{
+  amqp_frame_t frame;
+
+  if (amqp_simple_wait_frame(conn, &frame)
+      || AMQP_FRAME_METHOD != frame.frame_type || channel != frame.channel
+      || id != frame.payload.method.id) {
+    fprintf(stderr, "Expected method %08x on channel %d\n", id, channel);
+    abort();
+  }
+}
+
+static void run(amqp_boolean_t decode_in_place)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *socket = amqp_tcp_socket_new();
+  amqp_envelope_t envelope;
+  amqp_frame_t frame;
+  int status;
+  pid_t child;
+  int sv[2];
+
+  if (!conn || !socket || socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("creating the connection");
+  }
+
+  child = fork();
+  if (child < 0) {
+    fail("fork failed");
+  }
+  if (0 == child) {
+    size_t offset = 0;
+
+    close(sv[0]);
+    while (offset < out_len) {
+      size_t len = out_len - offset < 1000 ? out_len - offset : 1000;
+      if (write(sv[1], out + offset, len) != (ssize_t)len) {
+        _exit(1);
+      }
+      offset += len;
+    }
+    _exit(0);
+  }
+  close(sv[1]);
+
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  amqp_set_decode_in_place(conn, decode_in_place);
+  if (amqp_simple_wait_frame(conn, &frame) || 'A' != frame.frame_type) {
+    fail("expected the protocol header");
+  }
+  if (amqp_tune_connection(conn, 0, FRAME_MAX, 0)) {
+    fail("tuning");
+  }
+
+  if (amqp_consume_message(conn, &envelope, NULL)) {
+    fail("consuming the large message");
+  }
+  if (1 != envelope.channel || 1 != envelope.delivery_tag
+      || BODY_SIZE != envelope.message.body.len
+      || memcmp(envelope.message.body.bytes, body, BODY_SIZE)
+      || envelope.message.properties.content_type.len != 10) {
+    fail("large message mismatch");
+  }
+  amqp_destroy_envelope(&envelope);
+
+  if (amqp_simple_wait_frame(conn, &frame)
+      || AMQP_FRAME_HEARTBEAT != frame.frame_type) {
+    fail("Expected the heartbeat");
+  }
+  expect_method(conn, 2, AMQP_CHANNEL_FLOW_METHOD);
+  expect_method(conn, 1, AMQP_BASIC_ACK_METHOD);
+
+  if (amqp_consume_message(conn, &envelope, NULL)
+      != AMQP_STATUS_UNEXPECTED_STATE) {
+    fail("expected the closed channel to end the delivery");
+  }
+  expect_method(conn, 1, AMQP_CHANNEL_CLOSE_METHOD);
+
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    fail("writer failed");
+  }
+  amqp_destroy_connection(conn);
+}
+
+int main(void)
+{
+  size_t i;
+
+  for (i = 0; i < BODY_SIZE; ++i) {
+    body[i] = (char)(i * 7 + i / 251);
+  }
+  build_stream();
+
+  run(0);
+  run(1);
+
+  free(out);
+  return 0;
+}
@@ -0,0 +1,258 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Reads body frames decoded in place from the socket read buffer and keeps
+ * them while that buffer is replaced: when a frame straddles the end of a
+ * read, when a full read makes the buffer grow, and when the connection
+ * goes quiet and the buffer shrinks. Every frame held has to keep its
+ * contents until its channel's buffers are released, and the buffers it
+ * keeps count as resident until then.
+ */
+
+#define MIN_BUFFER 4096
+#define MAX_BUFFER 65536
+#define FRAMES 8
+
+static int peer;
+static amqp_connection_state_t conn;
+static amqp_frame_t frames[FRAMES];
+static size_t frame_sizes[FRAMES];
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static unsigned char pattern(int n, size_t i)
+{
+  return (unsigned char)(n * 31 + i * 7 + i / 251);
+}
+
+/* Writes body frames first to last on channel, frame n carrying size
+ * bytes of pattern n, all in one write */
+static void send_frames(amqp_channel_t channel, int first, int last,
+                        size_t size)
+{
+  size_t frame_len = size + 8;
+  unsigned char *buf = malloc(frame_len * (last - first + 1));
+  unsigned char *p = buf;
+  int n;
+  size_t i;
+
+  if (!buf) {
+    fail("allocating frames");
+  }
+  for (n = first; n <= last; ++n) {
+    p[0] = AMQP_FRAME_BODY;
+    p[1] = (unsigned char)(channel >> 8);
+    p[2] = (unsigned char)channel;
+    p[3] = (unsigned char)(size >> 24);
+    p[4] = (unsigned char)(size >> 16);
+    p[5] = (unsigned char)(size >> 8);
+    p[6] = (unsigned char)size;
+    for (i = 0; i < size; ++i) {
+      p[7 + i] = pattern(n, i);
+    }
+    p[7 + size] = AMQP_FRAME_END;
+    frame_sizes[n] = size;
+    p += frame_len;
+  }
+  if (send(peer, buf, p - buf, 0) != p - buf) {
+    fail("sending frames");
+  }
+  free(buf);
+}
+
+static void read_frames(amqp_channel_t channel, int first, int last)
+{
+  int n;
+
+  for (n = first; n <= last; ++n) {
+    if (amqp_simple_wait_frame(conn, &frames[n])) {
+      fail("reading a frame");
+    }
+    if (AMQP_FRAME_BODY != frames[n].frame_type
+        || channel != frames[n].channel
+        || frame_sizes[n] != frames[n].payload.body_fragment.len) {
+      fail("Unexpected frame");
+    }
+  }
+}
+
+/* Frames decoded in place lie next to each other in the read buffer */
+static void expect_adjacent(int n)
+{
+  if ((char *)frames[n].payload.body_fragment.bytes
+      != (char *)frames[n - 1].payload.body_fragment.bytes
+      + frames[n - 1].payload.body_fragment.len + 8) {
+    fprintf(stderr, "Expected frame %d to be decoded in place\n", n);
+    abort();
+  }
+}
+
+static void check_frames(int first, int last)
+{
+  int n;
+  size_t i;
+
+  for (n = first; n <= last; ++n) {
+    const unsigned char *body = frames[n].payload.body_fragment.bytes;
+    for (i = 0; i < frame_sizes[n]; ++i) {
+      if (body[i] != pattern(n, i)) {
+        fprintf(stderr, "Frame %d changed at byte %d\n", n, (int)i);
+        abort();
+      }
+    }
+  }
+}
+
+static void expect_buffer_size(size_t size)
+{
+  if (amqp_get_sock_inbound_buffer_size(conn) != size) {
+    fprintf(stderr, "Expected a read buffer of %d bytes, got %d\n",
+            (int)size, (int)amqp_get_sock_inbound_buffer_size(conn));
+    abort();
+  }
+}
+
+static void expect_resident(uint64_t bytes)
+{
+  if (amqp_get_sock_inbound_resident_bytes() != bytes) {
+    fprintf(stderr, "Expected %d bytes of read buffers, got %d\n",
+            (int)bytes, (int)amqp_get_sock_inbound_resident_bytes());
+    abort();
+  }
+}
+
+int main(void)
+{
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  struct timeval poll;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  amqp_set_decode_in_place(conn, 1);
+  if (amqp_set_sock_inbound_buffer_policy(conn, MIN_BUFFER, MAX_BUFFER)) {
+    fail("setting the read buffer policy");
+  }
+
+  if (send(peer, "AMQP\0\0\x09\x01", 8, 0) != 8) {
+    fail("sending the protocol header");
+  }
+  if (amqp_simple_wait_frame(conn, &frame) || 'A' != frame.frame_type) {
+    fail("expected the protocol header");
+  }
+  if (amqp_tune_connection(conn, 0, 131072, 0)) {
+    fail("tuning");
+  }
+
+  /* Whole frames in one read */
+  send_frames(1, 0, 2, 100);
+  read_frames(1, 0, 2);
+  expect_adjacent(1);
+  expect_adjacent(2);
+  expect_buffer_size(MIN_BUFFER);
+  expect_resident(MIN_BUFFER);
+
+  /* Three 1508 byte frames don't fit in one read: the third straddles its
+   * end and is copied, and the full read makes the next buffer bigger.
+   * The first buffer is replaced while frames 0 to 2 point into it. */
+  send_frames(1, 3, 5, 1500);
+  read_frames(1, 3, 5);
+  expect_adjacent(4);
+  expect_buffer_size(2 * MIN_BUFFER);
+  check_frames(0, 5);
+  /* The first buffer, the one frames 3 and 4 were read into and the
+   * current one */
+  expect_resident(4 * MIN_BUFFER);
+
+  /* Frames held on another channel while the quiet connection drops its
+   * buffer back to the minimum */
+  send_frames(2, 6, 7, 200);
+  read_frames(2, 6, 7);
+  expect_adjacent(7);
+  amqp_maybe_release_buffers_on_channel(conn, 1);
+  poll.tv_sec = 0;
+  poll.tv_usec = 0;
+  if (amqp_simple_wait_frame_noblock(conn, &frame, &poll)
+      != AMQP_STATUS_TIMEOUT) {
+    fail("expected the poll to time out");
+  }
+  expect_buffer_size(MIN_BUFFER);
+  check_frames(6, 7);
+  expect_resident(3 * MIN_BUFFER);
+
+  /* Carry on into the new buffer */
+  amqp_maybe_release_buffers_on_channel(conn, 2);
+  send_frames(3, 0, 1, 100);
+  read_frames(3, 0, 1);
+  expect_adjacent(1);
+  check_frames(0, 1);
+  expect_resident(MIN_BUFFER);
+
+  amqp_destroy_connection(conn);
+  expect_resident(0);
+  close(peer);
+  return 0;
+}
@@ -0,0 +1,242 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <amqp.h>
+
+/*
+ * Allocates large blocks, bigger than the page size, from a pool through
+ * an allocator that counts what is live. Blocks recycled into the cache
+ * have to be handed out again for any amount in their size class without
+ * allocating, the cache has to stay within its byte limit, and trimming it
+ * or emptying the pool has to free everything.
+ *
+ * Built with AMQP_POOL_POISON, as the library then is, everything handed
+ * out has to be filled with the poison pattern, reused memory included.
+ */
+
+static long live_blocks;
+static long mallocs;
+
+static void *AMQP_CALL count_malloc(void *user_data, size_t size)
+{
+  void *block = malloc(size);
+  (void)user_data;
+  if (block != NULL) {
+    live_blocks++;
+    mallocs++;
+  }
+  return block;
+}
+
+static void *AMQP_CALL count_calloc(void *user_data, size_t nmemb,
+                                    size_t size)
+{
+  void *block = calloc(nmemb, size);
+  (void)user_data;
+  if (block != NULL) {
+    live_blocks++;
+  }
+  return block;
+}
+
+static void *AMQP_CALL count_realloc(void *user_data, void *ptr,
+                                     size_t size)
+{
+  void *block = realloc(ptr, size);
+  (void)user_data;
+  if (block != NULL && ptr == NULL) {
+    live_blocks++;
+  }
+  return block;
+}
+
+static void AMQP_CALL count_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  if (ptr != NULL) {
+    live_blocks--;
+  }
+  free(ptr);
+}
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void expect_cache(amqp_pool_t *pool, int blocks, size_t bytes)
+{
+  if (pool->large_cache.num_blocks != blocks
+      || pool->large_cache_bytes != bytes) {
+    fprintf(stderr, "Expected %d blocks of %d bytes cached, got %d of %d\n",
+            blocks, (int)bytes, pool->large_cache.num_blocks,
+            (int)pool->large_cache_bytes);
+    abort();
+  }
+}
+
+static void *alloc(amqp_pool_t *pool, size_t amount)
+{
+  void *block = amqp_pool_alloc(pool, amount);
+
+  if (block == NULL) {
+    fail("allocating from the pool");
+  }
+  memset(block, 0, amount);
+  return block;
+}
+
+#ifdef AMQP_POOL_POISON
+static void expect_poison(const unsigned char *block, size_t amount)
+{
+  size_t i;
+
+  for (i = 0; i < amount; ++i) {
+    if (block[i] != 0xA5) {
+      fprintf(stderr, "Byte %d of %d is not poisoned\n", (int)i,
+              (int)amount);
+      abort();
+    }
+  }
+}
+
+/* Dirties pages and large blocks, then checks they come back poisoned */
+static void check_poison(void)
+{
+  static const size_t amounts[] = { 8, 100, 2000, 4096, 5000, 8192, 20000 };
+  const size_t count = sizeof(amounts) / sizeof(amounts[0]);
+  amqp_pool_t pool;
+  size_t i;
+  int round;
+
+  init_amqp_pool(&pool, 4096);
+  for (round = 0; round < 2; ++round) {
+    for (i = 0; i < count; ++i) {
+      unsigned char *block = amqp_pool_alloc(&pool, amounts[i]);
+
+      if (block == NULL) {
+        fail("allocating from the pool");
+      }
+      expect_poison(block, amounts[i]);
+      memset(block, 0, amounts[i]);
+    }
+    recycle_amqp_pool(&pool);
+  }
+  empty_amqp_pool(&pool);
+}
+#endif
+
+int main(void)
+{
+  amqp_allocator_t allocator = {
+    count_malloc, count_calloc, count_realloc, count_free, NULL
+  };
+  amqp_pool_t pool;
+  void *block;
+  long before;
+
+  if (amqp_set_allocator(&allocator) != AMQP_STATUS_OK) {
+    fail("setting the allocator");
+  }
+  init_amqp_pool(&pool, 4096);
+
+  /* Anything up to 8192 bytes is in the same class and reuses the block */
+  block = alloc(&pool, 5000);
+  recycle_amqp_pool(&pool);
+  expect_cache(&pool, 1, 8192);
+  before = mallocs;
+  if (alloc(&pool, 8192) != block) {
+    fail("Expected the cached block to be reused");
+  }
+  expect_cache(&pool, 0, 0);
+  recycle_amqp_pool(&pool);
+  if (alloc(&pool, 4100) != block || mallocs != before) {
+    fail("Expected the cached block to be reused without allocating");
+  }
+
+  /* The next class up doesn't take it */
+  if (alloc(&pool, 8200) == block || mallocs != before + 1) {
+    fail("Expected a block of the next size class to be allocated");
+  }
+  recycle_amqp_pool(&pool);
+  expect_cache(&pool, 2, 8192 + 16384);
+
+  /* The cache keeps no more than its limit, recycled or lowered to */
+  amqp_pool_set_large_cache(&pool, 0);
+  expect_cache(&pool, 0, 0);
+  amqp_pool_set_large_cache(&pool, 16384);
+  alloc(&pool, 5000);
+  alloc(&pool, 5000);
+  alloc(&pool, 5000);
+  before = live_blocks;
+  recycle_amqp_pool(&pool);
+  expect_cache(&pool, 2, 16384);
+  if (live_blocks != before - 1) {
+    fail("Expected the block over the limit to be freed");
+  }
+  amqp_pool_set_large_cache(&pool, 8192);
+  expect_cache(&pool, 1, 8192);
+  if (live_blocks != before - 2) {
+    fail("Expected lowering the limit to free a block");
+  }
+
+  /* Blocks over the limit are neither rounded up nor cached */
+  alloc(&pool, 20000);
+  recycle_amqp_pool(&pool);
+  expect_cache(&pool, 1, 8192);
+  if (live_blocks != before - 2) {
+    fail("Expected the block over the limit to be freed");
+  }
+
+  amqp_pool_trim(&pool);
+  expect_cache(&pool, 0, 0);
+  empty_amqp_pool(&pool);
+#ifdef AMQP_POOL_POISON
+  check_poison();
+#endif
+  if (live_blocks != 0) {
+    fprintf(stderr, "%ld blocks left after emptying the pool\n",
+            live_blocks);
+    abort();
+  }
+  return 0;
+}
@@ -0,0 +1,202 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Publishes in batching mode with a max_latency and checks that a batch
+ * stays buffered until its latency is up, and is then written out by
+ * amqp_flush_expired() and by reading frames, without another publish.
+ */
+
+static int peer;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+static void publish(amqp_connection_state_t conn)
+{
+  check("publishing",
+        amqp_basic_publish(conn, 1, amqp_cstring_bytes("amq.direct"),
+                           amqp_cstring_bytes("test"), 0, 0, NULL,
+                           amqp_cstring_bytes("hello")));
+}
+
+/* Reads the method, header and body frames of a message */
+static void expect_message(void)
+{
+  unsigned char buf[4096];
+  size_t len = 0;
+  size_t offset = 0;
+  int frames = 0;
+
+  while (frames < 3) {
+    ssize_t res;
+    size_t size;
+
+    if (len - offset >= 7) {
+      size = ((size_t)buf[offset + 3] << 24) | ((size_t)buf[offset + 4] << 16)
+             | ((size_t)buf[offset + 5] << 8) | buf[offset + 6];
+      if (len - offset >= size + 8) {
+        if (buf[offset] != (0 == frames ? AMQP_FRAME_METHOD
+                            : 1 == frames ? AMQP_FRAME_HEADER
+                            : AMQP_FRAME_BODY)) {
+          fail("Unexpected frame type");
+        }
+        offset += size + 8;
+        frames++;
+        continue;
+      }
+    }
+
+    res = recv(peer, buf + len, sizeof(buf) - len, MSG_DONTWAIT);
+    if (res <= 0) {
+      fail("Expected a message to be written");
+    }
+    len += res;
+  }
+
+  if (offset != len) {
+    fail("Expected only one message");
+  }
+}
+
+static void expect_nothing(void)
+{
+  char c;
+
+  if (recv(peer, &c, 1, MSG_DONTWAIT) > 0) {
+    fail("Expected nothing to be written");
+  }
+}
+
+int main(void)
+{
+  static const char heartbeat[] = { AMQP_FRAME_HEARTBEAT, 0, 0, 0, 0, 0, 0,
+                                    (char)AMQP_FRAME_END
+                                  };
+  amqp_connection_state_t conn;
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  amqp_bytes_t header;
+  struct timeval max_latency;
+  struct timeval poll;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  header.bytes = "AMQP\0\0\x09\x01";
+  header.len = 8;
+  if (amqp_handle_input(conn, header, &frame) != 8) {
+    fail("reading the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+
+  max_latency.tv_sec = 0;
+  max_latency.tv_usec = 20000;
+  check("batching",
+        amqp_set_publish_batching(conn, 65536, 0, &max_latency));
+
+  /* Nothing is due with nothing buffered */
+  check("flushing expired", amqp_flush_expired(conn));
+  expect_nothing();
+
+  publish(conn);
+  check("flushing expired", amqp_flush_expired(conn));
+  expect_nothing();
+  usleep(40000);
+  check("flushing expired", amqp_flush_expired(conn));
+  expect_message();
+  check("flushing expired", amqp_flush_expired(conn));
+  expect_nothing();
+
+  /* Polling for frames writes out a batch that is due, and only then */
+  poll.tv_sec = 0;
+  poll.tv_usec = 0;
+  publish(conn);
+  if (send(peer, heartbeat, sizeof(heartbeat), 0) != sizeof(heartbeat)) {
+    fail("sending a heartbeat");
+  }
+  check("reading", amqp_simple_wait_frame_noblock(conn, &frame, &poll));
+  expect_nothing();
+  usleep(40000);
+  if (send(peer, heartbeat, sizeof(heartbeat), 0) != sizeof(heartbeat)) {
+    fail("sending a heartbeat");
+  }
+  check("reading", amqp_simple_wait_frame_noblock(conn, &frame, &poll));
+  if (AMQP_FRAME_HEARTBEAT != frame.frame_type) {
+    fail("Expected a heartbeat frame");
+  }
+  expect_message();
+
+  check("batching", amqp_set_publish_batching(conn, 0, 0, NULL));
+  amqp_destroy_connection(conn);
+  close(peer);
+  return 0;
+}
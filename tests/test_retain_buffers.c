@@ -0,0 +1,301 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_tcp_socket.h>
+
+/*
+ * Retains the buffers of body frames read on a channel, copied into the
+ * channel pool or decoded in place, and reads on while the channel's
+ * buffers are released again. The retained frames have to keep their
+ * contents past the next reads and releases and past the connection, and
+ * the last release of the handle has to free what the connection left
+ * behind. Buffers can't be retained while a frame is queued on the channel.
+ */
+
+#define FRAMES 12
+#define FRAME_SIZE 1000
+
+static long live_blocks;
+static int peer;
+static amqp_connection_state_t conn;
+static amqp_frame_t frames[FRAMES];
+
+static void *AMQP_CALL count_malloc(void *user_data, size_t size)
+{
+  void *block = malloc(size);
+  (void)user_data;
+  if (block != NULL) {
+    live_blocks++;
+  }
+  return block;
+}
+
+static void *AMQP_CALL count_calloc(void *user_data, size_t nmemb,
+                                    size_t size)
+{
+  void *block = calloc(nmemb, size);
+  (void)user_data;
+  if (block != NULL) {
+    live_blocks++;
+  }
+  return block;
+}
+
+static void *AMQP_CALL count_realloc(void *user_data, void *ptr,
+                                     size_t size)
+{
+  void *block = realloc(ptr, size);
+  (void)user_data;
+  if (block != NULL && ptr == NULL) {
+    live_blocks++;
+  }
+  return block;
+}
+
+static void AMQP_CALL count_free(void *user_data, void *ptr)
+{
+  (void)user_data;
+  if (ptr != NULL) {
+    live_blocks--;
+  }
+  free(ptr);
+}
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void check(const char *what, int res)
+{
+  if (res != AMQP_STATUS_OK) {
+    fprintf(stderr, "%s: %s\n", what, amqp_error_string2(res));
+    abort();
+  }
+}
+
+static unsigned char pattern(int n, size_t i)
+{
+  return (unsigned char)(n * 31 + i * 7 + i / 251);
+}
+
+/* Writes body frames first to last on channel, frame n carrying
+ * FRAME_SIZE bytes of pattern n */
+static void send_frames(amqp_channel_t channel, int first, int last)
+{
+  unsigned char frame[FRAME_SIZE + 8];
+  int n;
+  size_t i;
+
+  for (n = first; n <= last; ++n) {
+    frame[0] = AMQP_FRAME_BODY;
+    frame[1] = (unsigned char)(channel >> 8);
+    frame[2] = (unsigned char)channel;
+    frame[3] = 0;
+    frame[4] = 0;
+    frame[5] = (unsigned char)(FRAME_SIZE >> 8);
+    frame[6] = (unsigned char)FRAME_SIZE;
+    for (i = 0; i < FRAME_SIZE; ++i) {
+      frame[7 + i] = pattern(n, i);
+    }
+    frame[7 + FRAME_SIZE] = AMQP_FRAME_END;
+    if (send(peer, frame, sizeof(frame), 0) != sizeof(frame)) {
+      fail("sending frames");
+    }
+  }
+}
+
+static void send_flow_ok(amqp_channel_t channel)
+{
+  unsigned char frame[13];
+  amqp_channel_flow_ok_t flow_ok;
+  amqp_bytes_t encoded;
+
+  flow_ok.active = 1;
+  frame[0] = AMQP_FRAME_METHOD;
+  frame[1] = (unsigned char)(channel >> 8);
+  frame[2] = (unsigned char)channel;
+  frame[3] = 0;
+  frame[4] = 0;
+  frame[5] = 0;
+  frame[6] = 5;
+  frame[7] = 0;
+  frame[8] = 20;
+  frame[9] = 0;
+  frame[10] = 21;
+  encoded.bytes = frame + 11;
+  encoded.len = 1;
+  if (amqp_encode_method(AMQP_CHANNEL_FLOW_OK_METHOD, &flow_ok, encoded)
+      != 1) {
+    fail("encoding channel.flow-ok");
+  }
+  frame[12] = AMQP_FRAME_END;
+  if (send(peer, frame, sizeof(frame), 0) != sizeof(frame)) {
+    fail("sending channel.flow-ok");
+  }
+}
+
+static void read_frames(amqp_channel_t channel, int first, int last)
+{
+  int n;
+
+  for (n = first; n <= last; ++n) {
+    check("reading a frame", amqp_simple_wait_frame(conn, &frames[n]));
+    if (AMQP_FRAME_BODY != frames[n].frame_type
+        || channel != frames[n].channel
+        || FRAME_SIZE != frames[n].payload.body_fragment.len) {
+      fail("Unexpected frame");
+    }
+  }
+}
+
+static void check_frames(int first, int last)
+{
+  int n;
+  size_t i;
+
+  for (n = first; n <= last; ++n) {
+    const unsigned char *body = frames[n].payload.body_fragment.bytes;
+    for (i = 0; i < FRAME_SIZE; ++i) {
+      if (body[i] != pattern(n, i)) {
+        fprintf(stderr, "Frame %d changed at byte %d\n", n, (int)i);
+        abort();
+      }
+    }
+  }
+}
+
+static void run(amqp_boolean_t decode_in_place)
+{
+  amqp_retained_buffers_t *retained;
+  amqp_retained_buffers_t *other;
+  amqp_socket_t *socket;
+  amqp_frame_t frame;
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    fail("socketpair");
+  }
+  peer = sv[1];
+
+  conn = amqp_new_connection();
+  socket = amqp_tcp_socket_new();
+  if (!conn || !socket) {
+    fail("creating the connection");
+  }
+  amqp_tcp_socket_set_sockfd(socket, sv[0]);
+  amqp_set_socket(conn, socket);
+  amqp_set_decode_in_place(conn, decode_in_place);
+  if (send(peer, "AMQP\0\0\x09\x01", 8, 0) != 8) {
+    fail("sending the protocol header");
+  }
+  if (amqp_simple_wait_frame(conn, &frame) || 'A' != frame.frame_type) {
+    fail("expected the protocol header");
+  }
+  check("tuning", amqp_tune_connection(conn, 0, 4096, 0));
+
+  send_frames(1, 0, 3);
+  read_frames(1, 0, 3);
+  check("retaining", amqp_retain_buffers_on_channel(conn, 1, &retained));
+  amqp_retained_buffers_add_ref(retained);
+
+  /* The channel carries on with other memory */
+  send_frames(1, 4, 7);
+  read_frames(1, 4, 7);
+  check_frames(0, 7);
+  amqp_maybe_release_buffers_on_channel(conn, 1);
+  send_frames(1, 8, 11);
+  read_frames(1, 8, 11);
+  check_frames(0, 3);
+  check_frames(8, 11);
+
+  /* Not with a frame queued on the channel */
+  send_frames(1, 4, 4);
+  send_flow_ok(2);
+  if (NULL == amqp_channel_flow(conn, 2, 1)) {
+    fail("Expected channel.flow-ok");
+  }
+  other = retained;
+  if (amqp_retain_buffers_on_channel(conn, 1, &other)
+      != AMQP_STATUS_UNEXPECTED_STATE || other != NULL) {
+    fail("Expected nothing to be retained with a frame queued");
+  }
+  read_frames(1, 4, 4);
+  check("retaining", amqp_retain_buffers_on_channel(conn, 1, &other));
+  amqp_release_retained_buffers(other);
+
+  /* The retained frames outlive the connection, the handle holds the
+   * last of its memory */
+  amqp_destroy_connection(conn);
+  close(peer);
+  check_frames(0, 3);
+  amqp_release_retained_buffers(retained);
+  check_frames(0, 3);
+  if (live_blocks == 0) {
+    fail("Expected the handle to still hold memory");
+  }
+  amqp_release_retained_buffers(retained);
+  if (live_blocks != 0) {
+    fprintf(stderr, "%ld blocks left after the last release\n",
+            live_blocks);
+    abort();
+  }
+}
+
+int main(void)
+{
+  amqp_allocator_t allocator = {
+    count_malloc, count_calloc, count_realloc, count_free, NULL
+  };
+
+  if (amqp_set_allocator(&allocator) != AMQP_STATUS_OK) {
+    fail("setting the allocator");
+  }
+  run(0);
+  run(1);
+  return 0;
+}
@@ -0,0 +1,406 @@
+/* vim:set ft=c ts=2 sw=2 sts=2 et cindent: */
+/*
+ * ***** BEGIN LICENSE BLOCK *****
+ * Version: MIT
+ *
+ * Portions created by Alan Antonuk are Copyright (c) 2012-2013
+ * Alan Antonuk. All Rights Reserved.
+ *
+ * Portions created by VMware are Copyright (c) 2007-2012 VMware, Inc.
+ * All Rights Reserved.
+ *
+ * Portions created by Tony Garnock-Jones are Copyright (c) 2009-2010
+ * VMware, Inc. and Tony Garnock-Jones. All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * ***** END LICENSE BLOCK *****
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <amqp.h>
+#include <amqp_framing.h>
+#include <amqp_ssl_socket.h>
+
+/*
+ * Publishes messages over an SSL socket to a TLS server in a child process,
+ * which checks the frames it decrypts and replies with a channel.open-ok
+ * frame for the client to read. Run once with kernel TLS requested and
+ * once without; where the kernel or OpenSSL can't do kTLS the first run
+ * covers the fallback to encrypting in user space. Then two connections
+ * share a context, and the second one has to resume the session of the
+ * first. A connection the server drops without a TLS close must not leave
+ * a session behind that the next one resumes.
+ */
+
+static const size_t body_sizes[] = {
+  0, 1, 1000, 16383, 16384, 16385, 131064, 131065, 1048576 + 3
+};
+
+#define MAX_BODY_SIZE (1048576 + 3)
+
+static EVP_PKEY *pkey;
+static X509 *cert;
+/* created before forking so that every server has the same ticket keys */
+static SSL_CTX *server_ctx;
+/* one port for all runs, as sessions are cached per host and port */
+static int listener;
+static int port;
+static char cert_path[] = "/tmp/test_ssl_loopback.XXXXXX";
+static char *body;
+
+static void fail(const char *what)
+{
+  fprintf(stderr, "%s\n", what);
+  abort();
+}
+
+static void make_certificate(void)
+{
+  EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+  FILE *f;
+  int fd;
+
+  if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0
+      || EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) <= 0
+      || EVP_PKEY_keygen(ctx, &pkey) <= 0) {
+    fail("generating key");
+  }
+  EVP_PKEY_CTX_free(ctx);
+
+  cert = X509_new();
+  if (!cert) {
+    fail("allocating certificate");
+  }
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_get_notBefore(cert), 0);
+  X509_gmtime_adj(X509_get_notAfter(cert), 3600);
+  X509_set_pubkey(cert, pkey);
+  X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, X509_get_subject_name(cert));
+  if (!X509_sign(cert, pkey, EVP_sha256())) {
+    fail("signing certificate");
+  }
+
+  fd = mkstemp(cert_path);
+  f = fd < 0 ? NULL : fdopen(fd, "w");
+  if (!f || !PEM_write_X509(f, cert) || fclose(f)) {
+    fail("writing certificate");
+  }
+}
+
+static void read_all(SSL *ssl, void *buf, size_t len)
+{
+  size_t got = 0;
+
+  while (got < len) {
+    int res = SSL_read(ssl, (char *)buf + got, (int)(len - got));
+    if (res <= 0) {
+      fail("server: SSL_read failed");
+    }
+    got += res;
+  }
+}
+
+/* Reads one frame into buf and returns its type */
+static int read_frame(SSL *ssl, char *buf, size_t *len)
+{
+  unsigned char header[7];
+  unsigned char frame_end;
+
+  read_all(ssl, header, sizeof(header));
+  *len = ((size_t)header[3] << 24) | (header[4] << 16) | (header[5] << 8)
+         | header[6];
+  if (*len > MAX_BODY_SIZE) {
+    fail("server: frame too large");
+  }
+  read_all(ssl, buf, *len);
+  read_all(ssl, &frame_end, 1);
+  if (AMQP_FRAME_END != frame_end) {
+    fail("server: bad frame end");
+  }
+  return header[0];
+}
+
+static void serve(int fd)
+{
+  static const unsigned char reply[] = {
+    'A', 'M', 'Q', 'P', 0, 0, 9, 1,
+    AMQP_FRAME_METHOD, 0, 1, 0, 0, 0, 8,
+    0, 20, 0, 11, 0, 0, 0, 0, AMQP_FRAME_END
+  };
+  char *buf = malloc(MAX_BODY_SIZE);
+  char *got = malloc(MAX_BODY_SIZE);
+  SSL *ssl;
+  size_t i;
+
+  if (!buf || !got) {
+    fail("server: allocating buffers");
+  }
+  ssl = SSL_new(server_ctx);
+  if (!ssl || !SSL_set_fd(ssl, fd) || SSL_accept(ssl) <= 0) {
+    fail("server: SSL_accept failed");
+  }
+
+  for (i = 0; i < sizeof(body_sizes) / sizeof(body_sizes[0]); i++) {
+    size_t received = 0;
+    size_t len;
+
+    if (AMQP_FRAME_METHOD != read_frame(ssl, buf, &len)) {
+      fail("server: expected a method frame");
+    }
+    if (AMQP_FRAME_HEADER != read_frame(ssl, buf, &len)) {
+      fail("server: expected a header frame");
+    }
+    while (received < body_sizes[i]) {
+      if (AMQP_FRAME_BODY != read_frame(ssl, got + received, &len)) {
+        fail("server: expected a body frame");
+      }
+      received += len;
+    }
+    if (received != body_sizes[i] || memcmp(got, body, received)) {
+      fail("server: body mismatch");
+    }
+  }
+
+  if (SSL_write(ssl, reply, sizeof(reply)) != (int)sizeof(reply)) {
+    fail("server: SSL_write failed");
+  }
+  SSL_shutdown(ssl);
+  _exit(0);
+}
+
+/* Sends the protocol header, then closes the connection without a TLS
+ * close_notify */
+static void serve_and_drop(int fd)
+{
+  static const unsigned char reply[] = { 'A', 'M', 'Q', 'P', 0, 0, 9, 1 };
+  SSL *ssl = SSL_new(server_ctx);
+
+  if (!ssl || !SSL_set_fd(ssl, fd) || SSL_accept(ssl) <= 0) {
+    fail("server: SSL_accept failed");
+  }
+  if (SSL_write(ssl, reply, sizeof(reply)) != (int)sizeof(reply)) {
+    fail("server: SSL_write failed");
+  }
+  close(fd);
+  _exit(0);
+}
+
+static void run_dropped(amqp_ssl_context_t *context)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *ssl_socket;
+  amqp_frame_t frame;
+  int status;
+  pid_t child;
+
+  child = fork();
+  if (child < 0) {
+    fail("fork failed");
+  }
+  if (0 == child) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      fail("server: accept failed");
+    }
+    serve_and_drop(fd);
+  }
+
+  ssl_socket = amqp_ssl_socket_new_with_context(context);
+  if (!ssl_socket) {
+    fail("creating SSL socket");
+  }
+  amqp_ssl_socket_set_verify(ssl_socket, 0);
+  if (amqp_socket_open(ssl_socket, "127.0.0.1", port)) {
+    fail("amqp_socket_open failed");
+  }
+  amqp_set_socket(conn, ssl_socket);
+
+  if (amqp_simple_wait_frame(conn, &frame) || 'A' != frame.frame_type) {
+    fail("expected the protocol header");
+  }
+  if (AMQP_STATUS_OK == amqp_simple_wait_frame(conn, &frame)) {
+    fail("expected the dropped connection to fail");
+  }
+
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    fail("server failed");
+  }
+  amqp_destroy_connection(conn);
+}
+
+static amqp_boolean_t run(amqp_ssl_context_t *context, amqp_boolean_t ktls)
+{
+  amqp_connection_state_t conn = amqp_new_connection();
+  amqp_socket_t *ssl_socket;
+  amqp_boolean_t reused;
+  amqp_frame_t frame;
+  int status;
+  pid_t child;
+  size_t i;
+
+  child = fork();
+  if (child < 0) {
+    fail("fork failed");
+  }
+  if (0 == child) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      fail("server: accept failed");
+    }
+    serve(fd);
+  }
+
+  if (context) {
+    ssl_socket = amqp_ssl_socket_new_with_context(context);
+  } else {
+    ssl_socket = amqp_ssl_socket_new();
+    if (ssl_socket && amqp_ssl_socket_set_cacert(ssl_socket, cert_path)) {
+      fail("setting the CA certificate");
+    }
+  }
+  if (!ssl_socket) {
+    fail("creating SSL socket");
+  }
+  amqp_ssl_socket_set_verify(ssl_socket, 0);
+  amqp_ssl_socket_set_ktls(ssl_socket, ktls);
+  if (amqp_socket_open(ssl_socket, "127.0.0.1", port)) {
+    fail("amqp_socket_open failed");
+  }
+  amqp_set_socket(conn, ssl_socket);
+  printf("kTLS %s: send %s, recv %s; session resumed: %s\n",
+         ktls ? "requested" : "off",
+         amqp_ssl_socket_get_ktls(ssl_socket) & AMQP_SSL_KTLS_SEND ? "yes" : "no",
+         amqp_ssl_socket_get_ktls(ssl_socket) & AMQP_SSL_KTLS_RECV ? "yes" : "no",
+         amqp_ssl_socket_session_reused(ssl_socket) ? "yes" : "no");
+  if (!ktls && amqp_ssl_socket_get_ktls(ssl_socket)) {
+    fail("kTLS in use although it wasn't requested");
+  }
+
+  for (i = 0; i < sizeof(body_sizes) / sizeof(body_sizes[0]); i++) {
+    amqp_bytes_t message;
+    message.bytes = body;
+    message.len = body_sizes[i];
+    if (amqp_basic_publish(conn, 1, amqp_cstring_bytes("amq.direct"),
+                           amqp_cstring_bytes("test"), 0, 0, NULL,
+                           message)) {
+      fail("amqp_basic_publish failed");
+    }
+  }
+
+  /* The protocol header the server sends first comes back as a pseudo
+   * frame of type 'A' */
+  if (amqp_simple_wait_frame(conn, &frame) || 'A' != frame.frame_type) {
+    fail("expected the protocol header");
+  }
+  if (amqp_simple_wait_frame(conn, &frame)
+      || AMQP_FRAME_METHOD != frame.frame_type
+      || AMQP_CHANNEL_OPEN_OK_METHOD != frame.payload.method.id) {
+    fail("expected channel.open-ok");
+  }
+
+  if (waitpid(child, &status, 0) != child || !WIFEXITED(status)
+      || WEXITSTATUS(status)) {
+    fail("server failed");
+  }
+  reused = amqp_ssl_socket_session_reused(ssl_socket);
+  amqp_destroy_connection(conn);
+  return reused;
+}
+
+int main(void)
+{
+  amqp_ssl_context_t *context;
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  size_t i;
+
+  SSL_library_init();
+  body = malloc(MAX_BODY_SIZE);
+  if (!body) {
+    fail("allocating body");
+  }
+  for (i = 0; i < MAX_BODY_SIZE; i++) {
+    body[i] = (char)(i * 7 + i / 4093);
+  }
+  make_certificate();
+  server_ctx = SSL_CTX_new(SSLv23_server_method());
+  if (!server_ctx || 1 != SSL_CTX_use_certificate(server_ctx, cert)
+      || 1 != SSL_CTX_use_PrivateKey(server_ctx, pkey)) {
+    fail("setting up server context");
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr))
+      || listen(listener, 1)
+      || getsockname(listener, (struct sockaddr *)&addr, &addr_len)) {
+    fail("listening on loopback");
+  }
+  port = ntohs(addr.sin_port);
+
+  run(NULL, 1);
+  run(NULL, 0);
+
+  context = amqp_ssl_context_new();
+  if (!context || amqp_ssl_context_set_cacert(context, cert_path)) {
+    fail("setting up SSL context");
+  }
+  if (run(context, 0)) {
+    fail("first connection claims to have resumed a session");
+  }
+  if (!run(context, 0)) {
+    fail("second connection did not resume the session");
+  }
+  run_dropped(context);
+  if (run(context, 0)) {
+    fail("resumed the session of a connection that was dropped");
+  }
+  if (!run(context, 0)) {
+    fail("did not resume the session after a dropped connection");
+  }
+  amqp_ssl_context_release(context);
+
+  close(listener);
+  unlink(cert_path);
+  free(body);
+  return 0;
+}
@@ -410,6 +410,116 @@ static void test_table_codec(FILE *out)
   empty_amqp_pool(&pool);
 }
 
+static void test_table_iter(void)
+{
+  amqp_pool_t pool;
+  amqp_table_iter_t iter;
+  amqp_table_iter_t child;
+  amqp_field_value_t value;
+  amqp_bytes_t encoded;
+  amqp_bytes_t key;
+  uint8_t kind;
+  size_t offset = 0;
+  int entries = 0;
+  int result;
+
+  encoded.len = sizeof(pre_encoded_table);
+  encoded.bytes = pre_encoded_table;
+
+  result = amqp_table_iter_init(&iter, encoded, &offset);
+  if (result < 0) {
+    die("Table iterator init failed: %s", amqp_error_string2(result));
+  }
+  if (offset != sizeof(pre_encoded_table)) {
+    die("Offset should be %ld, was %ld", (long)sizeof(pre_encoded_table),
+        (long)offset);
+  }
+
+  while ((result = amqp_table_iter_next(&iter, &key, &kind)) > 0) {
+    entries++;
+  }
+  if (result < 0) {
+    die("Table iteration failed: %s", amqp_error_string2(result));
+  }
+  if (entries != 14) {
+    die("Table iteration should find 14 entries, found %d", entries);
+  }
+
+  init_amqp_pool(&pool, 4096);
+
+  offset = 0;
+  amqp_table_iter_init(&iter, encoded, &offset);
+  result = amqp_table_iter_find(&iter, amqp_cstring_bytes("signedint"), &kind);
+  if (result != 1 || kind != AMQP_FIELD_KIND_I32) {
+    die("Table iterator did not find signedint");
+  }
+  result = amqp_table_iter_value(&iter, &pool, &value);
+  if (result < 0 || value.value.i32 != 12345) {
+    die("Table iterator decoded signedint wrongly");
+  }
+
+  /* finds continue from the current position */
+  result = amqp_table_iter_find(&iter, amqp_cstring_bytes("table"), &kind);
+  if (result != 1 || kind != AMQP_FIELD_KIND_TABLE) {
+    die("Table iterator did not find table");
+  }
+  result = amqp_table_iter_child(&iter, &child);
+  if (result < 0) {
+    die("Table iterator child init failed: %s", amqp_error_string2(result));
+  }
+  result = amqp_table_iter_find(&child, amqp_cstring_bytes("two"), &kind);
+  if (result != 1 || kind != AMQP_FIELD_KIND_UTF8) {
+    die("Table iterator did not find nested key");
+  }
+  result = amqp_table_iter_value(&child, &pool, &value);
+  if (result < 0 || value.value.bytes.len != strlen("A long string")
+      || memcmp(value.value.bytes.bytes, "A long string", value.value.bytes.len)) {
+    die("Table iterator decoded nested string wrongly");
+  }
+
+  result = amqp_table_iter_find(&iter, amqp_cstring_bytes("signedint"), &kind);
+  if (result != 0) {
+    die("Table iterator found an entry it had already passed");
+  }
+
+  {
+    amqp_basic_properties_t properties;
+    amqp_table_entry_t header;
+    uint8_t raw_buffer[256];
+    amqp_bytes_t raw;
+
+    memset(&properties, 0, sizeof(properties));
+    properties._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_HEADERS_FLAG
+                        | AMQP_BASIC_DELIVERY_MODE_FLAG;
+    properties.content_type = amqp_cstring_bytes("text/plain");
+    properties.delivery_mode = 2;
+    header.key = amqp_cstring_bytes("route");
+    header.value.kind = AMQP_FIELD_KIND_UTF8;
+    header.value.value.bytes = amqp_cstring_bytes("eu-west");
+    properties.headers.num_entries = 1;
+    properties.headers.entries = &header;
+
+    raw.bytes = raw_buffer;
+    raw.len = sizeof(raw_buffer);
+    result = amqp_encode_properties(AMQP_BASIC_CLASS, &properties, raw);
+    if (result < 0) {
+      die("Properties encoding failed: %s", amqp_error_string2(result));
+    }
+    raw.len = result;
+
+    result = amqp_table_iter_init_headers(&iter, raw);
+    if (result != 1) {
+      die("Table iterator did not find the headers table");
+    }
+    result = amqp_table_iter_find(&iter, amqp_cstring_bytes("route"), &kind);
+    if (result != 1 || kind != AMQP_FIELD_KIND_UTF8) {
+      die("Table iterator did not find header");
+    }
+  }
+
+  empty_amqp_pool(&pool);
+}
+
 #define CHUNK_SIZE 4096
 
 static int compare_files(FILE *f1_in, FILE *f2_in)
@@ -457,6 +567,7 @@ int main(void)
   test_table_codec(out);
   fprintf(out, "----------\n");
   test_dump_value(out);
+  test_table_iter();
 
   if (srcdir == NULL) {
     srcdir = ".";